@@ -0,0 +1,580 @@
+/*
+	Copyright (c) 2009, Scott Ellis
+	All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+		* Redistributions of source code must retain the above copyright
+		  notice, this list of conditions and the following disclaimer.
+		* Redistributions in binary form must reproduce the above copyright
+		  notice, this list of conditions and the following disclaimer in the
+		  documentation and/or other materials provided with the distribution.
+		* Neither the name of the <organization> nor the
+		  names of its contributors may be used to endorse or promote products
+		  derived from this software without specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY Scott Ellis ''AS IS'' AND ANY
+	EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+	WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+	DISCLAIMED. IN NO EVENT SHALL Scott Ellis BE LIABLE FOR ANY
+	DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+	(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+	LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+	ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+	(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+	SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/*
+ * Animations rendered on the host. Each frame is computed from the time
+ * since the start into one color plane per channel, and only the leds 
+ * whose color changed are written, all in one batched transfer.
+ *
+ * An RGB fade that the firmware can run by itself within a frame or so
+ * of the requested time is handed to the leds instead, a set-rgb to the
+ * start color, a set-fade-speed and a fade-rgb, three writes per led no
+ * matter how long the fade is. The firmware steps every channel by the
+ * same amount each tick, so only fades where every channel that changes
+ * changes by the same amount look the same done that way.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+
+#include "utility.h"
+#include "i2c_functions.h"
+#include "i2c_blinkm.h"
+#include "blinkm_cache.h"
+#include "blinkm_color.h"
+#include "blinkm_regs.h"
+#include "blinkm_anim.h"
+
+static void plan_hardware_fade(struct blinkm_anim *a, struct blinkm_effect *e);
+static void render_effect(struct blinkm_anim *a, struct blinkm_effect *e, uint64_t t);
+static uint32_t progress(struct blinkm_effect *e, uint64_t t);
+static uint8_t lerp(uint8_t from, uint8_t to, uint32_t p);
+static void set_pixel(struct blinkm_anim *a, int i, uint8_t r, uint8_t g, uint8_t b);
+static int push_frame(struct blinkm_anim *a, struct blinkm_anim_stats *stats);
+static int send_batch(struct blinkm_anim *a, struct blinkm_batch *b, const int *pos, 
+			struct blinkm_anim_stats *stats);
+static int parse_effect(char *buff, struct blinkm_effect *e, int num_leds, int line_no);
+static int parse_color(const char *token, uint8_t *color);
+
+
+int blinkm_anim_init(struct blinkm_anim *a, struct i2c_session *bus, const uint8_t *leds, 
+		int num_leds, int fps)
+{
+	if (!a || num_leds < 1 || num_leds > BLINKM_ANIM_MAX_LEDS)
+		return -1;
+
+	memset(a, 0, sizeof(struct blinkm_anim));
+
+	a->_bus = bus;
+	a->_num_leds = num_leds;
+	memcpy(a->_led, leds, num_leds);
+	a->_fps = fps > 0 ? fps : BLINKM_ANIM_DEFAULT_FPS;
+	a->_hw_fades = 1;
+
+	return 0;
+}
+
+/*
+ * Effects are kept in start order, a later effect draws over an earlier
+ * one on the leds they share.
+ */
+int blinkm_anim_add(struct blinkm_anim *a, const struct blinkm_effect *e)
+{
+	int i;
+
+	if (a->_num_effects >= BLINKM_ANIM_MAX_EFFECTS) {
+		fprintf(stderr, "No more than %d effects in an animation\n", BLINKM_ANIM_MAX_EFFECTS);
+		return -1;
+	}
+
+	if (e->_first < 0 || e->_last >= a->_num_leds || e->_first > e->_last) {
+		fprintf(stderr, "Effect leds %d-%d are not in the list of %d\n", 
+			e->_first, e->_last, a->_num_leds);
+		return -1;
+	}
+
+	for (i = a->_num_effects; i > 0 && a->_effect[i - 1]._start > e->_start; i--)
+		a->_effect[i] = a->_effect[i - 1];
+
+	a->_effect[i] = *e;
+	a->_effect[i]._hardware = 0;
+
+	if (a->_effect[i]._type == BLINKM_EFFECT_CHASE && a->_effect[i]._width < 1)
+		a->_effect[i]._width = 1;
+
+	a->_num_effects++;
+
+	return 0;
+}
+
+/*
+ * Effect lines are
+ *
+ *   start_ms duration_ms effect leds from to [width]
+ *
+ * where effect is fade-rgb, fade-hsb, gradient or chase, leds is a 
+ * position in the led list, a first-last range or * for all of them, 
+ * and the colors are r,g,b or h,s,b for fade-hsb. Blank lines and 
+ * anything after a # are ignored.
+ * Return the number of effects added or -1 on a bad line.
+ */
+int blinkm_anim_parse(FILE *fp, struct blinkm_anim *a)
+{
+	struct blinkm_effect e;
+	char buff[256];
+	int line_no, count, result;
+
+	line_no = 0;
+	count = 0;
+
+	while (fgets(buff, sizeof(buff), fp)) {
+		line_no++;
+
+		result = parse_effect(buff, &e, a->_num_leds, line_no);
+
+		if (result < 0)
+			return -1;
+
+		if (result == 0)
+			continue;
+
+		if (blinkm_anim_add(a, &e) < 0)
+			return -1;
+
+		count++;
+	}
+
+	return count;
+}
+
+/*
+ * Draw the frame for time t, in microseconds from the start. Leds no
+ * effect has reached yet keep whatever the last frame left them with.
+ */
+void blinkm_anim_render(struct blinkm_anim *a, uint64_t t)
+{
+	int i;
+
+	for (i = 0; i < a->_num_effects; i++) {
+		if (t >= a->_effect[i]._start)
+			render_effect(a, &a->_effect[i], t);
+	}
+}
+
+/*
+ * Play the effects at _fps until the last one is done. A frame more than
+ * a period late is counted and the animation jumps ahead to the present,
+ * so it always ends on time. Return the number of frames sent or -1.
+ */
+int blinkm_anim_run(struct blinkm_anim *a, struct blinkm_anim_stats *stats)
+{
+	struct timespec deadline;
+	uint64_t start, end, period, next, now, t;
+	int i;
+
+	if (!a || !a->_bus || !stats)
+		return -1;
+
+	memset(stats, 0, sizeof(struct blinkm_anim_stats));
+	memset(a->_owner, 0, sizeof(a->_owner));
+
+	end = 0;
+
+	for (i = 0; i < a->_num_effects; i++) {
+		plan_hardware_fade(a, &a->_effect[i]);
+
+		if (a->_effect[i]._start + a->_effect[i]._usecs > end)
+			end = a->_effect[i]._start + a->_effect[i]._usecs;
+	}
+
+	period = 1000000 / a->_fps;
+	start = monotonic_usecs();
+	next = start;
+
+	for (;;) {
+		t = next - start;
+
+		blinkm_anim_render(a, t);
+
+		if (push_frame(a, stats) < 0)
+			break;
+
+		stats->_frames++;
+
+		if (t >= end)
+			break;
+
+		next += period;
+
+		/* the last frame lands exactly on the end */
+		if (next - start > end)
+			next = start + end;
+
+		now = monotonic_usecs();
+
+		if (now > next + period) {
+			stats->_late++;
+			next = now - start > end ? start + end : now;
+		}
+		else if (now < next) {
+			deadline.tv_sec = next / 1000000;
+			deadline.tv_nsec = (next % 1000000) * 1000;
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+		}
+	}
+
+	stats->_msecs = (monotonic_usecs() - start) / 1000.0;
+
+	return stats->_frames;
+}
+
+/*
+ * A device fade is used when every channel that changes moves the same
+ * distance and some fade speed finishes within a frame, or a tenth of 
+ * the fade, of the requested time.
+ */
+static void plan_hardware_fade(struct blinkm_anim *a, struct blinkm_effect *e)
+{
+	uint64_t ticks, actual, slack, period;
+	int i, d, dist, speed;
+
+	e->_hardware = 0;
+
+	if (!a->_hw_fades || e->_type != BLINKM_EFFECT_FADE_RGB || e->_usecs == 0)
+		return;
+
+	dist = 0;
+
+	for (i = 0; i < 3; i++) {
+		d = abs(e->_to[i] - e->_from[i]);
+
+		if (d == 0)
+			continue;
+
+		if (dist && d != dist)
+			return;
+
+		dist = d;
+	}
+
+	if (dist == 0)
+		return;
+
+	ticks = e->_usecs / BLINKM_FADE_TICK_USECS;
+
+	if (ticks < 1)
+		ticks = 1;
+
+	speed = (dist + ticks - 1) / ticks;
+
+	if (speed > 255)
+		speed = 255;
+
+	actual = ((dist + speed - 1) / speed) * BLINKM_FADE_TICK_USECS;
+
+	period = 1000000 / a->_fps;
+	slack = e->_usecs / 10 > period ? e->_usecs / 10 : period;
+
+	if (actual > e->_usecs + slack || actual + slack < e->_usecs)
+		return;
+
+	e->_hardware = 1;
+	e->_speed = speed;
+}
+
+static void render_effect(struct blinkm_anim *a, struct blinkm_effect *e, uint64_t t)
+{
+	uint8_t rgb[3], hsb[3];
+	uint32_t p, q;
+	int i, n, d, head;
+
+	p = progress(e, t);
+	n = e->_last - e->_first + 1;
+
+	switch (e->_type) {
+	case BLINKM_EFFECT_FADE_RGB:
+		for (i = e->_first; i <= e->_last; i++)
+			set_pixel(a, i, lerp(e->_from[0], e->_to[0], p), 
+				lerp(e->_from[1], e->_to[1], p), lerp(e->_from[2], e->_to[2], p));
+
+		break;
+
+	case BLINKM_EFFECT_FADE_HSB:
+		/* the short way around the hue circle */
+		d = e->_to[0] - e->_from[0];
+
+		if (d > 127)
+			d -= 256;
+		else if (d < -128)
+			d += 256;
+
+		hsb[0] = (uint8_t) (e->_from[0] + ((d * (int64_t) p) >> 16));
+		hsb[1] = lerp(e->_from[1], e->_to[1], p);
+		hsb[2] = lerp(e->_from[2], e->_to[2], p);
+
+		blinkm_hsb_to_rgb(hsb[0], hsb[1], hsb[2], rgb);
+
+		for (i = e->_first; i <= e->_last; i++)
+			set_pixel(a, i, rgb[0], rgb[1], rgb[2]);
+
+		break;
+
+	case BLINKM_EFFECT_GRADIENT:
+		for (i = e->_first; i <= e->_last; i++) {
+			q = n > 1 ? ((uint32_t) (i - e->_first) << 16) / (n - 1) : 0;
+			set_pixel(a, i, lerp(e->_from[0], e->_to[0], q), 
+				lerp(e->_from[1], e->_to[1], q), lerp(e->_from[2], e->_to[2], q));
+		}
+
+		break;
+
+	case BLINKM_EFFECT_CHASE:
+		/* the head runs far enough past the last led for the tail to clear */
+		head = e->_first + (int) (((uint64_t) p * (n + e->_width - 1)) >> 16);
+
+		for (i = e->_first; i <= e->_last; i++) {
+			d = head - i;
+
+			if (d < 0 || d >= e->_width) {
+				set_pixel(a, i, e->_to[0], e->_to[1], e->_to[2]);
+			}
+			else {
+				q = ((uint32_t) (e->_width - d) << 16) / e->_width;
+				set_pixel(a, i, lerp(e->_to[0], e->_from[0], q), 
+					lerp(e->_to[1], e->_from[1], q), lerp(e->_to[2], e->_from[2], q));
+			}
+		}
+
+		break;
+	}
+
+	for (i = e->_first; i <= e->_last; i++)
+		a->_owner[i] = e - a->_effect + 1;
+}
+
+/* 
+ * How far along the effect is at time t, 0 to 65536.
+ */
+static uint32_t progress(struct blinkm_effect *e, uint64_t t)
+{
+	if (e->_usecs == 0 || t >= e->_start + e->_usecs)
+		return 65536;
+
+	return (uint32_t) (((t - e->_start) << 16) / e->_usecs);
+}
+
+static uint8_t lerp(uint8_t from, uint8_t to, uint32_t p)
+{
+	return (uint8_t) (from + (((to - from) * (int64_t) p) >> 16));
+}
+
+static void set_pixel(struct blinkm_anim *a, int i, uint8_t r, uint8_t g, uint8_t b)
+{
+	a->_frame._r[i] = r;
+	a->_frame._g[i] = g;
+	a->_frame._b[i] = b;
+}
+
+/*
+ * Write the leds whose color changed since they were last sent. A led 
+ * that belongs to a device fade gets the fade commands once instead.
+ */
+static int push_frame(struct blinkm_anim *a, struct blinkm_anim_stats *stats)
+{
+	struct blinkm_batch batch;
+	struct blinkm_effect *e;
+	int pos[BLINKM_MAX_BATCH];
+	int i, n;
+
+	blinkm_batch_init(&batch);
+
+	for (i = 0; i < a->_num_leds; i++) {
+		if (!a->_owner[i])
+			continue;
+
+		/* room for the three fade commands */
+		if (batch._count > BLINKM_MAX_BATCH - 3) {
+			if (send_batch(a, &batch, pos, stats) < 0)
+				return -1;
+
+			blinkm_batch_init(&batch);
+		}
+
+		e = &a->_effect[a->_owner[i] - 1];
+		n = batch._count;
+
+		if (e->_hardware) {
+			if (a->_known[i] && a->_shown._r[i] == e->_to[0] 
+					&& a->_shown._g[i] == e->_to[1] && a->_shown._b[i] == e->_to[2])
+				continue;
+
+			if (!a->_known[i] || a->_shown._r[i] != e->_from[0] 
+					|| a->_shown._g[i] != e->_from[1] || a->_shown._b[i] != e->_from[2])
+				blinkm_batch_add(&batch, a->_led[i], SET_RGB_COLOR_NOW, 
+					e->_from[0], e->_from[1], e->_from[2]);
+
+			blinkm_batch_add(&batch, a->_led[i], SET_FADE_SPEED, e->_speed, 0, 0);
+			blinkm_batch_add(&batch, a->_led[i], FADE_TO_RGB_COLOR, 
+				e->_to[0], e->_to[1], e->_to[2]);
+
+			a->_shown._r[i] = e->_to[0];
+			a->_shown._g[i] = e->_to[1];
+			a->_shown._b[i] = e->_to[2];
+			stats->_hardware++;
+		}
+		else {
+			if (a->_known[i] && a->_shown._r[i] == a->_frame._r[i] 
+					&& a->_shown._g[i] == a->_frame._g[i] && a->_shown._b[i] == a->_frame._b[i])
+				continue;
+
+			blinkm_batch_add(&batch, a->_led[i], SET_RGB_COLOR_NOW, 
+				a->_frame._r[i], a->_frame._g[i], a->_frame._b[i]);
+
+			a->_shown._r[i] = a->_frame._r[i];
+			a->_shown._g[i] = a->_frame._g[i];
+			a->_shown._b[i] = a->_frame._b[i];
+		}
+
+		a->_known[i] = 1;
+
+		for (; n < batch._count; n++)
+			pos[n] = i;
+	}
+
+	return send_batch(a, &batch, pos, stats);
+}
+
+static int send_batch(struct blinkm_anim *a, struct blinkm_batch *b, const int *pos, 
+			struct blinkm_anim_stats *stats)
+{
+	int i, written, suppressed;
+
+	if (b->_count == 0)
+		return 0;
+
+	suppressed = a->_bus->_cache ? a->_bus->_cache->_suppressed : 0;
+
+	written = blinkm_batch_send(a->_bus, b);
+
+	if (a->_bus->_cache)
+		suppressed = a->_bus->_cache->_suppressed - suppressed;
+
+	stats->_writes += written;
+	stats->_suppressed += suppressed;
+	stats->_failed += b->_count - written - suppressed;
+
+	/* try again next frame */
+	for (i = 0; i < b->_count; i++) {
+		if (!b->_cmd[i]._sent)
+			a->_known[pos[i]] = 0;
+	}
+
+	return written;
+}
+
+/*
+ * Return 1 for an effect, 0 for a blank line or -1 on a bad line.
+ */
+static int parse_effect(char *buff, struct blinkm_effect *e, int num_leds, int line_no)
+{
+	char *p, *token[7], *save, *end;
+	long start, usecs;
+	int n;
+
+	p = strchr(buff, '#');
+
+	if (p)
+		*p = 0;
+
+	n = 0;
+	p = strtok_r(buff, " \t\r\n", &save);
+
+	while (p && n < 7) {
+		token[n++] = p;
+		p = strtok_r(NULL, " \t\r\n", &save);
+	}
+
+	if (n == 0)
+		return 0;
+
+	memset(e, 0, sizeof(struct blinkm_effect));
+
+	if (n < 6) {
+		fprintf(stderr, "Line %d: expected start duration effect leds from to\n", line_no);
+		return -1;
+	}
+
+	start = strtol(token[0], &end, 0);
+
+	if (*end || start < 0) {
+		fprintf(stderr, "Line %d: bad start time %s\n", line_no, token[0]);
+		return -1;
+	}
+
+	usecs = strtol(token[1], &end, 0);
+
+	if (*end || usecs < 0) {
+		fprintf(stderr, "Line %d: bad duration %s\n", line_no, token[1]);
+		return -1;
+	}
+
+	e->_start = (uint64_t) start * 1000;
+	e->_usecs = (uint64_t) usecs * 1000;
+
+	if (!strcasecmp(token[2], "fade-rgb"))
+		e->_type = BLINKM_EFFECT_FADE_RGB;
+	else if (!strcasecmp(token[2], "fade-hsb"))
+		e->_type = BLINKM_EFFECT_FADE_HSB;
+	else if (!strcasecmp(token[2], "gradient"))
+		e->_type = BLINKM_EFFECT_GRADIENT;
+	else if (!strcasecmp(token[2], "chase"))
+		e->_type = BLINKM_EFFECT_CHASE;
+	else {
+		fprintf(stderr, "Line %d: unknown effect %s\n", line_no, token[2]);
+		return -1;
+	}
+
+	if (!strcmp(token[3], "*")) {
+		e->_first = 0;
+		e->_last = num_leds - 1;
+	}
+	else if (sscanf(token[3], "%d-%d", &e->_first, &e->_last) == 1) {
+		e->_last = e->_first;
+	}
+
+	if (parse_color(token[4], e->_from) < 0 || parse_color(token[5], e->_to) < 0) {
+		fprintf(stderr, "Line %d: colors are three 0-255 values like 255,0,0\n", line_no);
+		return -1;
+	}
+
+	if (n > 6)
+		e->_width = strtol(token[6], &end, 0);
+
+	return 1;
+}
+
+static int parse_color(const char *token, uint8_t *color)
+{
+	int c[3];
+
+	if (sscanf(token, "%d,%d,%d", &c[0], &c[1], &c[2]) != 3)
+		return -1;
+
+	if (c[0] < 0 || c[0] > 255 || c[1] < 0 || c[1] > 255 || c[2] < 0 || c[2] > 255)
+		return -1;
+
+	color[0] = c[0];
+	color[1] = c[1];
+	color[2] = c[2];
+
+	return 0;
+}
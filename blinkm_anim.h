@@ -0,0 +1,120 @@
+/*
+	Copyright (c) 2009, Scott Ellis
+	All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+		* Redistributions of source code must retain the above copyright
+		  notice, this list of conditions and the following disclaimer.
+		* Redistributions in binary form must reproduce the above copyright
+		  notice, this list of conditions and the following disclaimer in the
+		  documentation and/or other materials provided with the distribution.
+		* Neither the name of the <organization> nor the
+		  names of its contributors may be used to endorse or promote products
+		  derived from this software without specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY Scott Ellis ''AS IS'' AND ANY
+	EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+	WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+	DISCLAIMED. IN NO EVENT SHALL Scott Ellis BE LIABLE FOR ANY
+	DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+	(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+	LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+	ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+	(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+	SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#ifndef BLINKM_ANIM_H
+#define BLINKM_ANIM_H
+
+#define BLINKM_ANIM_MAX_LEDS 127
+#define BLINKM_ANIM_MAX_EFFECTS 64
+#define BLINKM_ANIM_DEFAULT_FPS 30
+
+/* 
+ * The firmware moves each channel fade speed steps closer every tick,
+ * about 30 ticks a second.
+ */
+#define BLINKM_FADE_TICK_USECS 33333
+
+#define BLINKM_EFFECT_FADE_RGB 1
+#define BLINKM_EFFECT_FADE_HSB 2
+#define BLINKM_EFFECT_GRADIENT 3
+#define BLINKM_EFFECT_CHASE 4
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct i2c_session;
+
+/* one color plane per channel, indexed by position in the led list */
+struct blinkm_frame {
+	uint8_t _r[BLINKM_ANIM_MAX_LEDS];
+	uint8_t _g[BLINKM_ANIM_MAX_LEDS];
+	uint8_t _b[BLINKM_ANIM_MAX_LEDS];
+};
+
+/*
+ * An effect covers the leds at positions _first to _last in the list 
+ * from _start for _usecs, in microseconds from the start of the 
+ * animation. Fades go from _from to _to on every led, gradients spread
+ * _from to _to across the leds, and a chase runs a _width led band of 
+ * _from over a background of _to from the first led to the last. Fade 
+ * HSB colors are h, s, b, everything else is r, g, b. 
+ */
+struct blinkm_effect {
+	int _type;
+	int _first;
+	int _last;
+	uint64_t _start;
+	uint64_t _usecs;
+	uint8_t _from[3];
+	uint8_t _to[3];
+	int _width;
+	/* set by blinkm_anim_run() when a device fade can do the work */
+	int _hardware;
+	uint8_t _speed;
+};
+
+struct blinkm_anim_stats {
+	int _frames;
+	int _late;
+	int _writes;
+	int _suppressed;
+	int _failed;
+	int _hardware;
+	double _msecs;
+};
+
+struct blinkm_anim {
+	struct i2c_session *_bus;
+	int _num_leds;
+	uint8_t _led[BLINKM_ANIM_MAX_LEDS];
+	int _fps;
+	/* let the leds run fades that they can do alone, on by default */
+	int _hw_fades;
+	int _num_effects;
+	struct blinkm_effect _effect[BLINKM_ANIM_MAX_EFFECTS];
+	struct blinkm_frame _frame;
+	/* what each led was last sent, _known is 0 until something was */
+	struct blinkm_frame _shown;
+	uint8_t _known[BLINKM_ANIM_MAX_LEDS];
+	/* the effect that last drew each led plus one, 0 for none yet */
+	uint8_t _owner[BLINKM_ANIM_MAX_LEDS];
+};
+
+int blinkm_anim_init(struct blinkm_anim *a, struct i2c_session *bus, const uint8_t *leds, 
+		int num_leds, int fps);
+int blinkm_anim_add(struct blinkm_anim *a, const struct blinkm_effect *e);
+int blinkm_anim_parse(FILE *fp, struct blinkm_anim *a);
+void blinkm_anim_render(struct blinkm_anim *a, uint64_t t);
+int blinkm_anim_run(struct blinkm_anim *a, struct blinkm_anim_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,906 @@
+/*
+	Copyright (c) 2009, Scott Ellis
+	All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+		* Redistributions of source code must retain the above copyright
+		  notice, this list of conditions and the following disclaimer.
+		* Redistributions in binary form must reproduce the above copyright
+		  notice, this list of conditions and the following disclaimer in the
+		  documentation and/or other materials provided with the distribution.
+		* Neither the name of the <organization> nor the
+		  names of its contributors may be used to endorse or promote products
+		  derived from this software without specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY Scott Ellis ''AS IS'' AND ANY
+	EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+	WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+	DISCLAIMED. IN NO EVENT SHALL Scott Ellis BE LIABLE FOR ANY
+	DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+	(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+	LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+	ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+	(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+	SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/*
+ *  blinkm-bench, runs the common BlinkM workloads against a bus and reports
+ *  latency, throughput, syscalls and bytes on the wire per command.
+ *
+ *  Against a simulated bus the device count is set by the bench, against
+ *  a real bus the first N devices found by a scan are used.
+ *
+ *  With -c it instead times the host color kernels on that many colors,
+ *  scalar against the vector code, no bus needed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "utility.h"
+#include "i2c_functions.h"
+#include "i2c_blinkm.h"
+#include "i2c_scan.h"
+#include "blinkm_regs.h"
+#include "blinkm_queue.h"
+#include "blinkm_color.h"
+
+#define BENCH_DEFAULT_COUNTS "1,8,32,127"
+#define BENCH_DEFAULT_ITERATIONS 100
+#define BENCH_MAX_COUNTS 16
+#define BENCH_SCRIPT_LINES 10
+/* updates per led per operation in the flood workload */
+#define BENCH_FLOOD_UPDATES 8
+#define BENCH_COLOR_ITERATIONS 10000
+
+enum bench_format { FORMAT_TEXT, FORMAT_JSON, FORMAT_CSV };
+
+/* 
+ * One timed operation. Returns the number of blinkm commands it carried, 
+ * less then zero on failure. The per_led workloads get iterations * devices
+ * operations so every device is hit the same number of times.
+ */
+typedef int (*bench_op)(struct i2c_session *bus, const uint8_t *leds, int num_leds, int iter);
+
+struct bench_workload {
+	const char *_name;
+	int _per_led;
+	bench_op _op;
+	/* cleanup after the last operation, may be NULL */
+	void (*_done)(void);
+};
+
+struct bench_result {
+	const char *_workload;
+	int _devices;
+	int _ops;
+	int _cmds;
+	int _errors;
+	double _p50_usecs;
+	double _p99_usecs;
+	double _wall_msecs;
+	double _cmds_per_sec;
+	double _syscalls_per_cmd;
+	double _bytes_per_cmd;
+	uint64_t _bytes;
+	double _bus_msecs;
+	double _bus_cmds_per_sec;
+};
+
+/* input planes, then an output set for each path */
+struct color_planes {
+	int _count;
+	uint8_t *_in[3];
+	uint8_t *_scalar[3];
+	uint8_t *_simd[3];
+	uint8_t _lut[256];
+};
+
+struct color_result {
+	const char *_kernel;
+	int _colors;
+	double _scalar_nsecs;
+	double _simd_nsecs;
+	int _match;
+};
+
+static const char *color_kernels[] = {
+	"hsb-to-rgb", "rgb-to-hsb", "blend", "scale", "gamma-lut"
+};
+
+#define NUM_COLOR_KERNELS (int) (sizeof(color_kernels) / sizeof(color_kernels[0]))
+
+static int op_set_rgb(struct i2c_session *bus, const uint8_t *leds, int num_leds, int iter);
+static int op_set_rgb_batch(struct i2c_session *bus, const uint8_t *leds, int num_leds, int iter);
+static int op_set_rgb_async(struct i2c_session *bus, const uint8_t *leds, int num_leds, int iter);
+static int op_set_rgb_flood(struct i2c_session *bus, const uint8_t *leds, int num_leds, int iter);
+static void stop_async_queue(void);
+static int op_fade_rgb(struct i2c_session *bus, const uint8_t *leds, int num_leds, int iter);
+static int op_get_rgb(struct i2c_session *bus, const uint8_t *leds, int num_leds, int iter);
+static int op_find_leds(struct i2c_session *bus, const uint8_t *leds, int num_leds, int iter);
+static int op_write_script(struct i2c_session *bus, const uint8_t *leds, int num_leds, int iter);
+
+static struct bench_workload workloads[] = {
+	{ "set-rgb", 1, op_set_rgb, NULL },
+	{ "set-rgb-batch", 0, op_set_rgb_batch, NULL },
+	{ "set-rgb-async", 0, op_set_rgb_async, stop_async_queue },
+	{ "set-rgb-flood", 0, op_set_rgb_flood, stop_async_queue },
+	{ "fade-rgb", 1, op_fade_rgb, NULL },
+	{ "get-rgb", 1, op_get_rgb, NULL },
+	{ "find-leds", 0, op_find_leds, NULL },
+	{ "write-script", 0, op_write_script, NULL }
+};
+
+#define NUM_WORKLOADS (int) (sizeof(workloads) / sizeof(workloads[0]))
+
+static int script_delay_ms;
+
+static struct blinkm_queue async_queue;
+static int async_errors;
+
+static void usage(const char *argv_0);
+static int parse_counts(char *arg, int *counts);
+static int workload_selected(const char *list, const char *name);
+static int open_bench_bus(struct i2c_session *bus, const char *bus_name, int devices, 
+			uint8_t *leds);
+static int run_workload(struct i2c_session *bus, struct bench_workload *w, const uint8_t *leds,
+			int num_leds, int iterations, struct bench_result *result);
+static int compare_usecs(const void *a, const void *b);
+static void print_text(FILE *fp, struct bench_result *results, int count);
+static void print_json(FILE *fp, const char *bus_name, int iterations, 
+			struct bench_result *results, int count);
+static void print_csv(FILE *fp, const char *bus_name, struct bench_result *results, int count);
+static int run_color_bench(FILE *fp, enum bench_format format, int colors, int iterations);
+static void run_color_kernel(int kernel, struct color_planes *p, uint8_t **out);
+static double time_color_kernel(int kernel, struct color_planes *p, uint8_t **out, int iterations);
+static void print_color_results(FILE *fp, enum bench_format format, struct color_result *results, 
+			int count);
+
+
+int main(int argc, char **argv)
+{
+	struct i2c_session bus;
+	struct bench_result *results;
+	char counts_arg[64];
+	const char *bus_name, *selected, *output;
+	uint8_t leds[128];
+	int counts[BENCH_MAX_COUNTS];
+	int opt, i, j, num_counts, num_results, iterations, num_leds, delay_set, colors, iter_set;
+	enum bench_format format;
+	FILE *fp;
+
+	bus_name = getenv("BLINKM_BUS");
+	selected = NULL;
+	output = NULL;
+	format = FORMAT_TEXT;
+	iterations = BENCH_DEFAULT_ITERATIONS;
+	delay_set = 0;
+	colors = 0;
+	iter_set = 0;
+	strcpy(counts_arg, BENCH_DEFAULT_COUNTS);
+
+	while ((opt = getopt(argc, argv, "B:n:i:w:f:o:d:c:h")) != -1) {
+		switch (opt) {
+		case 'B':
+			bus_name = optarg;
+			break;
+
+		case 'n':
+			strncpy(counts_arg, optarg, sizeof(counts_arg) - 1);
+			counts_arg[sizeof(counts_arg) - 1] = 0;
+			break;
+
+		case 'i':
+			iterations = atoi(optarg);
+			iter_set = 1;
+			break;
+
+		case 'c':
+			colors = atoi(optarg);
+			break;
+
+		case 'w':
+			selected = optarg;
+			break;
+
+		case 'f':
+			if (!strcasecmp(optarg, "json"))
+				format = FORMAT_JSON;
+			else if (!strcasecmp(optarg, "csv"))
+				format = FORMAT_CSV;
+			else if (!strcasecmp(optarg, "text"))
+				format = FORMAT_TEXT;
+			else {
+				usage(argv[0]);
+				return 1;
+			}
+
+			break;
+
+		case 'o':
+			output = optarg;
+			break;
+
+		case 'd':
+			script_delay_ms = atoi(optarg);
+			delay_set = 1;
+			break;
+
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (colors > 0) {
+		fp = stdout;
+
+		if (output) {
+			fp = fopen(output, "w");
+
+			if (!fp) {
+				perror(output);
+				return 1;
+			}
+		}
+
+		i = run_color_bench(fp, format, colors, iter_set ? iterations : BENCH_COLOR_ITERATIONS);
+
+		if (output)
+			fclose(fp);
+
+		return i < 0 ? 1 : 0;
+	}
+
+	if (!bus_name || !*bus_name)
+		bus_name = "sim";
+
+	/* the simulator has no eeprom to wait on */
+	if (!delay_set && strncmp(bus_name, "sim", 3))
+		script_delay_ms = BLINKM_EEPROM_DELAY_MS;
+
+	num_counts = parse_counts(counts_arg, counts);
+
+	if (num_counts < 1 || iterations < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	results = calloc(num_counts * NUM_WORKLOADS, sizeof(struct bench_result));
+
+	if (!results) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+
+	num_results = 0;
+
+	for (i = 0; i < num_counts; i++) {
+		num_leds = open_bench_bus(&bus, bus_name, counts[i], leds);
+
+		if (num_leds < 0) {
+			free(results);
+			return 1;
+		}
+
+		if (num_leds < counts[i]) {
+			fprintf(stderr, "Skipping %d devices, only %d found on %s\n", 
+				counts[i], num_leds, bus_name);
+			i2c_close_session(&bus);
+			continue;
+		}
+
+		for (j = 0; j < NUM_WORKLOADS; j++) {
+			if (selected && !workload_selected(selected, workloads[j]._name))
+				continue;
+
+			if (run_workload(&bus, &workloads[j], leds, num_leds, iterations, 
+					&results[num_results]) == 0)
+				num_results++;
+		}
+
+		i2c_close_session(&bus);
+	}
+
+	fp = stdout;
+
+	if (output) {
+		fp = fopen(output, "w");
+
+		if (!fp) {
+			perror(output);
+			free(results);
+			return 1;
+		}
+	}
+
+	if (format == FORMAT_JSON)
+		print_json(fp, bus_name, iterations, results, num_results);
+	else if (format == FORMAT_CSV)
+		print_csv(fp, bus_name, results, num_results);
+	else
+		print_text(fp, results, num_results);
+
+	if (output)
+		fclose(fp);
+
+	free(results);
+
+	return 0;
+}
+
+static void usage(const char *argv_0)
+{
+	int i;
+
+	printf("Usage: %s [-B bus] [-n devices[,devices...]] [-i iterations] "
+		"[-w workload[,workload...]] [-f text|json|csv] [-o file] [-d script_delay_ms]\n", argv_0);
+	printf("       %s -c colors [-i iterations] [-f text|json|csv] [-o file]\n", argv_0);
+	printf("\nThe bus defaults to $BLINKM_BUS, then to a simulated bus.\n");
+	printf("Device counts default to %s.\n", BENCH_DEFAULT_COUNTS);
+	printf("\nWorkloads\n");
+
+	for (i = 0; i < NUM_WORKLOADS; i++)
+		printf("  %s\n", workloads[i]._name);
+
+	printf("\nColor kernels, with -c\n");
+
+	for (i = 0; i < NUM_COLOR_KERNELS; i++)
+		printf("  %s\n", color_kernels[i]);
+}
+
+static int parse_counts(char *arg, int *counts)
+{
+	char *p;
+	int n;
+
+	n = 0;
+
+	for (p = strtok(arg, ","); p && n < BENCH_MAX_COUNTS; p = strtok(NULL, ",")) {
+		counts[n] = atoi(p);
+
+		if (counts[n] < 1 || counts[n] > 127) {
+			fprintf(stderr, "Device counts must be 1-127\n");
+			return -1;
+		}
+
+		n++;
+	}
+
+	return n;
+}
+
+static int workload_selected(const char *list, const char *name)
+{
+	const char *p;
+	int len;
+
+	len = strlen(name);
+
+	for (p = list; p && *p; p = strchr(p, ',')) {
+		if (*p == ',')
+			p++;
+
+		if (!strncasecmp(p, name, len) && (p[len] == 0 || p[len] == ','))
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ *  A simulated bus is opened with exactly the devices asked for at 
+ *  addresses 1-N. Anything else is scanned and the first N found are used.
+ *  Return the number of leds available or less then zero on failure.
+ */
+static int open_bench_bus(struct i2c_session *bus, const char *bus_name, int devices, 
+			uint8_t *leds)
+{
+	struct blinkm_scan scan;
+	char name[I2C_BUS_NAME_LEN];
+	int i;
+
+	if (!strncmp(bus_name, "sim", 3)) {
+		/* a later leds= replaces an earlier one */
+		snprintf(name, sizeof(name), "%s:leds=1-%d", bus_name, devices);
+
+		if (i2c_open_session(bus, name) < 0)
+			return -1;
+
+		for (i = 0; i < devices; i++)
+			leds[i] = i + 1;
+
+		return devices;
+	}
+
+	if (i2c_open_session(bus, bus_name) < 0)
+		return -1;
+
+	if (blinkm_scan_bus(bus, &scan) < 0) {
+		i2c_close_session(bus);
+		return -1;
+	}
+
+	if (scan._count > devices)
+		scan._count = devices;
+
+	memcpy(leds, scan._addr, scan._count);
+
+	return scan._count;
+}
+
+static int run_workload(struct i2c_session *bus, struct bench_workload *w, const uint8_t *leds,
+			int num_leds, int iterations, struct bench_result *result)
+{
+	uint64_t start, op_start, end, syscalls, bytes, bus_usecs;
+	double *samples;
+	int i, n, ops;
+
+	ops = w->_per_led ? iterations * num_leds : iterations;
+
+	samples = malloc(ops * sizeof(double));
+
+	if (!samples) {
+		fprintf(stderr, "Out of memory\n");
+		return -1;
+	}
+
+	memset(result, 0, sizeof(struct bench_result));
+	result->_workload = w->_name;
+	result->_devices = num_leds;
+	result->_ops = ops;
+
+	syscalls = bus->_syscalls;
+	bytes = bus->_bytes;
+	bus_usecs = bus->_bus_usecs;
+
+	start = monotonic_usecs();
+
+	for (i = 0; i < ops; i++) {
+		op_start = monotonic_usecs();
+
+		n = w->_op(bus, leds, num_leds, i);
+
+		end = monotonic_usecs();
+
+		samples[i] = end - op_start;
+
+		if (n < 0)
+			result->_errors++;
+		else
+			result->_cmds += n;
+	}
+
+	if (w->_done)
+		w->_done();
+
+	end = monotonic_usecs();
+
+	qsort(samples, ops, sizeof(double), compare_usecs);
+
+	result->_p50_usecs = samples[(ops - 1) / 2];
+	result->_p99_usecs = samples[((ops - 1) * 99) / 100];
+	result->_wall_msecs = (end - start) / 1000.0;
+	result->_bytes = bus->_bytes - bytes;
+	result->_bus_msecs = (bus->_bus_usecs - bus_usecs) / 1000.0;
+
+	if (end > start)
+		result->_cmds_per_sec = result->_cmds * 1000000.0 / (end - start);
+
+	/* what the wire allows, the number that matters on a simulated bus */
+	if (result->_bus_msecs > 0)
+		result->_bus_cmds_per_sec = result->_cmds * 1000.0 / result->_bus_msecs;
+
+	if (result->_cmds > 0) {
+		result->_syscalls_per_cmd = (double) (bus->_syscalls - syscalls) / result->_cmds;
+		result->_bytes_per_cmd = (double) result->_bytes / result->_cmds;
+	}
+
+	free(samples);
+
+	return 0;
+}
+
+static int compare_usecs(const void *a, const void *b)
+{
+	double x = *(const double *) a;
+	double y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
+
+static int op_set_rgb(struct i2c_session *bus, const uint8_t *leds, int num_leds, int iter)
+{
+	if (blinkm_set_rgb_color_now(bus, leds[iter % num_leds], iter, iter >> 8, 0x40) < 0)
+		return -1;
+
+	return 1;
+}
+
+static int op_set_rgb_batch(struct i2c_session *bus, const uint8_t *leds, int num_leds, int iter)
+{
+	struct blinkm_batch batch;
+	int i;
+
+	blinkm_batch_init(&batch);
+
+	for (i = 0; i < num_leds; i++)
+		blinkm_batch_add(&batch, leds[i], SET_RGB_COLOR_NOW, iter, i, 0x40);
+
+	return blinkm_batch_send(bus, &batch);
+}
+
+static void async_done(struct blinkm_request *req, void *ctx)
+{
+	(void) ctx;
+
+	if (req->_result < 0)
+		async_errors++;
+}
+
+/* one command per led through the queue, then wait for the bus thread */
+static int op_set_rgb_async(struct i2c_session *bus, const uint8_t *leds, int num_leds, int iter)
+{
+	int i;
+
+	if (async_queue._bus != bus) {
+		if (blinkm_queue_start(&async_queue, bus, 0) < 0)
+			return -1;
+	}
+
+	async_errors = 0;
+
+	for (i = 0; i < num_leds; i++) {
+		while (blinkm_queue_cmd(&async_queue, leds[i], SET_RGB_COLOR_NOW, iter, i, 0x40, 
+				async_done, NULL) < 0)
+			blinkm_queue_flush(&async_queue);
+	}
+
+	blinkm_queue_flush(&async_queue);
+
+	return async_errors ? -1 : num_leds;
+}
+
+/* 
+ * An animation outrunning the bus, most of the updates should be coalesced
+ * away and bytes per command drop.
+ */
+static int op_set_rgb_flood(struct i2c_session *bus, const uint8_t *leds, int num_leds, int iter)
+{
+	int i, j;
+
+	if (async_queue._bus != bus) {
+		if (blinkm_queue_start(&async_queue, bus, 0) < 0)
+			return -1;
+	}
+
+	async_errors = 0;
+
+	for (j = 0; j < BENCH_FLOOD_UPDATES; j++) {
+		for (i = 0; i < num_leds; i++) {
+			while (blinkm_queue_cmd(&async_queue, leds[i], SET_RGB_COLOR_NOW, iter, j, i, 
+					async_done, NULL) < 0)
+				blinkm_queue_flush(&async_queue);
+		}
+	}
+
+	blinkm_queue_flush(&async_queue);
+
+	return async_errors ? -1 : num_leds * BENCH_FLOOD_UPDATES;
+}
+
+static void stop_async_queue(void)
+{
+	blinkm_queue_stop(&async_queue);
+}
+
+static int op_fade_rgb(struct i2c_session *bus, const uint8_t *leds, int num_leds, int iter)
+{
+	if (blinkm_fade_to_rgb_color(bus, leds[iter % num_leds], 0x40, iter, iter >> 8) < 0)
+		return -1;
+
+	return 1;
+}
+
+static int op_get_rgb(struct i2c_session *bus, const uint8_t *leds, int num_leds, int iter)
+{
+	if (blinkm_get_current_rgb_color(bus, leds[iter % num_leds]) < 0)
+		return -1;
+
+	return 1;
+}
+
+/* a scan counts as one command */
+static int op_find_leds(struct i2c_session *bus, const uint8_t *leds, int num_leds, int iter)
+{
+	struct blinkm_scan scan;
+
+	(void) leds;
+	(void) iter;
+
+	if (blinkm_scan_bus(bus, &scan) < num_leds)
+		return -1;
+
+	return 1;
+}
+
+/* every script line to every led, plus the length and repeats */
+static int op_write_script(struct i2c_session *bus, const uint8_t *leds, int num_leds, int iter)
+{
+	struct script_line lines[BENCH_SCRIPT_LINES];
+	int i, n;
+
+	for (i = 0; i < BENCH_SCRIPT_LINES; i++) {
+		lines[i]._ticks = 10;
+		lines[i]._cmd = FADE_TO_RGB_COLOR;
+		lines[i]._arg[0] = iter;
+		lines[i]._arg[1] = i * 25;
+		lines[i]._arg[2] = 0;
+	}
+
+	n = blinkm_write_script(bus, leds, num_leds, lines, BENCH_SCRIPT_LINES, 0, 
+				script_delay_ms, NULL);
+
+	if (n < num_leds)
+		return -1;
+
+	return n * (BENCH_SCRIPT_LINES + 1);
+}
+
+static void print_text(FILE *fp, struct bench_result *results, int count)
+{
+	struct bench_result *r;
+	int i;
+
+	fprintf(fp, "%-14s %7s %7s %6s %10s %10s %11s %9s %9s %10s %11s\n",
+		"workload", "devices", "cmds", "errors", "p50 us", "p99 us", 
+		"cmds/s", "sys/cmd", "bytes/cmd", "bus ms", "bus cmds/s");
+
+	for (i = 0; i < count; i++) {
+		r = &results[i];
+
+		fprintf(fp, "%-14s %7d %7d %6d %10.1f %10.1f %11.0f %9.2f %9.2f %10.3f %11.0f\n",
+			r->_workload, r->_devices, r->_cmds, r->_errors, 
+			r->_p50_usecs, r->_p99_usecs, r->_cmds_per_sec,
+			r->_syscalls_per_cmd, r->_bytes_per_cmd, r->_bus_msecs,
+			r->_bus_cmds_per_sec);
+	}
+}
+
+static void print_json(FILE *fp, const char *bus_name, int iterations, 
+			struct bench_result *results, int count)
+{
+	struct bench_result *r;
+	int i;
+
+	fprintf(fp, "{\n  \"bus\": \"%s\",\n  \"timestamp\": %ld,\n  \"iterations\": %d,\n"
+		"  \"results\": [\n", bus_name, (long) time(NULL), iterations);
+
+	for (i = 0; i < count; i++) {
+		r = &results[i];
+
+		fprintf(fp, "    { \"workload\": \"%s\", \"devices\": %d, \"ops\": %d, "
+			"\"cmds\": %d, \"errors\": %d, \"p50_usecs\": %.1f, \"p99_usecs\": %.1f, "
+			"\"wall_msecs\": %.3f, \"cmds_per_sec\": %.1f, \"syscalls_per_cmd\": %.3f, "
+			"\"bytes\": %llu, \"bytes_per_cmd\": %.3f, \"bus_msecs\": %.3f, "
+			"\"bus_cmds_per_sec\": %.1f }%s\n",
+			r->_workload, r->_devices, r->_ops, r->_cmds, r->_errors,
+			r->_p50_usecs, r->_p99_usecs, r->_wall_msecs, r->_cmds_per_sec,
+			r->_syscalls_per_cmd, (unsigned long long) r->_bytes, r->_bytes_per_cmd,
+			r->_bus_msecs, r->_bus_cmds_per_sec, i < count - 1 ? "," : "");
+	}
+
+	fprintf(fp, "  ]\n}\n");
+}
+
+static void print_csv(FILE *fp, const char *bus_name, struct bench_result *results, int count)
+{
+	struct bench_result *r;
+	long now;
+	int i;
+
+	now = (long) time(NULL);
+
+	fprintf(fp, "timestamp,bus,workload,devices,ops,cmds,errors,p50_usecs,p99_usecs,"
+		"wall_msecs,cmds_per_sec,syscalls_per_cmd,bytes,bytes_per_cmd,bus_msecs,bus_cmds_per_sec\n");
+
+	for (i = 0; i < count; i++) {
+		r = &results[i];
+
+		fprintf(fp, "%ld,%s,%s,%d,%d,%d,%d,%.1f,%.1f,%.3f,%.1f,%.3f,%llu,%.3f,%.3f,%.1f\n",
+			now, bus_name, r->_workload, r->_devices, r->_ops, r->_cmds, r->_errors,
+			r->_p50_usecs, r->_p99_usecs, r->_wall_msecs, r->_cmds_per_sec,
+			r->_syscalls_per_cmd, (unsigned long long) r->_bytes, r->_bytes_per_cmd,
+			r->_bus_msecs, r->_bus_cmds_per_sec);
+	}
+}
+
+/*
+ * Every kernel over the same random colors, first scalar and then with
+ * the vector code, checking the two give the same bytes.
+ */
+static int run_color_bench(FILE *fp, enum bench_format format, int colors, int iterations)
+{
+	struct color_planes p;
+	struct color_result results[NUM_COLOR_KERNELS];
+	uint8_t *mem;
+	int i, k;
+
+	if (iterations < 1) {
+		fprintf(stderr, "Iterations must be at least 1\n");
+		return -1;
+	}
+
+	mem = malloc((size_t) colors * 9);
+
+	if (!mem) {
+		fprintf(stderr, "Out of memory for %d colors\n", colors);
+		return -1;
+	}
+
+	p._count = colors;
+
+	for (i = 0; i < 3; i++) {
+		p._in[i] = mem + (size_t) colors * i;
+		p._scalar[i] = mem + (size_t) colors * (3 + i);
+		p._simd[i] = mem + (size_t) colors * (6 + i);
+	}
+
+	srand(1);
+
+	for (i = 0; i < colors * 3; i++)
+		mem[i] = rand() & 0xff;
+
+	blinkm_gamma_table(p._lut, 2.2, 255);
+
+	for (k = 0; k < NUM_COLOR_KERNELS; k++) {
+		results[k]._kernel = color_kernels[k];
+		results[k]._colors = colors;
+
+		blinkm_color_simd(0);
+		results[k]._scalar_nsecs = time_color_kernel(k, &p, p._scalar, iterations);
+		run_color_kernel(k, &p, p._scalar);
+
+		blinkm_color_simd(1);
+		results[k]._simd_nsecs = time_color_kernel(k, &p, p._simd, iterations);
+		run_color_kernel(k, &p, p._simd);
+
+		results[k]._match = !memcmp(p._scalar[0], p._simd[0], colors) 
+			&& !memcmp(p._scalar[1], p._simd[1], colors) 
+			&& !memcmp(p._scalar[2], p._simd[2], colors);
+	}
+
+	print_color_results(fp, format, results, NUM_COLOR_KERNELS);
+
+	free(mem);
+
+	return 0;
+}
+
+/* 
+ * One pass from the input planes, the in place kernels get a fresh copy.
+ */
+static void run_color_kernel(int kernel, struct color_planes *p, uint8_t **out)
+{
+	int i;
+
+	switch (kernel) {
+	case 0:
+		blinkm_hsb_to_rgb_n(p->_in[0], p->_in[1], p->_in[2], out[0], out[1], out[2], p->_count);
+		break;
+
+	case 1:
+		blinkm_rgb_to_hsb_n(p->_in[0], p->_in[1], p->_in[2], out[0], out[1], out[2], p->_count);
+		break;
+
+	case 2:
+		for (i = 0; i < 3; i++)
+			blinkm_blend_n(p->_in[i], p->_in[(i + 1) % 3], out[i], p->_count, 100);
+
+		break;
+
+	case 3:
+		for (i = 0; i < 3; i++) {
+			memcpy(out[i], p->_in[i], p->_count);
+			blinkm_scale_n(out[i], p->_count, 180);
+		}
+
+		break;
+
+	case 4:
+		for (i = 0; i < 3; i++) {
+			memcpy(out[i], p->_in[i], p->_count);
+			blinkm_lut_n(out[i], p->_count, p->_lut);
+		}
+
+		break;
+	}
+}
+
+/*
+ * Nanoseconds per color. The in place kernels are timed on the output
+ * planes over and over, so no copy is in the loop.
+ */
+static double time_color_kernel(int kernel, struct color_planes *p, uint8_t **out, int iterations)
+{
+	uint64_t start;
+	int i, j;
+
+	run_color_kernel(kernel, p, out);
+
+	start = monotonic_nsecs();
+
+	for (i = 0; i < iterations; i++) {
+		switch (kernel) {
+		case 3:
+			for (j = 0; j < 3; j++)
+				blinkm_scale_n(out[j], p->_count, 180);
+
+			break;
+
+		case 4:
+			for (j = 0; j < 3; j++)
+				blinkm_lut_n(out[j], p->_count, p->_lut);
+
+			break;
+
+		default:
+			run_color_kernel(kernel, p, out);
+			break;
+		}
+	}
+
+	return (double) (monotonic_nsecs() - start) / ((double) iterations * p->_count);
+}
+
+static void print_color_results(FILE *fp, enum bench_format format, struct color_result *results, 
+			int count)
+{
+	struct color_result *r;
+	const char *isa;
+	long now;
+	int i;
+
+	blinkm_color_simd(1);
+	isa = blinkm_color_isa();
+	now = (long) time(NULL);
+
+	if (format == FORMAT_JSON) 
+		fprintf(fp, "{\n  \"isa\": \"%s\",\n  \"timestamp\": %ld,\n  \"results\": [\n", 
+			isa, now);
+	else if (format == FORMAT_CSV)
+		fprintf(fp, "timestamp,isa,kernel,colors,scalar_nsecs,simd_nsecs,speedup,match\n");
+	else
+		fprintf(fp, "%-12s %7s %12s %12s %8s %6s\n", "kernel", "colors", "scalar ns", 
+			isa, "speedup", "match");
+
+	for (i = 0; i < count; i++) {
+		r = &results[i];
+
+		if (format == FORMAT_JSON)
+			fprintf(fp, "    { \"kernel\": \"%s\", \"colors\": %d, \"scalar_nsecs\": %.3f, "
+				"\"simd_nsecs\": %.3f, \"speedup\": %.2f, \"match\": %s }%s\n", 
+				r->_kernel, r->_colors, r->_scalar_nsecs, r->_simd_nsecs, 
+				r->_scalar_nsecs / r->_simd_nsecs, r->_match ? "true" : "false",
+				i < count - 1 ? "," : "");
+		else if (format == FORMAT_CSV)
+			fprintf(fp, "%ld,%s,%s,%d,%.3f,%.3f,%.2f,%d\n", now, isa, r->_kernel, r->_colors,
+				r->_scalar_nsecs, r->_simd_nsecs, r->_scalar_nsecs / r->_simd_nsecs, r->_match);
+		else
+			fprintf(fp, "%-12s %7d %12.3f %12.3f %7.2fx %6s\n", r->_kernel, r->_colors, 
+				r->_scalar_nsecs, r->_simd_nsecs, r->_scalar_nsecs / r->_simd_nsecs, 
+				r->_match ? "yes" : "NO");
+	}
+
+	if (format == FORMAT_JSON)
+		fprintf(fp, "  ]\n}\n");
+}
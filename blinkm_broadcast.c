@@ -0,0 +1,183 @@
+/*
+	Copyright (c) 2009, Scott Ellis
+	All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+		* Redistributions of source code must retain the above copyright
+		  notice, this list of conditions and the following disclaimer.
+		* Redistributions in binary form must reproduce the above copyright
+		  notice, this list of conditions and the following disclaimer in the
+		  documentation and/or other materials provided with the distribution.
+		* Neither the name of the <organization> nor the
+		  names of its contributors may be used to endorse or promote products
+		  derived from this software without specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY Scott Ellis ''AS IS'' AND ANY
+	EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+	WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+	DISCLAIMED. IN NO EVENT SHALL Scott Ellis BE LIABLE FOR ANY
+	DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+	(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+	LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+	ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+	(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+	SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * Commands for every led on a bus in one transaction, written to the I2C
+ * general call address. BlinkMs take general calls, but other devices
+ * sharing the bus and some firmware may not, and a single ACK on the 
+ * general call hides a device that ignored it.
+ *
+ * With a shadow cache on the session, the first set-rgb broadcast reads
+ * every device back to learn which ones took it. Those that didn't are
+ * sent the same command by address, in one batched transfer, on every 
+ * broadcast after that. If nothing ACKs the general call at all, every 
+ * device found by a scan gets the batched unicast.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "i2c_functions.h"
+#include "i2c_blinkm.h"
+#include "i2c_scan.h"
+#include "blinkm_cache.h"
+#include "blinkm_regs.h"
+#include "blinkm_broadcast.h"
+
+static int unicast(struct i2c_session *bus, const uint8_t *leds, int num_leds, 
+			const uint8_t *data, int len, int *failed);
+
+
+/*
+ * The commands every led can take at once, random fades included since
+ * each led picks its own color anyway.
+ */
+int blinkm_can_broadcast(uint8_t cmd)
+{
+	const struct blinkm_opcode *op = blinkm_opcode(cmd);
+
+	return op && (op->_flags & BLINKM_OP_BROADCAST);
+}
+
+/*
+ * Return the number of unicast writes that were needed, or -1 if the
+ * command couldn't be delivered.
+ */
+int blinkm_broadcast(struct i2c_session *bus, uint8_t cmd, uint8_t a1, uint8_t a2, uint8_t a3,
+		struct blinkm_broadcast_stats *stats)
+{
+	struct blinkm_cache *c;
+	uint8_t data[BLINKM_MAX_CMD_LEN], leds[128], missed[128];
+	int before[128];
+	int i, len, rgb, target, num_leds, num_missed, verify;
+
+	memset(stats, 0, sizeof(struct blinkm_broadcast_stats));
+
+	if (!bus || !blinkm_can_broadcast(cmd))
+		return -1;
+
+	c = bus->_cache;
+
+	/* only a color set right now can be read back and compared */
+	verify = c && (cmd == SET_RGB_COLOR_NOW);
+	target = (a1 << 16) | (a2 << 8) | a3;
+	num_leds = 0;
+
+	/* 
+	 * A led already showing the color would look like it answered, so
+	 * the leds not learned yet are read before the general call too.
+	 */
+	if (verify) {
+		num_leds = blinkm_find_leds(bus, leds);
+
+		for (i = 0; i < num_leds; i++) {
+			before[leds[i]] = -1;
+
+			if (c->_general_call[leds[i]] == BLINKM_GC_UNKNOWN)
+				before[leds[i]] = blinkm_get_current_rgb_color(bus, leds[i]);
+		}
+	}
+
+	len = blinkm_encode_cmd(cmd, a1, a2, a3, data);
+
+	stats->_acked = (i2c_write(bus, 0x00, data, len) == len);
+
+	/* the common case, nothing known to need a second look */
+	if (stats->_acked && !c)
+		return 0;
+
+	if (!verify)
+		num_leds = blinkm_find_leds(bus, leds);
+
+	stats->_devices = num_leds;
+
+	if (num_leds < 0)
+		return -1;
+
+	num_missed = 0;
+
+	if (!stats->_acked) {
+		memcpy(missed, leds, num_leds);
+		num_missed = num_leds;
+	}
+	else {
+		for (i = 0; i < num_leds; i++) {
+			if (verify && c->_general_call[leds[i]] == BLINKM_GC_UNKNOWN 
+					&& before[leds[i]] >= 0) {
+				rgb = blinkm_get_current_rgb_color(bus, leds[i]);
+				stats->_verified++;
+
+				/* already the color before tells us nothing, try again next time */
+				if (rgb == target && before[leds[i]] != target)
+					c->_general_call[leds[i]] = BLINKM_GC_ANSWERS;
+				else if (rgb >= 0 && rgb != target)
+					c->_general_call[leds[i]] = BLINKM_GC_IGNORES;
+			}
+
+			if (c->_general_call[leds[i]] == BLINKM_GC_IGNORES)
+				missed[num_missed++] = leds[i];
+			else if (c->_general_call[leds[i]] == BLINKM_GC_ANSWERS)
+				blinkm_cache_update(c, leds[i], cmd, a1, a2, a3);
+			else
+				blinkm_cache_invalidate(c, leds[i]);
+		}
+	}
+
+	if (num_missed == 0)
+		return stats->_acked ? 0 : -1;
+
+	stats->_unicast = unicast(bus, missed, num_missed, data, len, &stats->_failed);
+
+	return stats->_unicast;
+}
+
+/*
+ * Writes the cache suppressed are marked sent without being written, so
+ * failures come from the _sent flags rather than the count written.
+ * Return the number of writes.
+ */
+static int unicast(struct i2c_session *bus, const uint8_t *leds, int num_leds, 
+			const uint8_t *data, int len, int *failed)
+{
+	struct blinkm_batch batch;
+	int i, written;
+
+	blinkm_batch_init(&batch);
+
+	for (i = 0; i < num_leds; i++)
+		blinkm_batch_add_raw(&batch, leds[i], data, len);
+
+	written = blinkm_batch_send(bus, &batch);
+
+	for (i = 0, *failed = 0; i < batch._count; i++) {
+		if (!batch._cmd[i]._sent)
+			(*failed)++;
+	}
+
+	return written;
+}
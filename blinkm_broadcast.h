@@ -0,0 +1,54 @@
+/*
+	Copyright (c) 2009, Scott Ellis
+	All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+		* Redistributions of source code must retain the above copyright
+		  notice, this list of conditions and the following disclaimer.
+		* Redistributions in binary form must reproduce the above copyright
+		  notice, this list of conditions and the following disclaimer in the
+		  documentation and/or other materials provided with the distribution.
+		* Neither the name of the <organization> nor the
+		  names of its contributors may be used to endorse or promote products
+		  derived from this software without specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY Scott Ellis ''AS IS'' AND ANY
+	EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+	WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+	DISCLAIMED. IN NO EVENT SHALL Scott Ellis BE LIABLE FOR ANY
+	DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+	(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+	LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+	ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+	(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+	SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef BLINKM_BROADCAST_H
+#define BLINKM_BROADCAST_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct i2c_session;
+
+struct blinkm_broadcast_stats {
+	/* 1 if some device ACKed the general call */
+	int _acked;
+	int _devices;
+	int _verified;
+	int _unicast;
+	int _failed;
+};
+
+int blinkm_can_broadcast(uint8_t cmd);
+int blinkm_broadcast(struct i2c_session *bus, uint8_t cmd, uint8_t a1, uint8_t a2, uint8_t a3,
+		struct blinkm_broadcast_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
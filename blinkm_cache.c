@@ -0,0 +1,208 @@
+/*
+	Copyright (c) 2009, Scott Ellis
+	All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+		* Redistributions of source code must retain the above copyright
+		  notice, this list of conditions and the following disclaimer.
+		* Redistributions in binary form must reproduce the above copyright
+		  notice, this list of conditions and the following disclaimer in the
+		  documentation and/or other materials provided with the distribution.
+		* Neither the name of the <organization> nor the
+		  names of its contributors may be used to endorse or promote products
+		  derived from this software without specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY Scott Ellis ''AS IS'' AND ANY
+	EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+	WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+	DISCLAIMED. IN NO EVENT SHALL Scott Ellis BE LIABLE FOR ANY
+	DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+	(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+	LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+	ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+	(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+	SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <string.h>
+#include <stdint.h>
+
+#include "blinkm_regs.h"
+#include "blinkm_cache.h"
+#include "i2c_blinkm.h"
+#include "i2c_functions.h"
+
+
+void blinkm_cache_init(struct blinkm_cache *c)
+{
+	if (c)
+		memset(c, 0, sizeof(struct blinkm_cache));
+}
+
+/*
+ * Forget what we know about one led, or every led if led is zero. Every
+ * led includes which addresses are present, a general call may have 
+ * moved them.
+ */
+void blinkm_cache_invalidate(struct blinkm_cache *c, uint8_t led)
+{
+	if (!c || led > 127)
+		return;
+
+	if (led == 0) {
+		memset(c->_led, 0, sizeof(c->_led));
+		memset(c->_present, 0, sizeof(c->_present));
+		memset(c->_general_call, 0, sizeof(c->_general_call));
+		c->_scanned = 0;
+	}
+	else {
+		memset(&c->_led[led], 0, sizeof(struct blinkm_shadow));
+	}
+}
+
+/*
+ * Return 1 if sending this command can't change anything on the led and 
+ * the write should be skipped. A NULL cache never suppresses anything.
+ */
+int blinkm_cache_check(struct blinkm_cache *c, uint8_t led, uint8_t cmd, uint8_t a1, uint8_t a2, uint8_t a3)
+{
+	struct blinkm_shadow *sh;
+	int same;
+
+	if (!c || led < 1 || led > 127) 
+		return 0;
+
+	sh = &c->_led[led];
+	same = 0;
+
+	if (sh->_script_playing)
+		return 0;
+
+	switch (cmd) {
+	case SET_RGB_COLOR_NOW:
+		/* a fade to the same color may still be running, only an exact repeat is a no-op */
+		same = sh->_color_valid && sh->_cmd == cmd 
+			&& sh->_arg[0] == a1 && sh->_arg[1] == a2 && sh->_arg[2] == a3;
+		break;
+
+	case FADE_TO_RGB_COLOR:
+		/* fading to the color we last set or faded to */
+		same = sh->_color_valid 
+			&& (sh->_cmd == SET_RGB_COLOR_NOW || sh->_cmd == FADE_TO_RGB_COLOR)
+			&& sh->_arg[0] == a1 && sh->_arg[1] == a2 && sh->_arg[2] == a3;
+		break;
+
+	case FADE_TO_HSB_COLOR:
+		same = sh->_color_valid && sh->_cmd == cmd 
+			&& sh->_arg[0] == a1 && sh->_arg[1] == a2 && sh->_arg[2] == a3;
+		break;
+
+	case SET_FADE_SPEED:
+		same = sh->_speed_valid && sh->_speed == a1;
+		break;
+	}
+
+	if (same)
+		c->_suppressed++;
+
+	return same;
+}
+
+/*
+ * Record a command that was written successfully. Commands that leave the
+ * color unpredictable, random fades and scripts, invalidate the shadow.
+ * Nothing is suppressed for a led while it plays a script.
+ */
+void blinkm_cache_update(struct blinkm_cache *c, uint8_t led, uint8_t cmd, uint8_t a1, uint8_t a2, uint8_t a3)
+{
+	struct blinkm_shadow *sh;
+	int i;
+
+	if (!c || led > 127) 
+		return;
+
+	if (led == 0) {
+		/* only a new address moves devices, the scan results stay otherwise */
+		if (cmd == SET_BLINKM_ADDRESS)
+			blinkm_cache_invalidate(c, 0);
+		else
+			memset(c->_led, 0, sizeof(c->_led));
+
+		if (cmd == PLAY_LIGHT_SCRIPT) {
+			for (i = 1; i < 128; i++)
+				c->_led[i]._script_playing = 1;
+		}
+
+		return;
+	}
+
+	sh = &c->_led[led];
+
+	switch (cmd) {
+	case SET_RGB_COLOR_NOW:
+	case FADE_TO_RGB_COLOR:
+	case FADE_TO_HSB_COLOR:
+		sh->_color_valid = 1;
+		sh->_cmd = cmd;
+		sh->_arg[0] = a1;
+		sh->_arg[1] = a2;
+		sh->_arg[2] = a3;
+		break;
+
+	case SET_FADE_SPEED:
+		sh->_speed_valid = 1;
+		sh->_speed = a1;
+		break;
+
+	case SET_SCRIPT_LENGTH_AND_REPEATS:
+		sh->_script_valid = 1;
+		sh->_script_length = a1;
+		sh->_script_repeats = a2;
+		break;
+
+	case SET_TIME_ADJUST:
+	case WRITE_SCRIPT_LINE:
+		break;
+
+	case PLAY_LIGHT_SCRIPT:
+		sh->_color_valid = 0;
+		sh->_speed_valid = 0;
+		sh->_script_playing = 1;
+		break;
+
+	case STOP_SCRIPT:
+		sh->_color_valid = 0;
+		sh->_script_playing = 0;
+		break;
+
+	default:
+		sh->_color_valid = 0;
+		break;
+	}
+}
+
+/*
+ * Read the color the led is showing right now and make that the shadow
+ * state. Use after anything outside this process may have changed the led.
+ * Return the packed rgb value or -1 on failure.
+ */
+int blinkm_cache_resync(struct i2c_session *bus, uint8_t led)
+{
+	int rgb;
+
+	if (!bus || !bus->_cache)
+		return -1;
+
+	blinkm_cache_invalidate(bus->_cache, led);
+
+	rgb = blinkm_get_current_rgb_color(bus, led);
+
+	if (rgb < 0)
+		return -1;
+
+	blinkm_cache_update(bus->_cache, led, SET_RGB_COLOR_NOW, 
+			(rgb >> 16) & 0xff, (rgb >> 8) & 0xff, rgb & 0xff);
+
+	return rgb;
+}
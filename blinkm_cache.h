@@ -0,0 +1,75 @@
+/*
+	Copyright (c) 2009, Scott Ellis
+	All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+		* Redistributions of source code must retain the above copyright
+		  notice, this list of conditions and the following disclaimer.
+		* Redistributions in binary form must reproduce the above copyright
+		  notice, this list of conditions and the following disclaimer in the
+		  documentation and/or other materials provided with the distribution.
+		* Neither the name of the <organization> nor the
+		  names of its contributors may be used to endorse or promote products
+		  derived from this software without specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY Scott Ellis ''AS IS'' AND ANY
+	EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+	WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+	DISCLAIMED. IN NO EVENT SHALL Scott Ellis BE LIABLE FOR ANY
+	DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+	(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+	LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+	ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+	(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+	SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef BLINKM_CACHE_H
+#define BLINKM_CACHE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct i2c_session;
+
+/* the last color command and fade speed we know each led is running */
+struct blinkm_shadow {
+	uint8_t _color_valid;
+	uint8_t _cmd;
+	uint8_t _arg[3];
+	uint8_t _speed_valid;
+	uint8_t _speed;
+	uint8_t _script_valid;
+	uint8_t _script_length;
+	uint8_t _script_repeats;
+	/* a light script may change color and fade speed at any time */
+	uint8_t _script_playing;
+};
+
+/* what a general call write reaches, learned by blinkm_broadcast() */
+#define BLINKM_GC_UNKNOWN 0
+#define BLINKM_GC_ANSWERS 1
+#define BLINKM_GC_IGNORES 2
+
+struct blinkm_cache {
+	struct blinkm_shadow _led[128];
+	int _suppressed;
+	/* devices found by the last scan, valid when _scanned is set */
+	int _scanned;
+	uint8_t _present[128];
+	uint8_t _general_call[128];
+};
+
+void blinkm_cache_init(struct blinkm_cache *c);
+void blinkm_cache_invalidate(struct blinkm_cache *c, uint8_t led);
+int blinkm_cache_check(struct blinkm_cache *c, uint8_t led, uint8_t cmd, uint8_t a1, uint8_t a2, uint8_t a3);
+void blinkm_cache_update(struct blinkm_cache *c, uint8_t led, uint8_t cmd, uint8_t a1, uint8_t a2, uint8_t a3);
+int blinkm_cache_resync(struct i2c_session *bus, uint8_t led);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
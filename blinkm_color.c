@@ -0,0 +1,678 @@
+/*
+	Copyright (c) 2009, Scott Ellis
+	All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+		* Redistributions of source code must retain the above copyright
+		  notice, this list of conditions and the following disclaimer.
+		* Redistributions in binary form must reproduce the above copyright
+		  notice, this list of conditions and the following disclaimer in the
+		  documentation and/or other materials provided with the distribution.
+		* Neither the name of the <organization> nor the
+		  names of its contributors may be used to endorse or promote products
+		  derived from this software without specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY Scott Ellis ''AS IS'' AND ANY
+	EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+	WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+	DISCLAIMED. IN NO EVENT SHALL Scott Ellis BE LIABLE FOR ANY
+	DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+	(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+	LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+	ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+	(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+	SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/*
+ * Host side color math for the simulator, the animation engine and 
+ * anything else that has whole frames of colors to convert.
+ *
+ * The array kernels work on one plane per channel. Each has a scalar
+ * version and SSE2 or AVX2 versions that give exactly the same bytes,
+ * picked at run time. Other targets, the Overo's ARM included, use the
+ * scalar code. Build with -DBLINKM_COLOR_SCALAR to leave
+ * the vector code out. The gamma lookup is a byte table lookup on every
+ * path, there is no byte gather on these instruction sets that beats it.
+ */
+
+#include <stdint.h>
+#include <math.h>
+
+#include "blinkm_color.h"
+
+#if !defined(BLINKM_COLOR_SCALAR)
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define HAVE_SSE2 1
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_AVX2 1
+#endif
+#endif
+#endif
+
+#define ISA_SCALAR 0
+#define ISA_SSE2 1
+#define ISA_AVX2 2
+
+static int color_isa = -1;
+static int simd_enabled = 1;
+
+static int get_isa(void);
+static int blend_weight(uint8_t alpha);
+
+#ifdef HAVE_SSE2
+static int hsb_to_rgb_sse2(const uint8_t *h, const uint8_t *s, const uint8_t *v, 
+			uint8_t *r, uint8_t *g, uint8_t *b, int n);
+static int rgb_to_hsb_sse2(const uint8_t *r, const uint8_t *g, const uint8_t *b, 
+			uint8_t *h, uint8_t *s, uint8_t *v, int n);
+static int blend_sse2(const uint8_t *a, const uint8_t *b, uint8_t *out, int n, int w);
+#endif
+
+#ifdef HAVE_AVX2
+static int hsb_to_rgb_avx2(const uint8_t *h, const uint8_t *s, const uint8_t *v, 
+			uint8_t *r, uint8_t *g, uint8_t *b, int n);
+static int rgb_to_hsb_avx2(const uint8_t *r, const uint8_t *g, const uint8_t *b, 
+			uint8_t *h, uint8_t *s, uint8_t *v, int n);
+static int blend_avx2(const uint8_t *a, const uint8_t *b, uint8_t *out, int n, int w);
+#endif
+
+
+
+/*
+ * Integer HSV to RGB in six 43 wide hue regions, close to what the 
+ * firmware does with a FADE_TO_HSB_COLOR.
+ */
+void blinkm_hsb_to_rgb(uint8_t h, uint8_t sat, uint8_t v, uint8_t *rgb)
+{
+	int region, remainder, p, q, t;
+
+	if (sat == 0) {
+		rgb[0] = rgb[1] = rgb[2] = v;
+		return;
+	}
+
+	region = h / 43;
+	remainder = (h - (region * 43)) * 6;
+
+	p = (v * (255 - sat)) >> 8;
+	q = (v * (255 - ((sat * remainder) >> 8))) >> 8;
+	t = (v * (255 - ((sat * (255 - remainder)) >> 8))) >> 8;
+
+	switch (region) {
+	case 0:
+		rgb[0] = v; rgb[1] = t; rgb[2] = p;
+		break;
+	case 1:
+		rgb[0] = q; rgb[1] = v; rgb[2] = p;
+		break;
+	case 2:
+		rgb[0] = p; rgb[1] = v; rgb[2] = t;
+		break;
+	case 3:
+		rgb[0] = p; rgb[1] = q; rgb[2] = v;
+		break;
+	case 4:
+		rgb[0] = t; rgb[1] = p; rgb[2] = v;
+		break;
+	default:
+		rgb[0] = v; rgb[1] = p; rgb[2] = q;
+		break;
+	}
+}
+
+/*
+ * The inverse, hue 0 is red, 85 green and 171 blue.
+ */
+void blinkm_rgb_to_hsb(uint8_t r, uint8_t g, uint8_t b, uint8_t *hsb)
+{
+	int max, min, delta, h;
+
+	max = r > g ? r : g;
+
+	if (b > max)
+		max = b;
+
+	min = r < g ? r : g;
+
+	if (b < min)
+		min = b;
+
+	delta = max - min;
+	hsb[2] = max;
+
+	if (delta == 0) {
+		hsb[0] = 0;
+		hsb[1] = 0;
+		return;
+	}
+
+	hsb[1] = (255 * delta) / max;
+
+	if (max == r)
+		h = (43 * (g - b)) / delta;
+	else if (max == g)
+		h = 85 + (43 * (b - r)) / delta;
+	else
+		h = 171 + (43 * (r - g)) / delta;
+
+	hsb[0] = (uint8_t) h;
+}
+
+void blinkm_hsb_to_rgb_n(const uint8_t *h, const uint8_t *s, const uint8_t *v, 
+		uint8_t *r, uint8_t *g, uint8_t *b, int n)
+{
+	uint8_t rgb[3];
+	int i = 0;
+
+	switch (get_isa()) {
+#ifdef HAVE_AVX2
+	case ISA_AVX2:
+		i = hsb_to_rgb_avx2(h, s, v, r, g, b, n);
+		break;
+#endif
+#ifdef HAVE_SSE2
+	case ISA_SSE2:
+		i = hsb_to_rgb_sse2(h, s, v, r, g, b, n);
+		break;
+#endif
+	}
+
+	for (; i < n; i++) {
+		blinkm_hsb_to_rgb(h[i], s[i], v[i], rgb);
+		r[i] = rgb[0];
+		g[i] = rgb[1];
+		b[i] = rgb[2];
+	}
+}
+
+void blinkm_rgb_to_hsb_n(const uint8_t *r, const uint8_t *g, const uint8_t *b, 
+		uint8_t *h, uint8_t *s, uint8_t *v, int n)
+{
+	uint8_t hsb[3];
+	int i = 0;
+
+	switch (get_isa()) {
+#ifdef HAVE_AVX2
+	case ISA_AVX2:
+		i = rgb_to_hsb_avx2(r, g, b, h, s, v, n);
+		break;
+#endif
+#ifdef HAVE_SSE2
+	case ISA_SSE2:
+		i = rgb_to_hsb_sse2(r, g, b, h, s, v, n);
+		break;
+#endif
+	}
+
+	for (; i < n; i++) {
+		blinkm_rgb_to_hsb(r[i], g[i], b[i], hsb);
+		h[i] = hsb[0];
+		s[i] = hsb[1];
+		v[i] = hsb[2];
+	}
+}
+
+/*
+ * out = a + (b - a) * alpha / 255, alpha 0 is all a and 255 all b.
+ * out can be either input.
+ */
+void blinkm_blend_n(const uint8_t *a, const uint8_t *b, uint8_t *out, int n, uint8_t alpha)
+{
+	int i = 0;
+	int w = blend_weight(alpha);
+
+	switch (get_isa()) {
+#ifdef HAVE_AVX2
+	case ISA_AVX2:
+		i = blend_avx2(a, b, out, n, w);
+		break;
+#endif
+#ifdef HAVE_SSE2
+	case ISA_SSE2:
+		i = blend_sse2(a, b, out, n, w);
+		break;
+#endif
+	}
+
+	for (; i < n; i++)
+		out[i] = (a[i] * (256 - w) + b[i] * w) >> 8;
+}
+
+/*
+ * Brightness, a blend toward black.
+ */
+void blinkm_scale_n(uint8_t *plane, int n, uint8_t level)
+{
+	static const uint8_t black[256];
+	int i;
+
+	/* blend from black in pieces, the zero plane is only so big */
+	for (i = 0; i < n; i += 256)
+		blinkm_blend_n(black, plane + i, plane + i, n - i < 256 ? n - i : 256, level);
+}
+
+/*
+ * A table for blinkm_lut_n() that applies gamma, then scales to level.
+ * A gamma around 2.2 makes equal steps look equally bright on an led.
+ */
+void blinkm_gamma_table(uint8_t *lut, double gamma, uint8_t level)
+{
+	double x;
+	int i;
+
+	if (gamma <= 0.0)
+		gamma = 1.0;
+
+	for (i = 0; i < 256; i++) {
+		x = pow(i / 255.0, gamma) * level;
+		lut[i] = (uint8_t) (x + 0.5);
+	}
+}
+
+void blinkm_lut_n(uint8_t *plane, int n, const uint8_t *lut)
+{
+	int i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		plane[i] = lut[plane[i]];
+		plane[i + 1] = lut[plane[i + 1]];
+		plane[i + 2] = lut[plane[i + 2]];
+		plane[i + 3] = lut[plane[i + 3]];
+	}
+
+	for (; i < n; i++)
+		plane[i] = lut[plane[i]];
+}
+
+/*
+ * Turn the vector kernels off, or back on. Return the previous setting.
+ */
+int blinkm_color_simd(int enable)
+{
+	int was = simd_enabled;
+
+	simd_enabled = enable;
+
+	return was;
+}
+
+/*
+ * The instruction set the array kernels are using.
+ */
+const char *blinkm_color_isa(void)
+{
+	switch (get_isa()) {
+	case ISA_SSE2:
+		return "sse2";
+	case ISA_AVX2:
+		return "avx2";
+	default:
+		return "scalar";
+	}
+}
+
+static int get_isa(void)
+{
+	if (!simd_enabled)
+		return ISA_SCALAR;
+
+	if (color_isa < 0) {
+#if defined(HAVE_AVX2)
+		__builtin_cpu_init();
+		color_isa = __builtin_cpu_supports("avx2") ? ISA_AVX2 : ISA_SSE2;
+#elif defined(HAVE_SSE2)
+		color_isa = ISA_SSE2;
+#else
+		color_isa = ISA_SCALAR;
+#endif
+	}
+
+	return color_isa;
+}
+
+/* 
+ * 0-255 to 0-256 so 255 is all of b, and a 16 bit lane holds the sum.
+ */
+static int blend_weight(uint8_t alpha)
+{
+	return alpha + (alpha >> 7);
+}
+
+/*
+ * The vector versions keep every value in 16 bit lanes, where all of the
+ * products above fit unsigned. h / 43 is (h * 191) >> 13 for any byte.
+ * The rgb to hsb divisions are done in float, which truncates to the 
+ * same integer since no quotient is closer than 1/255 to the next one.
+ * Each returns how many colors it did, the callers finish the rest.
+ */
+
+#ifdef HAVE_SSE2
+
+static void hsb_core_sse2(__m128i h, __m128i s, __m128i v, __m128i *r, __m128i *g, __m128i *b)
+{
+	const __m128i c255 = _mm_set1_epi16(255);
+	__m128i region, rem, p, q, t, m0, m1, m2, m3, m4, m5, gray;
+
+	region = _mm_srli_epi16(_mm_mullo_epi16(h, _mm_set1_epi16(191)), 13);
+	rem = _mm_mullo_epi16(_mm_sub_epi16(h, _mm_mullo_epi16(region, _mm_set1_epi16(43))), 
+			_mm_set1_epi16(6));
+
+	p = _mm_srli_epi16(_mm_mullo_epi16(v, _mm_sub_epi16(c255, s)), 8);
+	q = _mm_srli_epi16(_mm_mullo_epi16(s, rem), 8);
+	q = _mm_srli_epi16(_mm_mullo_epi16(v, _mm_sub_epi16(c255, q)), 8);
+	t = _mm_srli_epi16(_mm_mullo_epi16(s, _mm_sub_epi16(c255, rem)), 8);
+	t = _mm_srli_epi16(_mm_mullo_epi16(v, _mm_sub_epi16(c255, t)), 8);
+
+	m0 = _mm_cmpeq_epi16(region, _mm_setzero_si128());
+	m1 = _mm_cmpeq_epi16(region, _mm_set1_epi16(1));
+	m2 = _mm_cmpeq_epi16(region, _mm_set1_epi16(2));
+	m3 = _mm_cmpeq_epi16(region, _mm_set1_epi16(3));
+	m4 = _mm_cmpeq_epi16(region, _mm_set1_epi16(4));
+	m5 = _mm_cmpeq_epi16(region, _mm_set1_epi16(5));
+
+	*r = _mm_or_si128(_mm_or_si128(_mm_and_si128(_mm_or_si128(m0, m5), v), _mm_and_si128(m1, q)),
+		_mm_or_si128(_mm_and_si128(_mm_or_si128(m2, m3), p), _mm_and_si128(m4, t)));
+	*g = _mm_or_si128(_mm_or_si128(_mm_and_si128(m0, t), _mm_and_si128(_mm_or_si128(m1, m2), v)),
+		_mm_or_si128(_mm_and_si128(m3, q), _mm_and_si128(_mm_or_si128(m4, m5), p)));
+	*b = _mm_or_si128(_mm_or_si128(_mm_and_si128(_mm_or_si128(m0, m1), p), _mm_and_si128(m2, t)),
+		_mm_or_si128(_mm_and_si128(_mm_or_si128(m3, m4), v), _mm_and_si128(m5, q)));
+
+	gray = _mm_cmpeq_epi16(s, _mm_setzero_si128());
+	*r = _mm_or_si128(_mm_and_si128(gray, v), _mm_andnot_si128(gray, *r));
+	*g = _mm_or_si128(_mm_and_si128(gray, v), _mm_andnot_si128(gray, *g));
+	*b = _mm_or_si128(_mm_and_si128(gray, v), _mm_andnot_si128(gray, *b));
+}
+
+static int hsb_to_rgb_sse2(const uint8_t *h, const uint8_t *s, const uint8_t *v, 
+			uint8_t *r, uint8_t *g, uint8_t *b, int n)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i vh, vs, vv, r0, g0, b0, r1, g1, b1;
+	int i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		vh = _mm_loadu_si128((const __m128i *) (h + i));
+		vs = _mm_loadu_si128((const __m128i *) (s + i));
+		vv = _mm_loadu_si128((const __m128i *) (v + i));
+
+		hsb_core_sse2(_mm_unpacklo_epi8(vh, zero), _mm_unpacklo_epi8(vs, zero), 
+			_mm_unpacklo_epi8(vv, zero), &r0, &g0, &b0);
+		hsb_core_sse2(_mm_unpackhi_epi8(vh, zero), _mm_unpackhi_epi8(vs, zero), 
+			_mm_unpackhi_epi8(vv, zero), &r1, &g1, &b1);
+
+		_mm_storeu_si128((__m128i *) (r + i), _mm_packus_epi16(r0, r1));
+		_mm_storeu_si128((__m128i *) (g + i), _mm_packus_epi16(g0, g1));
+		_mm_storeu_si128((__m128i *) (b + i), _mm_packus_epi16(b0, b1));
+	}
+
+	return i;
+}
+
+/* truncating num / den for 8 signed 16 bit lanes, den > 0 */
+static __m128i div_sse2(__m128i num, __m128i den)
+{
+	__m128i nlo, nhi, dlo, dhi, qlo, qhi;
+
+	nlo = _mm_srai_epi32(_mm_unpacklo_epi16(num, num), 16);
+	nhi = _mm_srai_epi32(_mm_unpackhi_epi16(num, num), 16);
+	dlo = _mm_unpacklo_epi16(den, _mm_setzero_si128());
+	dhi = _mm_unpackhi_epi16(den, _mm_setzero_si128());
+
+	qlo = _mm_cvttps_epi32(_mm_div_ps(_mm_cvtepi32_ps(nlo), _mm_cvtepi32_ps(dlo)));
+	qhi = _mm_cvttps_epi32(_mm_div_ps(_mm_cvtepi32_ps(nhi), _mm_cvtepi32_ps(dhi)));
+
+	return _mm_packs_epi32(qlo, qhi);
+}
+
+/* the same for unsigned numerators up to 65535 */
+static __m128i divu_sse2(__m128i num, __m128i den)
+{
+	__m128i nlo, nhi, dlo, dhi, qlo, qhi;
+
+	nlo = _mm_unpacklo_epi16(num, _mm_setzero_si128());
+	nhi = _mm_unpackhi_epi16(num, _mm_setzero_si128());
+	dlo = _mm_unpacklo_epi16(den, _mm_setzero_si128());
+	dhi = _mm_unpackhi_epi16(den, _mm_setzero_si128());
+
+	qlo = _mm_cvttps_epi32(_mm_div_ps(_mm_cvtepi32_ps(nlo), _mm_cvtepi32_ps(dlo)));
+	qhi = _mm_cvttps_epi32(_mm_div_ps(_mm_cvtepi32_ps(nhi), _mm_cvtepi32_ps(dhi)));
+
+	return _mm_packs_epi32(qlo, qhi);
+}
+
+static void rgb_core_sse2(__m128i r, __m128i g, __m128i b, __m128i *h, __m128i *s, __m128i *v)
+{
+	__m128i max, min, delta, mr, mg, mb, num, base, none;
+
+	max = _mm_max_epi16(r, _mm_max_epi16(g, b));
+	min = _mm_min_epi16(r, _mm_min_epi16(g, b));
+	delta = _mm_sub_epi16(max, min);
+	none = _mm_cmpeq_epi16(delta, _mm_setzero_si128());
+
+	mr = _mm_cmpeq_epi16(max, r);
+	mg = _mm_andnot_si128(mr, _mm_cmpeq_epi16(max, g));
+	mb = _mm_andnot_si128(_mm_or_si128(mr, mg), _mm_cmpeq_epi16(max, max));
+
+	num = _mm_or_si128(_mm_or_si128(_mm_and_si128(mr, _mm_sub_epi16(g, b)), 
+			_mm_and_si128(mg, _mm_sub_epi16(b, r))), _mm_and_si128(mb, _mm_sub_epi16(r, g)));
+	base = _mm_or_si128(_mm_and_si128(mg, _mm_set1_epi16(85)), 
+			_mm_and_si128(mb, _mm_set1_epi16(171)));
+
+	*h = _mm_add_epi16(base, div_sse2(_mm_mullo_epi16(num, _mm_set1_epi16(43)), delta));
+	*h = _mm_andnot_si128(none, _mm_and_si128(*h, _mm_set1_epi16(0xff)));
+	*s = _mm_andnot_si128(none, divu_sse2(_mm_mullo_epi16(delta, _mm_set1_epi16(255)), max));
+	*v = max;
+}
+
+static int rgb_to_hsb_sse2(const uint8_t *r, const uint8_t *g, const uint8_t *b, 
+			uint8_t *h, uint8_t *s, uint8_t *v, int n)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i vr, vg, vb, h0, s0, v0, h1, s1, v1;
+	int i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		vr = _mm_loadu_si128((const __m128i *) (r + i));
+		vg = _mm_loadu_si128((const __m128i *) (g + i));
+		vb = _mm_loadu_si128((const __m128i *) (b + i));
+
+		rgb_core_sse2(_mm_unpacklo_epi8(vr, zero), _mm_unpacklo_epi8(vg, zero), 
+			_mm_unpacklo_epi8(vb, zero), &h0, &s0, &v0);
+		rgb_core_sse2(_mm_unpackhi_epi8(vr, zero), _mm_unpackhi_epi8(vg, zero), 
+			_mm_unpackhi_epi8(vb, zero), &h1, &s1, &v1);
+
+		_mm_storeu_si128((__m128i *) (h + i), _mm_packus_epi16(h0, h1));
+		_mm_storeu_si128((__m128i *) (s + i), _mm_packus_epi16(s0, s1));
+		_mm_storeu_si128((__m128i *) (v + i), _mm_packus_epi16(v0, v1));
+	}
+
+	return i;
+}
+
+static int blend_sse2(const uint8_t *a, const uint8_t *b, uint8_t *out, int n, int w)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i wa = _mm_set1_epi16(256 - w);
+	const __m128i wb = _mm_set1_epi16(w);
+	__m128i va, vb, lo, hi;
+	int i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		va = _mm_loadu_si128((const __m128i *) (a + i));
+		vb = _mm_loadu_si128((const __m128i *) (b + i));
+
+		lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(va, zero), wa), 
+			_mm_mullo_epi16(_mm_unpacklo_epi8(vb, zero), wb));
+		hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(va, zero), wa), 
+			_mm_mullo_epi16(_mm_unpackhi_epi8(vb, zero), wb));
+
+		_mm_storeu_si128((__m128i *) (out + i), 
+			_mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8)));
+	}
+
+	return i;
+}
+
+#endif
+
+#ifdef HAVE_AVX2
+
+/* AVX2 versions of the cores, 16 colors per register */
+
+__attribute__((target("avx2")))
+static void hsb_core_avx2(__m256i h, __m256i s, __m256i v, __m256i *r, __m256i *g, __m256i *b)
+{
+	const __m256i c255 = _mm256_set1_epi16(255);
+	__m256i region, rem, p, q, t, m0, m1, m2, m3, m4, m5, gray;
+
+	region = _mm256_srli_epi16(_mm256_mullo_epi16(h, _mm256_set1_epi16(191)), 13);
+	rem = _mm256_mullo_epi16(_mm256_sub_epi16(h, _mm256_mullo_epi16(region, _mm256_set1_epi16(43))), 
+			_mm256_set1_epi16(6));
+
+	p = _mm256_srli_epi16(_mm256_mullo_epi16(v, _mm256_sub_epi16(c255, s)), 8);
+	q = _mm256_srli_epi16(_mm256_mullo_epi16(s, rem), 8);
+	q = _mm256_srli_epi16(_mm256_mullo_epi16(v, _mm256_sub_epi16(c255, q)), 8);
+	t = _mm256_srli_epi16(_mm256_mullo_epi16(s, _mm256_sub_epi16(c255, rem)), 8);
+	t = _mm256_srli_epi16(_mm256_mullo_epi16(v, _mm256_sub_epi16(c255, t)), 8);
+
+	m0 = _mm256_cmpeq_epi16(region, _mm256_setzero_si256());
+	m1 = _mm256_cmpeq_epi16(region, _mm256_set1_epi16(1));
+	m2 = _mm256_cmpeq_epi16(region, _mm256_set1_epi16(2));
+	m3 = _mm256_cmpeq_epi16(region, _mm256_set1_epi16(3));
+	m4 = _mm256_cmpeq_epi16(region, _mm256_set1_epi16(4));
+	m5 = _mm256_cmpeq_epi16(region, _mm256_set1_epi16(5));
+
+	*r = _mm256_or_si256(_mm256_or_si256(_mm256_and_si256(_mm256_or_si256(m0, m5), v), 
+			_mm256_and_si256(m1, q)), _mm256_or_si256(_mm256_and_si256(_mm256_or_si256(m2, m3), p), 
+			_mm256_and_si256(m4, t)));
+	*g = _mm256_or_si256(_mm256_or_si256(_mm256_and_si256(m0, t), 
+			_mm256_and_si256(_mm256_or_si256(m1, m2), v)), _mm256_or_si256(_mm256_and_si256(m3, q), 
+			_mm256_and_si256(_mm256_or_si256(m4, m5), p)));
+	*b = _mm256_or_si256(_mm256_or_si256(_mm256_and_si256(_mm256_or_si256(m0, m1), p), 
+			_mm256_and_si256(m2, t)), _mm256_or_si256(_mm256_and_si256(_mm256_or_si256(m3, m4), v), 
+			_mm256_and_si256(m5, q)));
+
+	gray = _mm256_cmpeq_epi16(s, _mm256_setzero_si256());
+	*r = _mm256_blendv_epi8(*r, v, gray);
+	*g = _mm256_blendv_epi8(*g, v, gray);
+	*b = _mm256_blendv_epi8(*b, v, gray);
+}
+
+/* 16 words back to 16 bytes, in order */
+__attribute__((target("avx2")))
+static __m128i pack_avx2(__m256i x)
+{
+	return _mm_packus_epi16(_mm256_castsi256_si128(x), _mm256_extracti128_si256(x, 1));
+}
+
+__attribute__((target("avx2")))
+static __m256i load_avx2(const uint8_t *p)
+{
+	return _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) p));
+}
+
+__attribute__((target("avx2")))
+static int hsb_to_rgb_avx2(const uint8_t *h, const uint8_t *s, const uint8_t *v, 
+			uint8_t *r, uint8_t *g, uint8_t *b, int n)
+{
+	__m256i vr, vg, vb;
+	int i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		hsb_core_avx2(load_avx2(h + i), load_avx2(s + i), load_avx2(v + i), &vr, &vg, &vb);
+
+		_mm_storeu_si128((__m128i *) (r + i), pack_avx2(vr));
+		_mm_storeu_si128((__m128i *) (g + i), pack_avx2(vg));
+		_mm_storeu_si128((__m128i *) (b + i), pack_avx2(vb));
+	}
+
+	return i;
+}
+
+__attribute__((target("avx2")))
+static __m256i div_avx2(__m256i num, __m256i den, int is_signed)
+{
+	__m256i nlo, nhi, dlo, dhi, qlo, qhi;
+
+	if (is_signed) {
+		nlo = _mm256_cvtepi16_epi32(_mm256_castsi256_si128(num));
+		nhi = _mm256_cvtepi16_epi32(_mm256_extracti128_si256(num, 1));
+	}
+	else {
+		nlo = _mm256_cvtepu16_epi32(_mm256_castsi256_si128(num));
+		nhi = _mm256_cvtepu16_epi32(_mm256_extracti128_si256(num, 1));
+	}
+
+	dlo = _mm256_cvtepu16_epi32(_mm256_castsi256_si128(den));
+	dhi = _mm256_cvtepu16_epi32(_mm256_extracti128_si256(den, 1));
+
+	qlo = _mm256_cvttps_epi32(_mm256_div_ps(_mm256_cvtepi32_ps(nlo), _mm256_cvtepi32_ps(dlo)));
+	qhi = _mm256_cvttps_epi32(_mm256_div_ps(_mm256_cvtepi32_ps(nhi), _mm256_cvtepi32_ps(dhi)));
+
+	/* the pack works within each 128 bit half, put the quarters back in order */
+	return _mm256_permute4x64_epi64(_mm256_packs_epi32(qlo, qhi), 0xd8);
+}
+
+__attribute__((target("avx2")))
+static int rgb_to_hsb_avx2(const uint8_t *r, const uint8_t *g, const uint8_t *b, 
+			uint8_t *h, uint8_t *s, uint8_t *v, int n)
+{
+	__m256i vr, vg, vb, max, min, delta, mr, mg, mb, num, base, none, vh, vs;
+	int i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		vr = load_avx2(r + i);
+		vg = load_avx2(g + i);
+		vb = load_avx2(b + i);
+
+		max = _mm256_max_epi16(vr, _mm256_max_epi16(vg, vb));
+		min = _mm256_min_epi16(vr, _mm256_min_epi16(vg, vb));
+		delta = _mm256_sub_epi16(max, min);
+		none = _mm256_cmpeq_epi16(delta, _mm256_setzero_si256());
+
+		mr = _mm256_cmpeq_epi16(max, vr);
+		mg = _mm256_andnot_si256(mr, _mm256_cmpeq_epi16(max, vg));
+		mb = _mm256_andnot_si256(_mm256_or_si256(mr, mg), _mm256_cmpeq_epi16(max, max));
+
+		num = _mm256_or_si256(_mm256_or_si256(_mm256_and_si256(mr, _mm256_sub_epi16(vg, vb)), 
+				_mm256_and_si256(mg, _mm256_sub_epi16(vb, vr))), 
+				_mm256_and_si256(mb, _mm256_sub_epi16(vr, vg)));
+		base = _mm256_or_si256(_mm256_and_si256(mg, _mm256_set1_epi16(85)), 
+				_mm256_and_si256(mb, _mm256_set1_epi16(171)));
+
+		vh = _mm256_add_epi16(base, div_avx2(_mm256_mullo_epi16(num, _mm256_set1_epi16(43)), delta, 1));
+		vh = _mm256_andnot_si256(none, _mm256_and_si256(vh, _mm256_set1_epi16(0xff)));
+		vs = _mm256_andnot_si256(none, div_avx2(_mm256_mullo_epi16(delta, _mm256_set1_epi16(255)), max, 0));
+
+		_mm_storeu_si128((__m128i *) (h + i), pack_avx2(vh));
+		_mm_storeu_si128((__m128i *) (s + i), pack_avx2(vs));
+		_mm_storeu_si128((__m128i *) (v + i), pack_avx2(max));
+	}
+
+	return i;
+}
+
+__attribute__((target("avx2")))
+static int blend_avx2(const uint8_t *a, const uint8_t *b, uint8_t *out, int n, int w)
+{
+	const __m256i wa = _mm256_set1_epi16(256 - w);
+	const __m256i wb = _mm256_set1_epi16(w);
+	__m256i x;
+	int i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		x = _mm256_add_epi16(_mm256_mullo_epi16(load_avx2(a + i), wa), 
+			_mm256_mullo_epi16(load_avx2(b + i), wb));
+
+		_mm_storeu_si128((__m128i *) (out + i), pack_avx2(_mm256_srli_epi16(x, 8)));
+	}
+
+	return i;
+}
+
+#endif
+
@@ -0,0 +1,60 @@
+/*
+	Copyright (c) 2009, Scott Ellis
+	All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+		* Redistributions of source code must retain the above copyright
+		  notice, this list of conditions and the following disclaimer.
+		* Redistributions in binary form must reproduce the above copyright
+		  notice, this list of conditions and the following disclaimer in the
+		  documentation and/or other materials provided with the distribution.
+		* Neither the name of the <organization> nor the
+		  names of its contributors may be used to endorse or promote products
+		  derived from this software without specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY Scott Ellis ''AS IS'' AND ANY
+	EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+	WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+	DISCLAIMED. IN NO EVENT SHALL Scott Ellis BE LIABLE FOR ANY
+	DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+	(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+	LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+	ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+	(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+	SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#ifndef BLINKM_COLOR_H
+#define BLINKM_COLOR_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* 
+ * Colors use the same 8 bit H, S, B ranges the BlinkM commands take,
+ * a hue of 0-255 for the whole circle.
+ */
+void blinkm_hsb_to_rgb(uint8_t h, uint8_t s, uint8_t v, uint8_t *rgb);
+void blinkm_rgb_to_hsb(uint8_t r, uint8_t g, uint8_t b, uint8_t *hsb);
+
+/* whole planes, one channel per array and n colors in each */
+void blinkm_hsb_to_rgb_n(const uint8_t *h, const uint8_t *s, const uint8_t *v, 
+		uint8_t *r, uint8_t *g, uint8_t *b, int n);
+void blinkm_rgb_to_hsb_n(const uint8_t *r, const uint8_t *g, const uint8_t *b, 
+		uint8_t *h, uint8_t *s, uint8_t *v, int n);
+void blinkm_blend_n(const uint8_t *a, const uint8_t *b, uint8_t *out, int n, uint8_t alpha);
+void blinkm_scale_n(uint8_t *plane, int n, uint8_t level);
+void blinkm_gamma_table(uint8_t *lut, double gamma, uint8_t level);
+void blinkm_lut_n(uint8_t *plane, int n, const uint8_t *lut);
+
+int blinkm_color_simd(int enable);
+const char *blinkm_color_isa(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,519 @@
+/*
+	Copyright (c) 2009, Scott Ellis
+	All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+		* Redistributions of source code must retain the above copyright
+		  notice, this list of conditions and the following disclaimer.
+		* Redistributions in binary form must reproduce the above copyright
+		  notice, this list of conditions and the following disclaimer in the
+		  documentation and/or other materials provided with the distribution.
+		* Neither the name of the <organization> nor the
+		  names of its contributors may be used to endorse or promote products
+		  derived from this software without specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY Scott Ellis ''AS IS'' AND ANY
+	EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+	WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+	DISCLAIMED. IN NO EVENT SHALL Scott Ellis BE LIABLE FOR ANY
+	DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+	(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+	LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+	ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+	(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+	SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "blinkm_daemon.h"
+
+#define MAX_CLIENTS 16
+#define MAX_LINE 1024
+
+/* 
+ * A client's replies are written without blocking. While one is still
+ * waiting in _out no more of its lines are run, so a client that doesn't
+ * read its replies only holds up itself.
+ */
+struct client {
+	int _fd;
+	int _eof;
+	int _len;
+	char _buff[MAX_LINE + 1];
+	char *_out;
+	size_t _out_len;
+	size_t _out_sent;
+};
+
+static volatile sig_atomic_t done;
+
+static void handle_signal(int sig);
+static int open_listener(const char *path);
+static int run_client_lines(struct client *c, blinkm_line_handler handler, void *ctx);
+static int read_client(struct client *c);
+static int flush_client(struct client *c);
+static void close_client(struct client *c);
+static int connect_daemon(const char *path);
+static int write_all(int fd, const char *buff, int len);
+
+
+/*
+ * Serve command lines on a unix domain socket until SIGINT or SIGTERM.
+ * Lines from every client run one at a time on the caller's thread, so the
+ * handler has the bus to itself. Each reply ends with a single NUL byte.
+ */
+int blinkm_daemon_run(const char *path, blinkm_line_handler handler, void *ctx)
+{
+	struct pollfd fds[MAX_CLIENTS + 1];
+	struct client clients[MAX_CLIENTS];
+	struct client *c;
+	int i, fd, listener, result, ok;
+
+	if (!path)
+		path = BLINKM_DEFAULT_SOCKET;
+
+	listener = open_listener(path);
+
+	if (listener < 0)
+		return -1;
+
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, handle_signal);
+	signal(SIGTERM, handle_signal);
+
+	for (i = 0; i < MAX_CLIENTS; i++) {
+		memset(&clients[i], 0, sizeof(struct client));
+		clients[i]._fd = -1;
+	}
+
+	fprintf(stderr, "blinkm daemon listening on %s\n", path);
+
+	while (!done) {
+		fds[0].fd = listener;
+		fds[0].events = POLLIN;
+
+		for (i = 0; i < MAX_CLIENTS; i++) {
+			fds[i + 1].fd = clients[i]._fd;
+			fds[i + 1].events = clients[i]._out ? POLLOUT : POLLIN;
+		}
+
+		result = poll(fds, MAX_CLIENTS + 1, -1);
+
+		if (result < 0) {
+			if (errno == EINTR)
+				continue;
+
+			fprintf(stderr, "poll: %s\n", strerror(errno));
+			break;
+		}
+
+		if (fds[0].revents & POLLIN) {
+			fd = accept(listener, NULL, NULL);
+
+			for (i = 0; fd >= 0 && i < MAX_CLIENTS; i++) {
+				if (clients[i]._fd < 0) {
+					fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+					clients[i]._fd = fd;
+					clients[i]._eof = 0;
+					clients[i]._len = 0;
+					break;
+				}
+			}
+
+			if (fd >= 0 && i == MAX_CLIENTS) {
+				fprintf(stderr, "Too many clients, dropping connection\n");
+				close(fd);
+			}
+		}
+
+		for (i = 0; i < MAX_CLIENTS; i++) {
+			c = &clients[i];
+
+			if (c->_fd < 0 || !fds[i + 1].revents)
+				continue;
+
+			if (c->_out) 
+				ok = flush_client(c);
+			else
+				ok = read_client(c);
+
+			/* lines held back while a reply was waiting run now */
+			if (ok > 0 && !c->_out)
+				ok = run_client_lines(c, handler, ctx);
+
+			if (ok <= 0 || (c->_eof && c->_len == 0 && !c->_out))
+				close_client(c);
+		}
+	}
+
+	for (i = 0; i < MAX_CLIENTS; i++) 
+		if (clients[i]._fd >= 0)
+			close_client(&clients[i]);
+
+	close(listener);
+	unlink(path);
+
+	return 1;
+}
+
+/*
+ * Send a single command, or every line on stdin if argc is zero, and copy
+ * the replies to stdout. Lines are pipelined, the daemon closes the 
+ * connection once it has answered everything we sent.
+ */
+int blinkm_client_run(const char *path, int argc, char **argv)
+{
+	struct pollfd fds[2];
+	char buff[MAX_LINE], in[MAX_LINE];
+	int i, fd, n, len, in_len, in_sent, stdin_open;
+
+	if (!path)
+		path = BLINKM_DEFAULT_SOCKET;
+
+	fd = connect_daemon(path);
+
+	if (fd < 0)
+		return -1;
+
+	signal(SIGPIPE, SIG_IGN);
+
+	stdin_open = 0;
+
+	if (argc > 0) {
+		len = 0;
+		buff[0] = 0;
+
+		for (i = 0; i < argc; i++) {
+			n = snprintf(buff + len, sizeof(buff) - len, "%s%s", 
+					i > 0 ? " " : "", argv[i]);
+
+			if (n < 0 || n >= (int) sizeof(buff) - len - 1) {
+				fprintf(stderr, "Command line too long\n");
+				close(fd);
+				return -1;
+			}
+
+			len += n;
+		}
+
+		buff[len++] = '\n';
+
+		if (write_all(fd, buff, len) < 0) {
+			close(fd);
+			return -1;
+		}
+
+		shutdown(fd, SHUT_WR);
+	}
+	else {
+		stdin_open = 1;
+	}
+
+	/* 
+	 * The daemon stops reading our lines while a reply is waiting, so 
+	 * never block writing lines without reading the replies.
+	 */
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	in_len = 0;
+	in_sent = 0;
+
+	while (1) {
+		fds[0].fd = fd;
+		fds[0].events = POLLIN | (in_sent < in_len ? POLLOUT : 0);
+		fds[1].fd = stdin_open && in_sent == in_len ? STDIN_FILENO : -1;
+		fds[1].events = POLLIN;
+
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+
+			break;
+		}
+
+		if (fds[1].revents) {
+			n = read(STDIN_FILENO, in, sizeof(in));
+
+			if (n > 0) {
+				in_len = n;
+				in_sent = 0;
+			}
+			else {
+				stdin_open = 0;
+				shutdown(fd, SHUT_WR);
+			}
+		}
+
+		if (fds[0].revents & POLLOUT) {
+			n = write(fd, in + in_sent, in_len - in_sent);
+
+			if (n > 0)
+				in_sent += n;
+			else if (errno != EAGAIN && errno != EINTR)
+				break;
+		}
+
+		if (fds[0].revents & ~POLLOUT) {
+			n = read(fd, buff, sizeof(buff));
+
+			if (n < 0 && (errno == EAGAIN || errno == EINTR))
+				continue;
+
+			if (n <= 0)
+				break;
+
+			/* drop the NUL reply terminators */
+			for (i = 0, len = 0; i < n; i++) 
+				if (buff[i])
+					buff[len++] = buff[i];
+
+			write_all(STDOUT_FILENO, buff, len);
+		}
+	}
+
+	close(fd);
+
+	return 1;
+}
+
+static void handle_signal(int sig)
+{
+	(void) sig;
+	done = 1;
+}
+
+static int open_listener(const char *path)
+{
+	struct sockaddr_un addr;
+	struct stat st;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path too long: %s\n", path);
+		return -1;
+	}
+
+	/* a stale socket left by a daemon that didn't exit cleanly, never anything else */
+	if (lstat(path, &st) == 0) {
+		if (!S_ISSOCK(st.st_mode)) {
+			fprintf(stderr, "%s exists and is not a socket\n", path);
+			return -1;
+		}
+
+		unlink(path);
+	}
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	if (fd < 0) {
+		fprintf(stderr, "socket: %s\n", strerror(errno));
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0
+			|| listen(fd, MAX_CLIENTS) < 0) {
+		fprintf(stderr, "Could not listen on %s: %s\n", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * Run the complete lines in the client buffer, stopping at one whose reply
+ * can't be written yet. stdout and stderr are pointed at a memory stream 
+ * for the client while the handler runs, which glibc allows, so a reply 
+ * costs a single write.
+ * Return 0 if the client should be dropped.
+ */
+static int run_client_lines(struct client *c, blinkm_line_handler handler, void *ctx)
+{
+	FILE *out, *saved_out, *saved_err;
+	int start, i;
+
+	start = 0;
+
+	for (i = 0; i < c->_len && !c->_out; i++) {
+		if (c->_buff[i] != '\n') 
+			continue;
+
+		c->_buff[i] = 0;
+
+		out = open_memstream(&c->_out, &c->_out_len);
+
+		if (!out) {
+			fprintf(stderr, "open_memstream: %s\n", strerror(errno));
+			return 0;
+		}
+
+		fflush(stdout);
+		saved_out = stdout;
+		saved_err = stderr;
+		stdout = out;
+		stderr = out;
+
+		handler(c->_buff + start, ctx);
+
+		stdout = saved_out;
+		stderr = saved_err;
+
+		/* every reply ends with a NUL */
+		fputc(0, out);
+
+		if (fclose(out) != 0) {
+			free(c->_out);
+			c->_out = NULL;
+			return 0;
+		}
+
+		c->_out_sent = 0;
+		start = i + 1;
+
+		if (flush_client(c) < 1)
+			return 0;
+	}
+
+	if (start == 0 && c->_len == MAX_LINE) {
+		fprintf(stderr, "Command line too long, dropping client\n");
+		return 0;
+	}
+
+	memmove(c->_buff, c->_buff + start, c->_len - start);
+	c->_len -= start;
+
+	return 1;
+}
+
+/*
+ * Return 0 if the client should be dropped.
+ */
+static int read_client(struct client *c)
+{
+	int n;
+
+	n = read(c->_fd, c->_buff + c->_len, MAX_LINE - c->_len);
+
+	if (n > 0) {
+		c->_len += n;
+	}
+	else if (n == 0) {
+		c->_eof = 1;
+
+		/* last line without a newline */
+		if (c->_len > 0)
+			c->_buff[c->_len++] = '\n';
+	}
+	else if (errno != EAGAIN && errno != EINTR) {
+		return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Write as much of the waiting reply as the socket takes.
+ * Return 0 if the client should be dropped.
+ */
+static int flush_client(struct client *c)
+{
+	ssize_t n;
+
+	while (c->_out_sent < c->_out_len) {
+		n = write(c->_fd, c->_out + c->_out_sent, c->_out_len - c->_out_sent);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+
+			return errno == EAGAIN ? 1 : 0;
+		}
+
+		c->_out_sent += n;
+	}
+
+	free(c->_out);
+	c->_out = NULL;
+
+	return 1;
+}
+
+static void close_client(struct client *c)
+{
+	close(c->_fd);
+	c->_fd = -1;
+
+	if (c->_out) {
+		free(c->_out);
+		c->_out = NULL;
+	}
+}
+
+static int connect_daemon(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path too long: %s\n", path);
+		return -1;
+	}
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	if (fd < 0) {
+		fprintf(stderr, "socket: %s\n", strerror(errno));
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		fprintf(stderr, "Could not connect to blinkm daemon on %s: %s\n", 
+				path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static int write_all(int fd, const char *buff, int len)
+{
+	int n;
+
+	while (len > 0) {
+		n = write(fd, buff, len);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+
+			return -1;
+		}
+
+		buff += n;
+		len -= n;
+	}
+
+	return 1;
+}
@@ -0,0 +1,407 @@
+/*
+	Copyright (c) 2009, Scott Ellis
+	All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+		* Redistributions of source code must retain the above copyright
+		  notice, this list of conditions and the following disclaimer.
+		* Redistributions in binary form must reproduce the above copyright
+		  notice, this list of conditions and the following disclaimer in the
+		  documentation and/or other materials provided with the distribution.
+		* Neither the name of the <organization> nor the
+		  names of its contributors may be used to endorse or promote products
+		  derived from this software without specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY Scott Ellis ''AS IS'' AND ANY
+	EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+	WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+	DISCLAIMED. IN NO EVENT SHALL Scott Ellis BE LIABLE FOR ANY
+	DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+	(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+	LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+	ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+	(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+	SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <linux/i2c.h>
+
+#include "i2c_functions.h"
+#include "i2c_blinkm.h"
+#include "i2c_scan.h"
+#include "blinkm_regs.h"
+#include "blinkm_inventory.h"
+
+static int parse_line(char *line, struct blinkm_inventory_bus *b);
+static int firmware_value(const char *name);
+static const char *firmware_name(int firmware, char *buff, int size);
+
+
+const char *blinkm_inventory_path(void)
+{
+	const char *path = getenv("BLINKM_INVENTORY");
+
+	return path && *path ? path : BLINKM_INVENTORY_FILE;
+}
+
+/*
+ * The file has one line per bus, the bus, the time it was scanned and
+ * the devices found as address:type.
+ *
+ *   /dev/i2c-3 1760000000 9:blinkm 10:blinkm 11:maxm
+ *
+ * Return the number of buses, 0 if there is no file yet, -1 on errors.
+ */
+int blinkm_inventory_load(struct blinkm_inventory *inv, const char *path)
+{
+	char line[2048], *p;
+	FILE *fp;
+	int line_no;
+
+	memset(inv, 0, sizeof(struct blinkm_inventory));
+
+	fp = fopen(path, "r");
+
+	if (!fp) 
+		return errno == ENOENT ? 0 : -1;
+
+	line_no = 0;
+
+	while (inv->_count < BLINKM_INVENTORY_BUSES && fgets(line, sizeof(line), fp)) {
+		line_no++;
+
+		p = strchr(line, '#');
+
+		if (p)
+			*p = 0;
+
+		switch (parse_line(line, &inv->_bus[inv->_count])) {
+		case 1:
+			inv->_count++;
+			break;
+
+		case -1:
+			fprintf(stderr, "%s line %d: bad inventory entry ignored\n", path, line_no);
+			break;
+		}
+	}
+
+	fclose(fp);
+
+	return inv->_count;
+}
+
+/*
+ * Written to a temporary file and renamed, so a reader never sees half
+ * an inventory. Each writer gets its own temporary file, when two race
+ * the last rename wins.
+ */
+int blinkm_inventory_save(struct blinkm_inventory *inv, const char *path)
+{
+	char tmp[512], dir[512], type[16], *slash;
+	struct blinkm_inventory_bus *b;
+	FILE *fp;
+	int i, j, fd;
+
+	snprintf(dir, sizeof(dir), "%s", path);
+	slash = strrchr(dir, '/');
+
+	if (slash && slash != dir) {
+		*slash = 0;
+		mkdir(dir, 0755);
+	}
+
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+
+	fd = mkstemp(tmp);
+
+	if (fd < 0)
+		return -1;
+
+	fchmod(fd, 0644);
+
+	fp = fdopen(fd, "w");
+
+	if (!fp) {
+		close(fd);
+		remove(tmp);
+		return -1;
+	}
+
+	fprintf(fp, "# blinkm inventory, written by find-leds\n"
+		"# bus scanned address:type ...\n");
+
+	for (i = 0; i < inv->_count; i++) {
+		b = &inv->_bus[i];
+
+		fprintf(fp, "%s %ld", b->_bus, (long) b->_scanned);
+
+		for (j = 0; j < b->_count; j++) 
+			fprintf(fp, " %d:%s", b->_addr[j], 
+				firmware_name(b->_firmware[j], type, sizeof(type)));
+
+		fprintf(fp, "\n");
+	}
+
+	if (fclose(fp) != 0 || rename(tmp, path) < 0) {
+		remove(tmp);
+		return -1;
+	}
+
+	return 1;
+}
+
+struct blinkm_inventory_bus *blinkm_inventory_find(struct blinkm_inventory *inv, const char *bus_name)
+{
+	int i;
+
+	for (i = 0; i < inv->_count; i++) {
+		if (!strcmp(inv->_bus[i]._bus, bus_name))
+			return &inv->_bus[i];
+	}
+
+	return NULL;
+}
+
+/*
+ * Replace what is known about the scan's bus. When the inventory is full
+ * the bus scanned longest ago makes room.
+ */
+void blinkm_inventory_set(struct blinkm_inventory *inv, const struct blinkm_scan *scan)
+{
+	struct blinkm_inventory_bus *b;
+	int i;
+
+	b = blinkm_inventory_find(inv, scan->_bus);
+
+	if (!b && inv->_count < BLINKM_INVENTORY_BUSES) {
+		b = &inv->_bus[inv->_count++];
+	}
+	else if (!b) {
+		b = &inv->_bus[0];
+
+		for (i = 1; i < inv->_count; i++) {
+			if (inv->_bus[i]._scanned < b->_scanned)
+				b = &inv->_bus[i];
+		}
+	}
+
+	snprintf(b->_bus, sizeof(b->_bus), "%s", scan->_bus);
+	b->_scanned = time(NULL);
+	b->_count = scan->_count < 127 ? scan->_count : 127;
+	memcpy(b->_addr, scan->_addr, b->_count);
+
+	for (i = 0; i < b->_count; i++)
+		b->_firmware[i] = scan->_firmware[i];
+}
+
+/*
+ * Ask every device in the entry for its firmware version in one transfer
+ * instead of probing all 127 addresses. Any device missing or changed 
+ * fails the check. New devices aren't noticed until the entry goes stale
+ * or find-leds runs again.
+ * Return 1 if every device answered as recorded.
+ */
+int blinkm_inventory_check(struct i2c_session *bus, const struct blinkm_inventory_bus *b)
+{
+	struct i2c_msg msgs[2 * 127];
+	uint8_t cmd[1], reply[127][2];
+	int i, firmware;
+
+	if (b->_count == 0)
+		return 1;
+
+	if (!(bus->_funcs & I2C_FUNC_I2C)) {
+		for (i = 0; i < b->_count; i++) {
+			if (blinkm_get_firmware_version(bus, b->_addr[i], 0) != b->_firmware[i])
+				return 0;
+		}
+
+		return 1;
+	}
+
+	/* every write is the same single byte, they can share it */
+	blinkm_encode(GET_FIRMWARE_VERSION, NULL, 0, cmd, sizeof(cmd));
+
+	for (i = 0; i < b->_count; i++) {
+		msgs[2 * i].addr = b->_addr[i];
+		msgs[2 * i].flags = 0;
+		msgs[2 * i].len = 1;
+		msgs[2 * i].buf = cmd;
+
+		msgs[(2 * i) + 1].addr = b->_addr[i];
+		msgs[(2 * i) + 1].flags = I2C_M_RD;
+		msgs[(2 * i) + 1].len = 2;
+		msgs[(2 * i) + 1].buf = reply[i];
+	}
+
+	if (i2c_transfer(bus, msgs, 2 * b->_count) != 2 * b->_count)
+		return 0;
+
+	for (i = 0; i < b->_count; i++) {
+		firmware = (reply[i][0] << 8) | reply[i][1];
+
+		if (firmware != b->_firmware[i])
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * The leds on the session's bus from the inventory, if it has a recent
+ * enough entry for the bus that still checks out. leds needs room for 
+ * 127 addresses.
+ * Return the number of leds or -1 if the bus needs a scan.
+ */
+int blinkm_inventory_leds(struct i2c_session *bus, uint8_t *leds)
+{
+	struct blinkm_inventory inv;
+	struct blinkm_inventory_bus *b;
+	time_t now;
+
+	if (i2c_is_simulated(bus))
+		return -1;
+
+	if (blinkm_inventory_load(&inv, blinkm_inventory_path()) < 1)
+		return -1;
+
+	b = blinkm_inventory_find(&inv, bus->_bus);
+
+	if (!b)
+		return -1;
+
+	now = time(NULL);
+
+	if (now < b->_scanned || now - b->_scanned > BLINKM_INVENTORY_MAX_AGE)
+		return -1;
+
+	if (!blinkm_inventory_check(bus, b))
+		return -1;
+
+	memcpy(leds, b->_addr, b->_count);
+
+	return b->_count;
+}
+
+/*
+ * Record new scans, the ones with _error set are skipped and so are 
+ * simulated buses, which only exist in the process. verbose 
+ * reports a failure to write the file, commands that only scanned on
+ * the side don't care.
+ * Return -1 if the inventory couldn't be written.
+ */
+int blinkm_inventory_update(const struct blinkm_scan *scans, int count, int verbose)
+{
+	struct blinkm_inventory inv;
+	const char *path;
+	int i, n;
+
+	for (i = 0, n = 0; i < count; i++) {
+		if (!scans[i]._error && strncmp(scans[i]._bus, "sim", 3))
+			n++;
+	}
+
+	if (n == 0)
+		return 1;
+
+	path = blinkm_inventory_path();
+
+	if (blinkm_inventory_load(&inv, path) < 0)
+		memset(&inv, 0, sizeof(inv));
+
+	for (i = 0; i < count; i++) {
+		if (!scans[i]._error && strncmp(scans[i]._bus, "sim", 3))
+			blinkm_inventory_set(&inv, &scans[i]);
+	}
+
+	if (blinkm_inventory_save(&inv, path) < 0) {
+		if (verbose)
+			fprintf(stderr, "Could not write the inventory %s: %s\n", path, strerror(errno));
+
+		return -1;
+	}
+
+	return 1;
+}
+
+/*
+ * Return 1 for a bus entry, 0 for a blank line, -1 for a bad one.
+ */
+static int parse_line(char *line, struct blinkm_inventory_bus *b)
+{
+	char *p, *save, *colon, *end;
+	long addr;
+
+	memset(b, 0, sizeof(struct blinkm_inventory_bus));
+
+	p = strtok_r(line, " \t\r\n", &save);
+
+	if (!p)
+		return 0;
+
+	snprintf(b->_bus, sizeof(b->_bus), "%s", p);
+
+	p = strtok_r(NULL, " \t\r\n", &save);
+
+	if (!p)
+		return -1;
+
+	b->_scanned = strtol(p, &end, 10);
+
+	if (*end)
+		return -1;
+
+	while ((p = strtok_r(NULL, " \t\r\n", &save)) && b->_count < 127) {
+		colon = strchr(p, ':');
+
+		if (!colon)
+			return -1;
+
+		*colon++ = 0;
+		addr = strtol(p, &end, 0);
+
+		if (*end || addr < 1 || addr > 127)
+			return -1;
+
+		b->_addr[b->_count] = addr;
+		b->_firmware[b->_count] = firmware_value(colon);
+		b->_count++;
+	}
+
+	return 1;
+}
+
+static int firmware_value(const char *name)
+{
+	if (!strcmp(name, "blinkm"))
+		return BLINKM_DEVICE_FIRMWARE;
+
+	if (!strcmp(name, "maxm"))
+		return MAXM_DEVICE_FIRMWARE;
+
+	return strtol(name, NULL, 0);
+}
+
+static const char *firmware_name(int firmware, char *buff, int size)
+{
+	if (firmware == BLINKM_DEVICE_FIRMWARE)
+		return "blinkm";
+
+	if (firmware == MAXM_DEVICE_FIRMWARE)
+		return "maxm";
+
+	snprintf(buff, size, "0x%04x", firmware);
+
+	return buff;
+}
@@ -0,0 +1,78 @@
+/*
+	Copyright (c) 2009, Scott Ellis
+	All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+		* Redistributions of source code must retain the above copyright
+		  notice, this list of conditions and the following disclaimer.
+		* Redistributions in binary form must reproduce the above copyright
+		  notice, this list of conditions and the following disclaimer in the
+		  documentation and/or other materials provided with the distribution.
+		* Neither the name of the <organization> nor the
+		  names of its contributors may be used to endorse or promote products
+		  derived from this software without specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY Scott Ellis ''AS IS'' AND ANY
+	EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+	WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+	DISCLAIMED. IN NO EVENT SHALL Scott Ellis BE LIABLE FOR ANY
+	DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+	(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+	LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+	ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+	(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+	SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+
+#ifndef BLINKM_INVENTORY_H
+#define BLINKM_INVENTORY_H
+
+#define BLINKM_INVENTORY_FILE "/var/lib/blinkm/inventory"
+
+/* buses kept in the file, the oldest scan is dropped to make room */
+#define BLINKM_INVENTORY_BUSES 16
+
+/* a bus scanned longer ago than this gets a full scan again */
+#define BLINKM_INVENTORY_MAX_AGE (24 * 60 * 60)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct i2c_session;
+struct blinkm_scan;
+
+struct blinkm_inventory_bus {
+	char _bus[64];
+	time_t _scanned;
+	int _count;
+	uint8_t _addr[127];
+	int _firmware[127];
+};
+
+/* 
+ * The devices find-leds found on each bus, kept in a file so later 
+ * commands don't have to scan. $BLINKM_INVENTORY overrides the path.
+ */
+struct blinkm_inventory {
+	int _count;
+	struct blinkm_inventory_bus _bus[BLINKM_INVENTORY_BUSES];
+};
+
+const char *blinkm_inventory_path(void);
+int blinkm_inventory_load(struct blinkm_inventory *inv, const char *path);
+int blinkm_inventory_save(struct blinkm_inventory *inv, const char *path);
+struct blinkm_inventory_bus *blinkm_inventory_find(struct blinkm_inventory *inv, const char *bus_name);
+void blinkm_inventory_set(struct blinkm_inventory *inv, const struct blinkm_scan *scan);
+int blinkm_inventory_check(struct i2c_session *bus, const struct blinkm_inventory_bus *b);
+int blinkm_inventory_leds(struct i2c_session *bus, uint8_t *leds);
+int blinkm_inventory_update(const struct blinkm_scan *scans, int count, int verbose);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,567 @@
+/*
+	Copyright (c) 2009, Scott Ellis
+	All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+		* Redistributions of source code must retain the above copyright
+		  notice, this list of conditions and the following disclaimer.
+		* Redistributions in binary form must reproduce the above copyright
+		  notice, this list of conditions and the following disclaimer in the
+		  documentation and/or other materials provided with the distribution.
+		* Neither the name of the <organization> nor the
+		  names of its contributors may be used to endorse or promote products
+		  derived from this software without specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY Scott Ellis ''AS IS'' AND ANY
+	EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+	WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+	DISCLAIMED. IN NO EVENT SHALL Scott Ellis BE LIABLE FOR ANY
+	DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+	(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+	LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+	ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+	(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+	SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * An asynchronous front end for the blinkm commands. Any thread can submit
+ * requests without blocking, a single bus thread owns the session and 
+ * drains them, sending consecutive write-only commands as one batched 
+ * transfer. Color commands that a newer one for the same led replaces
+ * before they reach the bus are dropped, so a producer running faster 
+ * than the bus costs at most one write per led each time the queue is 
+ * drained.
+ *
+ * A finished request goes to its callback, on the bus thread, or if it 
+ * has none to the completion ring. The completion eventfd is readable 
+ * while completions are waiting. Only one thread should take completions.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "utility.h"
+#include "i2c_functions.h"
+#include "i2c_blinkm.h"
+#include "blinkm_regs.h"
+#include "blinkm_queue.h"
+
+static int ring_init(struct blinkm_ring *r, int size);
+static void ring_free(struct blinkm_ring *r);
+static int ring_push(struct blinkm_ring *r, const struct blinkm_request *req);
+static int ring_pop(struct blinkm_ring *r, struct blinkm_request *req);
+static int ring_empty(struct blinkm_ring *r);
+static void *bus_thread(void *arg);
+static void wait_for_work(struct blinkm_queue *q);
+static void coalesce(struct blinkm_queue *q, struct blinkm_request *reqs, int count);
+static int is_color_cmd(struct blinkm_request *req);
+static void run_requests(struct blinkm_queue *q, struct blinkm_request *reqs, int count);
+static void send_batch(struct blinkm_queue *q, struct blinkm_batch *b, struct blinkm_request **pending);
+static void finish_requests(struct blinkm_queue *q, struct blinkm_request *reqs, int count);
+
+
+/*
+ * The size is rounded up to a power of two. 
+ * Return a value less then zero on failure.
+ */
+int blinkm_queue_start(struct blinkm_queue *q, struct i2c_session *bus, int size)
+{
+	int n;
+
+	if (!q || !bus)
+		return -1;
+
+	memset(q, 0, sizeof(struct blinkm_queue));
+	q->_bus = bus;
+	q->_wake_fd = -1;
+	q->_event_fd = -1;
+	q->_coalesce = 1;
+
+	if (size < 1)
+		size = BLINKM_QUEUE_DEFAULT_SIZE;
+
+	for (n = 2; n < size; n <<= 1)
+		;
+
+	if (ring_init(&q->_pending, n) < 0 || ring_init(&q->_completed, n) < 0) 
+		goto fail;
+
+	/* the whole queue can be taken at once, the more seen the more coalesced */
+	q->_drain = calloc(n, sizeof(struct blinkm_request));
+
+	if (!q->_drain) {
+		fprintf(stderr, "Out of memory for a queue of %d\n", n);
+		goto fail;
+	}
+
+	q->_drain_size = n;
+
+	q->_wake_fd = eventfd(0, EFD_CLOEXEC);
+	q->_event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+	if (q->_wake_fd < 0 || q->_event_fd < 0) {
+		perror("eventfd");
+		goto fail;
+	}
+
+	pthread_mutex_init(&q->_idle_lock, NULL);
+	pthread_cond_init(&q->_idle, NULL);
+
+	if (pthread_create(&q->_thread, NULL, bus_thread, q)) {
+		fprintf(stderr, "Could not start the bus thread\n");
+		pthread_mutex_destroy(&q->_idle_lock);
+		pthread_cond_destroy(&q->_idle);
+		goto fail;
+	}
+
+	return 1;
+
+fail:
+	ring_free(&q->_pending);
+	ring_free(&q->_completed);
+
+	if (q->_drain)
+		free(q->_drain);
+
+	if (q->_wake_fd >= 0)
+		close(q->_wake_fd);
+
+	if (q->_event_fd >= 0)
+		close(q->_event_fd);
+
+	q->_bus = NULL;
+
+	return -1;
+}
+
+/*
+ * Everything already submitted is sent before the bus thread exits.
+ */
+void blinkm_queue_stop(struct blinkm_queue *q)
+{
+	uint64_t one = 1;
+
+	if (!q || !q->_bus)
+		return;
+
+	__atomic_store_n(&q->_stop, 1, __ATOMIC_SEQ_CST);
+
+	if (write(q->_wake_fd, &one, sizeof(one)) < 0)
+		perror("write eventfd");
+
+	pthread_join(q->_thread, NULL);
+
+	pthread_mutex_destroy(&q->_idle_lock);
+	pthread_cond_destroy(&q->_idle);
+	ring_free(&q->_pending);
+	ring_free(&q->_completed);
+	free(q->_drain);
+	close(q->_wake_fd);
+	close(q->_event_fd);
+
+	q->_drain = NULL;
+	q->_bus = NULL;
+}
+
+/*
+ * Never blocks. The request is copied.
+ * Return 1 if queued, -1 with errno EAGAIN if the queue is full.
+ */
+int blinkm_queue_submit(struct blinkm_queue *q, const struct blinkm_request *req)
+{
+	uint64_t one = 1;
+
+	if (!q || !q->_bus || !req || req->_len < 1 || req->_len > BLINKM_MAX_CMD_LEN 
+			|| req->_reply_len > BLINKM_MAX_CMD_LEN) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (ring_push(&q->_pending, req) < 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	__atomic_add_fetch(&q->_submitted, 1, __ATOMIC_SEQ_CST);
+
+	/* only costs a syscall when the bus thread is idle */
+	if (__atomic_load_n(&q->_sleeping, __ATOMIC_SEQ_CST)) {
+		if (write(q->_wake_fd, &one, sizeof(one)) < 0)
+			perror("write eventfd");
+	}
+
+	return 1;
+}
+
+/*
+ * Submit one write-only command, see blinkm_encode_cmd().
+ */
+int blinkm_queue_cmd(struct blinkm_queue *q, uint8_t led, uint8_t cmd, uint8_t a1, uint8_t a2, 
+		uint8_t a3, blinkm_done_fn done, void *ctx)
+{
+	struct blinkm_request req;
+	int len;
+
+	memset(&req, 0, sizeof(req));
+
+	len = blinkm_encode_cmd(cmd, a1, a2, a3, req._data);
+
+	if (len < 0) {
+		fprintf(stderr, "Command 0x%02X can't be queued\n", cmd);
+		errno = EINVAL;
+		return -1;
+	}
+
+	req._led = led;
+	req._len = len;
+	req._done = done;
+	req._ctx = ctx;
+
+	return blinkm_queue_submit(q, &req);
+}
+
+/*
+ * Take one finished request that had no callback.
+ * Return 1 if req was filled in, 0 if there was nothing waiting.
+ */
+int blinkm_queue_completion(struct blinkm_queue *q, struct blinkm_request *req)
+{
+	uint64_t count;
+
+	if (!q || !q->_bus || !req)
+		return 0;
+
+	if (ring_pop(&q->_completed, req))
+		return 1;
+
+	/* reset the eventfd, then look again for anything that raced with it */
+	if (read(q->_event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		perror("read eventfd");
+
+	return ring_pop(&q->_completed, req);
+}
+
+int blinkm_queue_event_fd(struct blinkm_queue *q)
+{
+	return q ? q->_event_fd : -1;
+}
+
+/*
+ * Block until everything submitted so far has been sent. This is for the
+ * end of a program, not for application threads in a loop.
+ */
+void blinkm_queue_flush(struct blinkm_queue *q)
+{
+	uint64_t target;
+
+	if (!q || !q->_bus)
+		return;
+
+	target = __atomic_load_n(&q->_submitted, __ATOMIC_SEQ_CST);
+
+	pthread_mutex_lock(&q->_idle_lock);
+
+	while (__atomic_load_n(&q->_finished, __ATOMIC_SEQ_CST) < target)
+		pthread_cond_wait(&q->_idle, &q->_idle_lock);
+
+	pthread_mutex_unlock(&q->_idle_lock);
+}
+
+static void *bus_thread(void *arg)
+{
+	struct blinkm_queue *q = (struct blinkm_queue *) arg;
+	int n;
+
+	while (1) {
+		for (n = 0; n < q->_drain_size; n++) {
+			if (!ring_pop(&q->_pending, &q->_drain[n]))
+				break;
+
+			q->_drain[n]._result = -1;
+		}
+
+		if (n > 0) {
+			if (q->_coalesce)
+				coalesce(q, q->_drain, n);
+
+			run_requests(q, q->_drain, n);
+			continue;
+		}
+
+		if (__atomic_load_n(&q->_stop, __ATOMIC_SEQ_CST))
+			break;
+
+		wait_for_work(q);
+	}
+
+	return NULL;
+}
+
+/*
+ * The producers check _sleeping after they push, so either they see it 
+ * set and wake us or we see their request here.
+ */
+static void wait_for_work(struct blinkm_queue *q)
+{
+	uint64_t count;
+
+	__atomic_store_n(&q->_sleeping, 1, __ATOMIC_SEQ_CST);
+
+	if (ring_empty(&q->_pending) && !__atomic_load_n(&q->_stop, __ATOMIC_SEQ_CST)) {
+		if (read(q->_wake_fd, &count, sizeof(count)) < 0 && errno != EINTR)
+			perror("read eventfd");
+	}
+
+	__atomic_store_n(&q->_sleeping, 0, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Mark every color command that a later color command to the same led 
+ * replaces. Anything else to a led is a barrier, a color command before
+ * a STOP_SCRIPT or a read is never merged with one after it. A general 
+ * call reaches every led so it is a barrier for all of them.
+ */
+static void coalesce(struct blinkm_queue *q, struct blinkm_request *reqs, int count)
+{
+	int last[128];
+	int i;
+
+	for (i = 0; i < 128; i++)
+		last[i] = -1;
+
+	for (i = 0; i < count; i++) {
+		if (reqs[i]._led == 0 || reqs[i]._led > 127) {
+			memset(last, 0xff, sizeof(last));
+			continue;
+		}
+
+		if (!is_color_cmd(&reqs[i])) {
+			last[reqs[i]._led] = -1;
+			continue;
+		}
+
+		if (last[reqs[i]._led] >= 0) {
+			reqs[last[reqs[i]._led]]._result = 0;
+			q->_coalesced++;
+		}
+
+		last[reqs[i]._led] = i;
+	}
+}
+
+static int is_color_cmd(struct blinkm_request *req)
+{
+	if (req->_reply_len > 0 || req->_delay_ms > 0)
+		return 0;
+
+	switch (req->_data[0]) {
+	case SET_RGB_COLOR_NOW:
+	case FADE_TO_RGB_COLOR:
+	case FADE_TO_HSB_COLOR:
+		return 1;
+
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Consecutive write-only requests go out as one transfer. A read or a
+ * request that needs a delay after it ends the batch so the order seen 
+ * by each led is the order submitted.
+ */
+static void run_requests(struct blinkm_queue *q, struct blinkm_request *reqs, int count)
+{
+	struct blinkm_batch batch;
+	struct blinkm_request *pending[BLINKM_MAX_BATCH];
+	struct blinkm_request *req;
+	int i;
+
+	blinkm_batch_init(&batch);
+
+	for (i = 0; i < count; i++) {
+		req = &reqs[i];
+
+		/* coalesced away */
+		if (req->_result == 0)
+			continue;
+
+		if (batch._count == BLINKM_MAX_BATCH)
+			send_batch(q, &batch, pending);
+
+		if (req->_reply_len == 0 && req->_delay_ms == 0) {
+			pending[batch._count] = req;
+			blinkm_batch_add_raw(&batch, req->_led, req->_data, req->_len);
+			continue;
+		}
+
+		send_batch(q, &batch, pending);
+
+		if (req->_reply_len > 0) {
+			if (i2c_write_read(q->_bus, req->_led, req->_data, req->_len, 
+					req->_reply, req->_reply_len) == req->_reply_len)
+				req->_result = 1;
+			else
+				req->_result = -1;
+		}
+		else {
+			if (i2c_write(q->_bus, req->_led, req->_data, req->_len) == req->_len)
+				req->_result = 1;
+			else
+				req->_result = -1;
+
+			msleep(req->_delay_ms);
+		}
+	}
+
+	send_batch(q, &batch, pending);
+
+	finish_requests(q, reqs, count);
+}
+
+static void send_batch(struct blinkm_queue *q, struct blinkm_batch *b, struct blinkm_request **pending)
+{
+	int i;
+
+	if (b->_count == 0)
+		return;
+
+	blinkm_batch_send(q->_bus, b);
+	q->_batches++;
+
+	for (i = 0; i < b->_count; i++) 
+		pending[i]->_result = b->_cmd[i]._sent ? 1 : -1;
+
+	blinkm_batch_init(b);
+}
+
+static void finish_requests(struct blinkm_queue *q, struct blinkm_request *reqs, int count)
+{
+	uint64_t posted;
+	int i;
+
+	posted = 0;
+
+	for (i = 0; i < count; i++) {
+		if (reqs[i]._done) {
+			reqs[i]._done(&reqs[i], reqs[i]._ctx);
+		}
+		else if (ring_push(&q->_completed, &reqs[i]) < 0) {
+			/* nobody is taking completions, don't stall the bus for them */
+			q->_lost++;
+		}
+		else {
+			posted++;
+		}
+	}
+
+	if (posted > 0 && write(q->_event_fd, &posted, sizeof(posted)) < 0)
+		perror("write eventfd");
+
+	pthread_mutex_lock(&q->_idle_lock);
+	__atomic_add_fetch(&q->_finished, count, __ATOMIC_SEQ_CST);
+	pthread_cond_broadcast(&q->_idle);
+	pthread_mutex_unlock(&q->_idle_lock);
+}
+
+static int ring_init(struct blinkm_ring *r, int size)
+{
+	int i;
+
+	r->_slot = calloc(size, sizeof(struct blinkm_ring_slot));
+
+	if (!r->_slot) {
+		fprintf(stderr, "Out of memory for a queue of %d\n", size);
+		return -1;
+	}
+
+	for (i = 0; i < size; i++)
+		r->_slot[i]._seq = i;
+
+	r->_mask = size - 1;
+	r->_head = 0;
+	r->_tail = 0;
+
+	return 1;
+}
+
+static void ring_free(struct blinkm_ring *r)
+{
+	if (r->_slot) {
+		free(r->_slot);
+		r->_slot = NULL;
+	}
+}
+
+/*
+ * Each slot's sequence number says whose turn it is. A producer claims 
+ * the slot at _head when its sequence equals the position, fills it in
+ * and publishes it by setting the sequence one past the position.
+ */
+static int ring_push(struct blinkm_ring *r, const struct blinkm_request *req)
+{
+	struct blinkm_ring_slot *slot;
+	uint64_t pos, seq;
+	int64_t diff;
+
+	pos = __atomic_load_n(&r->_head, __ATOMIC_RELAXED);
+
+	while (1) {
+		slot = &r->_slot[pos & r->_mask];
+		seq = __atomic_load_n(&slot->_seq, __ATOMIC_ACQUIRE);
+		diff = (int64_t) seq - (int64_t) pos;
+
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&r->_head, &pos, pos + 1, 1, 
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}
+		else if (diff < 0) {
+			return -1;
+		}
+		else {
+			pos = __atomic_load_n(&r->_head, __ATOMIC_RELAXED);
+		}
+	}
+
+	slot->_req = *req;
+
+	__atomic_store_n(&slot->_seq, pos + 1, __ATOMIC_RELEASE);
+
+	return 1;
+}
+
+/* single consumer, _tail is only touched here */
+static int ring_pop(struct blinkm_ring *r, struct blinkm_request *req)
+{
+	struct blinkm_ring_slot *slot;
+	uint64_t pos;
+
+	pos = r->_tail;
+	slot = &r->_slot[pos & r->_mask];
+
+	if (__atomic_load_n(&slot->_seq, __ATOMIC_ACQUIRE) != pos + 1)
+		return 0;
+
+	*req = slot->_req;
+
+	__atomic_store_n(&slot->_seq, pos + r->_mask + 1, __ATOMIC_RELEASE);
+	r->_tail = pos + 1;
+
+	return 1;
+}
+
+static int ring_empty(struct blinkm_ring *r)
+{
+	struct blinkm_ring_slot *slot = &r->_slot[r->_tail & r->_mask];
+
+	return __atomic_load_n(&slot->_seq, __ATOMIC_ACQUIRE) != r->_tail + 1;
+}
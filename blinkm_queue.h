@@ -0,0 +1,109 @@
+/*
+	Copyright (c) 2009, Scott Ellis
+	All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+		* Redistributions of source code must retain the above copyright
+		  notice, this list of conditions and the following disclaimer.
+		* Redistributions in binary form must reproduce the above copyright
+		  notice, this list of conditions and the following disclaimer in the
+		  documentation and/or other materials provided with the distribution.
+		* Neither the name of the <organization> nor the
+		  names of its contributors may be used to endorse or promote products
+		  derived from this software without specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY Scott Ellis ''AS IS'' AND ANY
+	EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+	WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+	DISCLAIMED. IN NO EVENT SHALL Scott Ellis BE LIABLE FOR ANY
+	DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+	(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+	LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+	ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+	(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+	SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef BLINKM_QUEUE_H
+#define BLINKM_QUEUE_H
+
+#define BLINKM_QUEUE_DEFAULT_SIZE 1024
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct i2c_session;
+struct blinkm_request;
+
+/* called on the bus thread, keep it short */
+typedef void (*blinkm_done_fn)(struct blinkm_request *req, void *ctx);
+
+struct blinkm_request {
+	uint8_t _led;
+	uint8_t _len;
+	uint8_t _reply_len;
+	uint8_t _data[BLINKM_MAX_CMD_LEN];
+	uint8_t _reply[BLINKM_MAX_CMD_LEN];
+	/* hold the bus this long after the write, for eeprom writes */
+	int _delay_ms;
+	/* 
+	 * set by the bus thread, 1 when done, -1 on failure, 0 when a newer
+	 * color command for the same led replaced it before it was sent
+	 */
+	int _result;
+	uint64_t _tag;
+	blinkm_done_fn _done;
+	void *_ctx;
+};
+
+struct blinkm_ring_slot {
+	uint64_t _seq;
+	struct blinkm_request _req;
+};
+
+/* bounded, any number of producers and a single consumer */
+struct blinkm_ring {
+	struct blinkm_ring_slot *_slot;
+	uint64_t _mask;
+	uint64_t _head;
+	uint64_t _tail;
+};
+
+struct blinkm_queue {
+	struct i2c_session *_bus;
+	struct blinkm_ring _pending;
+	struct blinkm_ring _completed;
+	int _wake_fd;
+	int _event_fd;
+	int _sleeping;
+	int _stop;
+	/* collapse superseded color commands, on by default */
+	int _coalesce;
+	struct blinkm_request *_drain;
+	int _drain_size;
+	uint64_t _submitted;
+	uint64_t _finished;
+	uint64_t _batches;
+	uint64_t _coalesced;
+	uint64_t _lost;
+	pthread_t _thread;
+	pthread_mutex_t _idle_lock;
+	pthread_cond_t _idle;
+};
+
+int blinkm_queue_start(struct blinkm_queue *q, struct i2c_session *bus, int size);
+void blinkm_queue_stop(struct blinkm_queue *q);
+int blinkm_queue_submit(struct blinkm_queue *q, const struct blinkm_request *req);
+int blinkm_queue_cmd(struct blinkm_queue *q, uint8_t led, uint8_t cmd, uint8_t a1, uint8_t a2, 
+		uint8_t a3, blinkm_done_fn done, void *ctx);
+int blinkm_queue_completion(struct blinkm_queue *q, struct blinkm_request *req);
+int blinkm_queue_event_fd(struct blinkm_queue *q);
+void blinkm_queue_flush(struct blinkm_queue *q);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
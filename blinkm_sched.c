@@ -0,0 +1,412 @@
+/*
+	Copyright (c) 2009, Scott Ellis
+	All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+		* Redistributions of source code must retain the above copyright
+		  notice, this list of conditions and the following disclaimer.
+		* Redistributions in binary form must reproduce the above copyright
+		  notice, this list of conditions and the following disclaimer in the
+		  documentation and/or other materials provided with the distribution.
+		* Neither the name of the <organization> nor the
+		  names of its contributors may be used to endorse or promote products
+		  derived from this software without specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY Scott Ellis ''AS IS'' AND ANY
+	EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+	WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+	DISCLAIMED. IN NO EVENT SHALL Scott Ellis BE LIABLE FOR ANY
+	DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+	(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+	LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+	ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+	(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+	SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/*
+ * Cues are sets of commands that should reach their leds at the same 
+ * moment. Everything due at one CLOCK_MONOTONIC time is encoded into a
+ * single I2C_RDWR transfer before the first cue fires, so firing one is
+ * a single ioctl. A SCHED_FIFO thread sleeps until each cue's absolute
+ * time with clock_nanosleep(TIMER_ABSTIME), so the timing doesn't drift
+ * from one cue to the next.
+ *
+ * For each cue, late is how long after its time the thread woke up and
+ * spread is how long the transfer took, the time between the first led
+ * and the last one getting the command.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <linux/i2c.h>
+
+#include "utility.h"
+#include "i2c_functions.h"
+#include "i2c_blinkm.h"
+#include "blinkm_cache.h"
+#include "blinkm_sched.h"
+#include "blinkm_regs.h"
+
+static struct blinkm_cue *find_cue(struct blinkm_sched *s, uint64_t at);
+static int compare_cues(const void *a, const void *b);
+static int prepare_cues(struct blinkm_sched *s);
+static int start_thread(struct blinkm_sched *s, pthread_t *tid);
+static void *fire_thread(void *arg);
+static int fire_cue(struct i2c_session *bus, struct blinkm_cue *cue);
+
+
+void blinkm_sched_init(struct blinkm_sched *s, struct i2c_session *bus)
+{
+	memset(s, 0, sizeof(struct blinkm_sched));
+	s->_bus = bus;
+	s->_priority = BLINKM_SCHED_PRIORITY;
+}
+
+void blinkm_sched_free(struct blinkm_sched *s)
+{
+	int i;
+
+	for (i = 0; i < s->_count; i++) {
+		if (s->_cue[i]._msgs)
+			free(s->_cue[i]._msgs);
+	}
+
+	if (s->_cue)
+		free(s->_cue);
+
+	s->_cue = NULL;
+	s->_count = 0;
+	s->_size = 0;
+}
+
+/*
+ * Commands added for the same time go out in the same transfer, in the
+ * order they were added. Return -1 if the command can't be added.
+ */
+int blinkm_sched_add(struct blinkm_sched *s, uint64_t at, uint8_t led, uint8_t cmd, 
+		uint8_t a1, uint8_t a2, uint8_t a3)
+{
+	struct blinkm_cue *cue;
+
+	cue = find_cue(s, at);
+
+	if (!cue)
+		return -1;
+
+	if (cue->_batch._count >= BLINKM_MAX_BATCH) {
+		fprintf(stderr, "No more than %d commands fit in one cue\n", BLINKM_MAX_BATCH);
+		return -1;
+	}
+
+	if (blinkm_batch_add(&cue->_batch, led, cmd, a1, a2, a3) < 0) {
+		fprintf(stderr, "Command 0x%02x can't be cued\n", cmd);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Blocks until the last cue has fired. Cues whose time has already 
+ * passed fire right away. Return the number of cues that reached every 
+ * led, or -1 if they couldn't be run.
+ */
+int blinkm_sched_run(struct blinkm_sched *s)
+{
+	pthread_t tid;
+	int i, locked, complete;
+
+	if (!s || !s->_bus)
+		return -1;
+
+	if (s->_count == 0)
+		return 0;
+
+	qsort(s->_cue, s->_count, sizeof(struct blinkm_cue), compare_cues);
+
+	if (prepare_cues(s) < 0)
+		return -1;
+
+	/* no page faults once the cues start */
+	locked = !mlockall(MCL_CURRENT);
+
+	if (start_thread(s, &tid) < 0) {
+		if (locked)
+			munlockall();
+
+		return -1;
+	}
+
+	pthread_join(tid, NULL);
+
+	if (locked)
+		munlockall();
+
+	complete = 0;
+
+	for (i = 0; i < s->_count; i++) {
+		if (s->_cue[i]._sent == s->_cue[i]._batch._count)
+			complete++;
+	}
+
+	return complete;
+}
+
+/*
+ * One line per cue, times relative to start.
+ */
+void blinkm_sched_print(FILE *fp, struct blinkm_sched *s, uint64_t start)
+{
+	struct blinkm_cue *cue;
+	int64_t max_late;
+	uint64_t max_spread;
+	double late, spread;
+	int i, cmds, sent;
+
+	fprintf(fp, "\n cue      at ms   cmds   sent    late us  spread us\n");
+
+	max_late = 0;
+	max_spread = 0;
+	late = 0.0;
+	spread = 0.0;
+	cmds = 0;
+	sent = 0;
+
+	for (i = 0; i < s->_count; i++) {
+		cue = &s->_cue[i];
+
+		fprintf(fp, "%4d %10.1f %6d %6d %10.1f %10.1f\n", i + 1, 
+			((int64_t) (cue->_at - start)) / 1000000.0, cue->_batch._count, 
+			cue->_sent, cue->_late_nsecs / 1000.0, cue->_spread_nsecs / 1000.0);
+
+		if (cue->_late_nsecs > max_late)
+			max_late = cue->_late_nsecs;
+
+		if (cue->_spread_nsecs > max_spread)
+			max_spread = cue->_spread_nsecs;
+
+		late += cue->_late_nsecs;
+		spread += cue->_spread_nsecs;
+		cmds += cue->_batch._count;
+		sent += cue->_sent;
+	}
+
+	fprintf(fp, "\n%d cues, %d of %d commands sent, %s thread\n", s->_count, sent, cmds,
+		s->_realtime ? "real-time" : "ordinary");
+
+	if (s->_count > 0)
+		fprintf(fp, "late avg %.1f us max %.1f us, spread avg %.1f us max %.1f us\n", 
+			late / s->_count / 1000.0, max_late / 1000.0, 
+			spread / s->_count / 1000.0, max_spread / 1000.0);
+}
+
+static struct blinkm_cue *find_cue(struct blinkm_sched *s, uint64_t at)
+{
+	struct blinkm_cue *cue;
+	int i, size;
+
+	/* cues mostly arrive in order, the match is usually the last one */
+	for (i = s->_count - 1; i >= 0; i--) {
+		if (s->_cue[i]._at == at)
+			return &s->_cue[i];
+	}
+
+	if (s->_count == s->_size) {
+		size = s->_size ? s->_size * 2 : 16;
+		cue = realloc(s->_cue, size * sizeof(struct blinkm_cue));
+
+		if (!cue) {
+			fprintf(stderr, "Out of memory for %d cues\n", size);
+			return NULL;
+		}
+
+		s->_cue = cue;
+		s->_size = size;
+	}
+
+	cue = &s->_cue[s->_count++];
+	memset(cue, 0, sizeof(struct blinkm_cue));
+	cue->_at = at;
+	blinkm_batch_init(&cue->_batch);
+
+	return cue;
+}
+
+static int compare_cues(const void *a, const void *b)
+{
+	const struct blinkm_cue *x = a;
+	const struct blinkm_cue *y = b;
+
+	if (x->_at < y->_at)
+		return -1;
+
+	return x->_at > y->_at;
+}
+
+/*
+ * Build every transfer up front, firing a cue only does the ioctl.
+ */
+static int prepare_cues(struct blinkm_sched *s)
+{
+	struct blinkm_cue *cue;
+	struct blinkm_cmd *c;
+	int i, j;
+
+	for (i = 0; i < s->_count; i++) {
+		cue = &s->_cue[i];
+
+		if (cue->_msgs)
+			free(cue->_msgs);
+
+		cue->_msgs = calloc(cue->_batch._count, sizeof(struct i2c_msg));
+
+		if (!cue->_msgs) {
+			fprintf(stderr, "Out of memory for cue %d\n", i + 1);
+			return -1;
+		}
+
+		for (j = 0; j < cue->_batch._count; j++) {
+			c = &cue->_batch._cmd[j];
+			c->_sent = 0;
+			cue->_msgs[j].addr = c->_led;
+			cue->_msgs[j].flags = 0;
+			cue->_msgs[j].len = c->_len;
+			cue->_msgs[j].buf = c->_data;
+		}
+
+		cue->_sent = 0;
+		cue->_late_nsecs = 0;
+		cue->_spread_nsecs = 0;
+	}
+
+	return 0;
+}
+
+/*
+ * Real-time priority needs root or CAP_SYS_NICE, without it the cues 
+ * still run, only with more jitter.
+ */
+static int start_thread(struct blinkm_sched *s, pthread_t *tid)
+{
+	struct sched_param param;
+	pthread_attr_t attr;
+	int err;
+
+	s->_realtime = 0;
+
+	if (s->_priority > 0) {
+		pthread_attr_init(&attr);
+		pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = s->_priority;
+		pthread_attr_setschedparam(&attr, &param);
+
+		err = pthread_create(tid, &attr, fire_thread, s);
+
+		pthread_attr_destroy(&attr);
+
+		if (!err) {
+			s->_realtime = 1;
+			return 0;
+		}
+
+		fprintf(stderr, "No real-time priority for the cue thread: %s\n", strerror(err));
+	}
+
+	if (pthread_create(tid, NULL, fire_thread, s)) {
+		fprintf(stderr, "Could not start the cue thread\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+static void *fire_thread(void *arg)
+{
+	struct blinkm_sched *s = (struct blinkm_sched *) arg;
+	struct blinkm_cue *cue;
+	struct blinkm_cmd *c;
+	struct timespec ts;
+	uint64_t woke, done;
+	int i, j;
+
+	for (i = 0; i < s->_count; i++) {
+		cue = &s->_cue[i];
+
+		ts.tv_sec = cue->_at / 1000000000;
+		ts.tv_nsec = cue->_at % 1000000000;
+
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+			;
+
+		woke = monotonic_nsecs();
+		cue->_sent = fire_cue(s->_bus, cue);
+		done = monotonic_nsecs();
+
+		cue->_late_nsecs = (int64_t) (woke - cue->_at);
+		cue->_spread_nsecs = done - woke;
+
+		/* the shadow state can wait until the leds have their commands */
+		for (j = 0; j < cue->_batch._count; j++) {
+			c = &cue->_batch._cmd[j];
+
+			if (c->_sent)
+				blinkm_cache_update(s->_bus->_cache, c->_led, c->_data[0], 
+					c->_data[1], c->_data[2], c->_data[3]);
+			else
+				blinkm_cache_invalidate(s->_bus->_cache, c->_led);
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * A NAK aborts the whole transfer, but the messages before it have been
+ * delivered and i2c-dev doesn't say which one failed. Sending everything
+ * again would restart fades and repeat script writes, so only the 
+ * set-rgb commands, which can safely arrive twice, are sent again on
+ * their own. The rest count as not sent. When an open breaker stopped
+ * the transfer before anything went out, every command is sent again.
+ * Return the number of commands that were sent.
+ */
+static int fire_cue(struct i2c_session *bus, struct blinkm_cue *cue)
+{
+	int i, n, sent, none_sent;
+
+	n = cue->_batch._count;
+
+	if (i2c_transfer(bus, cue->_msgs, n) == n) {
+		for (i = 0; i < n; i++)
+			cue->_batch._cmd[i]._sent = 1;
+
+		return n;
+	}
+
+	none_sent = (errno == EHOSTDOWN);
+	sent = 0;
+
+	for (i = 0; i < n; i++) {
+		if (!none_sent && cue->_batch._cmd[i]._data[0] != SET_RGB_COLOR_NOW)
+			continue;
+
+		if (i2c_transfer(bus, &cue->_msgs[i], 1) == 1) {
+			cue->_batch._cmd[i]._sent = 1;
+			sent++;
+		}
+	}
+
+	return sent;
+}
@@ -0,0 +1,76 @@
+/*
+	Copyright (c) 2009, Scott Ellis
+	All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+		* Redistributions of source code must retain the above copyright
+		  notice, this list of conditions and the following disclaimer.
+		* Redistributions in binary form must reproduce the above copyright
+		  notice, this list of conditions and the following disclaimer in the
+		  documentation and/or other materials provided with the distribution.
+		* Neither the name of the <organization> nor the
+		  names of its contributors may be used to endorse or promote products
+		  derived from this software without specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY Scott Ellis ''AS IS'' AND ANY
+	EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+	WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+	DISCLAIMED. IN NO EVENT SHALL Scott Ellis BE LIABLE FOR ANY
+	DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+	(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+	LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+	ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+	(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+	SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#ifndef BLINKM_SCHED_H
+#define BLINKM_SCHED_H
+
+/* SCHED_FIFO priority of the thread that fires the cues */
+#define BLINKM_SCHED_PRIORITY 50
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct i2c_session;
+struct i2c_msg;
+
+/* every command due at one time, sent as one transfer */
+struct blinkm_cue {
+	/* CLOCK_MONOTONIC nanoseconds */
+	uint64_t _at;
+	struct blinkm_batch _batch;
+	struct i2c_msg *_msgs;
+	/* filled in when the cue fires */
+	int _sent;
+	int64_t _late_nsecs;
+	uint64_t _spread_nsecs;
+};
+
+struct blinkm_sched {
+	struct i2c_session *_bus;
+	struct blinkm_cue *_cue;
+	int _count;
+	int _size;
+	/* SCHED_FIFO priority to ask for, 0 for an ordinary thread */
+	int _priority;
+	/* 1 if the cues were fired from a real-time thread */
+	int _realtime;
+};
+
+void blinkm_sched_init(struct blinkm_sched *s, struct i2c_session *bus);
+void blinkm_sched_free(struct blinkm_sched *s);
+int blinkm_sched_add(struct blinkm_sched *s, uint64_t at, uint8_t led, uint8_t cmd, 
+		uint8_t a1, uint8_t a2, uint8_t a3);
+int blinkm_sched_run(struct blinkm_sched *s);
+void blinkm_sched_print(FILE *fp, struct blinkm_sched *s, uint64_t start);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
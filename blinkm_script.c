@@ -0,0 +1,568 @@
+/*
+	Copyright (c) 2009, Scott Ellis
+	All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+		* Redistributions of source code must retain the above copyright
+		  notice, this list of conditions and the following disclaimer.
+		* Redistributions in binary form must reproduce the above copyright
+		  notice, this list of conditions and the following disclaimer in the
+		  documentation and/or other materials provided with the distribution.
+		* Neither the name of the <organization> nor the
+		  names of its contributors may be used to endorse or promote products
+		  derived from this software without specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY Scott Ellis ''AS IS'' AND ANY
+	EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+	WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+	DISCLAIMED. IN NO EVENT SHALL Scott Ellis BE LIABLE FOR ANY
+	DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+	(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+	LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+	ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+	(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+	SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "utility.h"
+#include "blinkm_regs.h"
+#include "i2c_blinkm.h"
+#include "i2c_functions.h"
+#include "blinkm_cache.h"
+#include "blinkm_script.h"
+
+
+static int parse_line(char *buff, struct blinkm_script *script, int line_no);
+static int parse_short_line(char *p, struct blinkm_script *script, int line_no);
+static int parse_cmd(const char *token);
+static int parse_arg(const char *token, int *val);
+static int load_image(const char *path, const struct stat *src, struct blinkm_script *script);
+static void save_image(const char *path, const struct stat *src, const struct blinkm_script *script);
+
+
+/*
+ * Scripts are text, one line per script line, in the form read-script 
+ * prints them
+ *
+ *   { W, 0, line_no, ticks, cmd, arg1, arg2, arg3 }
+ *
+ * or in the shorter form of the write-script-line arguments
+ *
+ *   ticks cmd arg1[,arg2[,arg3]]
+ *
+ * which takes the next line number. cmd is the command letter, c for 
+ * fade to rgb, its number or a command name like fade-rgb. Anything after
+ * the closing brace is ignored so read-script output can be saved and 
+ * loaded again. A 'repeats N' line sets the repeat count.
+ * Blank lines and anything after a # are ignored.
+ * Return the number of script lines or -1 on a bad line.
+ */
+int blinkm_script_parse(FILE *fp, struct blinkm_script *script)
+{
+	char buff[256];
+	char *p;
+	int i, line_no;
+
+	if (!fp || !script)
+		return -1;
+
+	memset(script, 0, sizeof(struct blinkm_script));
+
+	line_no = 0;
+
+	while (fgets(buff, sizeof(buff), fp)) {
+		line_no++;
+
+		p = strchr(buff, '#');
+
+		if (p)
+			*p = 0;
+
+		if (parse_line(buff, script, line_no) < 0)
+			return -1;
+	}
+
+	/* every line up to the last one given has to be there */
+	for (i = 0; i < script->_num_lines; i++) {
+		if (script->_line[i]._cmd == 0) {
+			fprintf(stderr, "Script line %d is missing\n", i);
+			return -1;
+		}
+	}
+
+	return script->_num_lines;
+}
+
+/*
+ * Load a script file, using the compiled image next to it when that is 
+ * newer than the text. The image is rebuilt whenever it is missing or stale.
+ * Return the number of script lines or -1 on failure.
+ */
+int blinkm_script_load(const char *path, struct blinkm_script *script)
+{
+	char image_path[512];
+	struct stat st;
+	FILE *fp;
+	int result;
+
+	if (!path || !script)
+		return -1;
+
+	if (stat(path, &st) < 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	snprintf(image_path, sizeof(image_path), "%s%s", path, BLINKM_SCRIPT_CACHE_SUFFIX);
+
+	result = load_image(image_path, &st, script);
+
+	if (result >= 0)
+		return result;
+
+	fp = fopen(path, "r");
+
+	if (!fp) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	result = blinkm_script_parse(fp, script);
+
+	fclose(fp);
+
+	if (result > 0) 
+		save_image(image_path, &st, script);
+
+	return result;
+}
+
+/*
+ * Make script 0 on every led match the given script, writing only the
+ * lines that differ. The current lines are read back one line at a time
+ * from all the leds in a single transfer. Scripts are stopped first, 
+ * reading script lines from a running script can hang the bus.
+ *
+ * The length and repeat count can't be read back. The length is taken to
+ * be the first empty line. When the caller passes repeats >= 0 or the
+ * file has a repeats line, the length and repeats are written unless the
+ * session cache remembers them. A negative repeats uses the script's own
+ * count.
+ * Return the number of leds that have the script, or -1 on failure.
+ */
+int blinkm_script_sync(struct i2c_session *bus, const uint8_t *leds, int num_leds,
+		const struct blinkm_script *script, int repeats, int delay_ms, 
+		struct blinkm_sync_stats *stats)
+{
+	struct script_line current[BLINKM_MAX_BATCH];
+	struct blinkm_shadow *sh;
+	struct blinkm_batch batch;
+	uint8_t targets[BLINKM_MAX_BATCH], *skip;
+	int ok[BLINKM_MAX_BATCH], same_length[BLINKM_MAX_BATCH];
+	uint64_t start;
+	int i, j, n, num_lines, check_repeats, result;
+
+	if (!leds || num_leds < 1 || num_leds > BLINKM_MAX_BATCH || !script 
+			|| script->_num_lines < 1 || !stats) 
+		return -1;
+
+	memset(stats, 0, sizeof(struct blinkm_sync_stats));
+	start = monotonic_usecs();
+
+	num_lines = script->_num_lines;
+
+	/* a repeats line in the file counts the same as one from the caller */
+	check_repeats = repeats >= 0 || script->_repeats_set;
+
+	if (repeats < 0)
+		repeats = script->_repeats;
+
+	blinkm_batch_init(&batch);
+
+	for (j = 0; j < num_leds; j++) 
+		blinkm_batch_add(&batch, leds[j], STOP_SCRIPT, 0, 0, 0);
+
+	blinkm_batch_send(bus, &batch);
+
+	/* only the leds that answered take part from here on */
+	n = 0;
+
+	for (j = 0; j < num_leds; j++) 
+		if (batch._cmd[j]._sent)
+			targets[n++] = leds[j];
+
+	if (n == 0)
+		return 0;
+
+	/* a row per line and one for the length, a column per led */
+	skip = calloc(num_lines + 1, n);
+
+	if (!skip) {
+		fprintf(stderr, "Out of memory syncing the script\n");
+		return -1;
+	}
+
+	for (j = 0; j < n; j++) 
+		same_length[j] = 1;
+
+	/* one line past the end tells us if the old script was longer */
+	for (i = 0; i <= num_lines && i < MAX_SCRIPT_LINES; i++) {
+		blinkm_batch_read_script_line(bus, targets, n, i, current, ok);
+
+		for (j = 0; j < n; j++) {
+			if (!ok[j]) 
+				continue;
+
+			if (i < num_lines) {
+				if (!memcmp(&current[j], &script->_line[i], sizeof(struct script_line)))
+					skip[(i * n) + j] = 1;
+				else if ((current[j]._ticks == 0 && current[j]._cmd == 0)
+						|| (current[j]._ticks == 0xff && current[j]._cmd == 0xff))
+					same_length[j] = 0;
+			}
+			else if (!(current[j]._ticks == 0 && current[j]._cmd == 0)
+					&& !(current[j]._ticks == 0xff && current[j]._cmd == 0xff)) {
+				same_length[j] = 0;
+			}
+		}
+	}
+
+	for (j = 0; j < n; j++) {
+		sh = bus->_cache ? &bus->_cache->_led[targets[j]] : NULL;
+
+		if (sh && sh->_script_valid) 
+			skip[(num_lines * n) + j] = sh->_script_length == num_lines 
+				&& sh->_script_repeats == repeats;
+		else
+			skip[(num_lines * n) + j] = same_length[j] && !check_repeats;
+
+		for (i = 0; i < num_lines; i++) 
+			if (!skip[(i * n) + j])
+				stats->_lines_written++;
+
+		if (!skip[(num_lines * n) + j])
+			stats->_length_written++;
+	}
+
+	result = blinkm_write_script(bus, targets, n, script->_line, num_lines, 
+			repeats, delay_ms, skip);
+
+	free(skip);
+
+	stats->_msecs = (monotonic_usecs() - start) / 1000.0;
+
+	return result;
+}
+
+static int parse_line(char *buff, struct blinkm_script *script, int line_no)
+{
+	char *p, *token[8];
+	int i, n, val[8];
+
+	p = buff;
+
+	while (isspace((unsigned char) *p))
+		p++;
+
+	if (*p == 0)
+		return 0;
+
+	if (!strncasecmp(p, "repeats", 7)) {
+		if (sscanf(p + 7, "%d", &val[0]) != 1 || val[0] < 0 || val[0] > 255) {
+			fprintf(stderr, "Bad repeat count on line %d\n", line_no);
+			return -1;
+		}
+
+		script->_repeats = val[0];
+		script->_repeats_set = 1;
+		return 0;
+	}
+
+	if (isdigit((unsigned char) *p))
+		return parse_short_line(p, script, line_no);
+
+	if (*p != '{') {
+		fprintf(stderr, "Line %d is not a { W, 0, line, ticks, cmd, a1, a2, a3 } entry\n", line_no);
+		return -1;
+	}
+
+	p++;
+
+	if (strchr(p, '}'))
+		*strchr(p, '}') = 0;
+
+	n = 0;
+	token[0] = strtok(p, ", \t\r\n");
+
+	while (token[n] && ++n < 8) 
+		token[n] = strtok(NULL, ", \t\r\n");
+
+	if (n < 5 || toupper((unsigned char) token[0][0]) != 'W') {
+		fprintf(stderr, "Line %d needs at least W, script, line, ticks and cmd\n", line_no);
+		return -1;
+	}
+
+	for (i = 1; i < n; i++) {
+		if (i == 4) {
+			val[i] = parse_cmd(token[i]);
+
+			if (val[i] < 0) {
+				fprintf(stderr, "Invalid script command %s on line %d\n", token[i], line_no);
+				return -1;
+			}
+		}
+		else if (parse_arg(token[i], &val[i]) < 0) {
+			fprintf(stderr, "Bad value %s on line %d\n", token[i], line_no);
+			return -1;
+		}
+	}
+
+	/* only script 0 is writable */
+	if (val[1] != 0) {
+		fprintf(stderr, "Only script 0 can be written, line %d\n", line_no);
+		return -1;
+	}
+
+	if (val[2] >= MAX_SCRIPT_LINES) {
+		fprintf(stderr, "Script line number %d out of range on line %d\n", val[2], line_no);
+		return -1;
+	}
+
+	for (i = n; i < 8; i++) 
+		val[i] = 0;
+
+	script->_line[val[2]]._ticks = val[3];
+	script->_line[val[2]]._cmd = val[4];
+	script->_line[val[2]]._arg[0] = val[5];
+	script->_line[val[2]]._arg[1] = val[6];
+	script->_line[val[2]]._arg[2] = val[7];
+
+	if (val[2] >= script->_num_lines)
+		script->_num_lines = val[2] + 1;
+
+	return 1;
+}
+
+/*
+ * ticks cmd arg1[,arg2[,arg3]], written at the next line number.
+ */
+static int parse_short_line(char *p, struct blinkm_script *script, int line_no)
+{
+	char *token[5];
+	int i, n, val[5];
+
+	n = 0;
+	token[0] = strtok(p, ", \t\r\n");
+
+	while (token[n] && ++n < 5) 
+		token[n] = strtok(NULL, ", \t\r\n");
+
+	if (n < 2 || parse_arg(token[0], &val[0]) < 0 || val[0] < 1) {
+		fprintf(stderr, "Bad script line %d, need ticks 1-255 and a command\n", line_no);
+		return -1;
+	}
+
+	val[1] = parse_cmd(token[1]);
+
+	if (val[1] < 0) {
+		fprintf(stderr, "Invalid script command %s on line %d\n", token[1], line_no);
+		return -1;
+	}
+
+	for (i = 2; i < 5; i++) {
+		if (i >= n) {
+			val[i] = 0;
+		}
+		else if (parse_arg(token[i], &val[i]) < 0) {
+			fprintf(stderr, "Bad value %s on line %d\n", token[i], line_no);
+			return -1;
+		}
+	}
+
+	if (script->_num_lines >= MAX_SCRIPT_LINES) {
+		fprintf(stderr, "More than %d script lines\n", MAX_SCRIPT_LINES);
+		return -1;
+	}
+
+	i = script->_num_lines++;
+
+	script->_line[i]._ticks = val[0];
+	script->_line[i]._cmd = val[1];
+	script->_line[i]._arg[0] = val[2];
+	script->_line[i]._arg[1] = val[3];
+	script->_line[i]._arg[2] = val[4];
+
+	return 1;
+}
+
+/*
+ * A command letter like c, a number like 0x63 or a name like fade-rgb.
+ */
+static int parse_cmd(const char *token)
+{
+	static const struct {
+		const char *_name;
+		int _cmd;
+	} names[] = {
+		{ "set-rgb", SET_RGB_COLOR_NOW },
+		{ "fade-rgb", FADE_TO_RGB_COLOR },
+		{ "fade-hsb", FADE_TO_HSB_COLOR },
+		{ "fade-random-rgb", FADE_TO_RANDOM_RGB_COLOR },
+		{ "fade-random-hsb", FADE_TO_RANDOM_HSB_COLOR },
+		{ "set-fade-speed", SET_FADE_SPEED },
+		{ "set-time-adjust", SET_TIME_ADJUST }
+	};
+	int i, cmd;
+
+	if (isdigit((unsigned char) token[0])) {
+		if (parse_arg(token, &cmd) < 0)
+			return -1;
+	}
+	else if (token[1] == 0) {
+		cmd = token[0];
+	}
+	else {
+		for (i = 0; i < (int) (sizeof(names) / sizeof(names[0])); i++) {
+			if (!strcasecmp(token, names[i]._name))
+				return names[i]._cmd;
+		}
+
+		return -1;
+	}
+
+	switch (cmd) {
+	case SET_RGB_COLOR_NOW:
+	case FADE_TO_RGB_COLOR:
+	case FADE_TO_HSB_COLOR:
+	case FADE_TO_RANDOM_RGB_COLOR:
+	case FADE_TO_RANDOM_HSB_COLOR:
+	case SET_FADE_SPEED:
+	case SET_TIME_ADJUST:
+		return cmd;
+
+	default:
+		return -1;
+	}
+}
+
+static int parse_arg(const char *token, int *val)
+{
+	char *end;
+
+	*val = strtol(token, &end, 0);
+
+	if (*end != 0 || *val < 0 || *val > 255)
+		return -1;
+
+	return 1;
+}
+
+static int64_t mtime_nsecs(const struct stat *st)
+{
+	return (int64_t) st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+static int load_image(const char *path, const struct stat *src, struct blinkm_script *script)
+{
+	const struct blinkm_script_image *image;
+	struct stat st;
+	void *map;
+	int fd, result;
+
+	fd = open(path, O_RDONLY);
+
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(struct blinkm_script_image)) {
+		close(fd);
+		return -1;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+	close(fd);
+
+	if (map == MAP_FAILED)
+		return -1;
+
+	image = (const struct blinkm_script_image *) map;
+	result = -1;
+
+	if (image->_magic == BLINKM_SCRIPT_MAGIC
+			&& image->_src_size == (uint32_t) src->st_size
+			&& image->_src_mtime_nsecs == mtime_nsecs(src)
+			&& image->_num_lines > 0 && image->_num_lines <= MAX_SCRIPT_LINES
+			&& st.st_size >= (off_t) (sizeof(struct blinkm_script_image) 
+				+ image->_num_lines * sizeof(struct script_line))) {
+		memset(script, 0, sizeof(struct blinkm_script));
+		script->_num_lines = image->_num_lines;
+		script->_repeats = image->_repeats;
+		script->_repeats_set = image->_repeats_set;
+		memcpy(script->_line, image + 1, image->_num_lines * sizeof(struct script_line));
+		result = script->_num_lines;
+	}
+
+	munmap(map, st.st_size);
+
+	return result;
+}
+
+/*
+ * Best effort, a read-only script directory just means parsing every time.
+ */
+static void save_image(const char *path, const struct stat *src, const struct blinkm_script *script)
+{
+	struct blinkm_script_image image;
+	char tmp[520];
+	FILE *fp;
+	int fd;
+
+	memset(&image, 0, sizeof(image));
+	image._magic = BLINKM_SCRIPT_MAGIC;
+	image._src_size = src->st_size;
+	image._src_mtime_nsecs = mtime_nsecs(src);
+	image._num_lines = script->_num_lines;
+	image._repeats = script->_repeats;
+	image._repeats_set = script->_repeats_set;
+
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+
+	fd = mkstemp(tmp);
+
+	if (fd < 0)
+		return;
+
+	fchmod(fd, 0644);
+
+	fp = fdopen(fd, "w");
+
+	if (!fp) {
+		close(fd);
+		unlink(tmp);
+		return;
+	}
+
+	if (fwrite(&image, sizeof(image), 1, fp) != 1
+			|| fwrite(script->_line, sizeof(struct script_line), script->_num_lines, fp) 
+				!= (size_t) script->_num_lines) {
+		fclose(fp);
+		unlink(tmp);
+		return;
+	}
+
+	if (fclose(fp) != 0 || rename(tmp, path) < 0)
+		unlink(tmp);
+}
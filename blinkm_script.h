@@ -0,0 +1,80 @@
+/*
+	Copyright (c) 2009, Scott Ellis
+	All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+		* Redistributions of source code must retain the above copyright
+		  notice, this list of conditions and the following disclaimer.
+		* Redistributions in binary form must reproduce the above copyright
+		  notice, this list of conditions and the following disclaimer in the
+		  documentation and/or other materials provided with the distribution.
+		* Neither the name of the <organization> nor the
+		  names of its contributors may be used to endorse or promote products
+		  derived from this software without specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY Scott Ellis ''AS IS'' AND ANY
+	EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+	WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+	DISCLAIMED. IN NO EVENT SHALL Scott Ellis BE LIABLE FOR ANY
+	DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+	(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+	LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+	ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+	(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+	SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef BLINKM_SCRIPT_H
+#define BLINKM_SCRIPT_H
+
+/* compiled scripts are cached next to the text file with this suffix */
+#define BLINKM_SCRIPT_CACHE_SUFFIX ".bms"
+#define BLINKM_SCRIPT_MAGIC 0x33534D42
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct i2c_session;
+
+struct blinkm_script {
+	int _num_lines;
+	uint8_t _repeats;
+	/* the file had a repeats line */
+	uint8_t _repeats_set;
+	struct script_line _line[MAX_SCRIPT_LINES];
+};
+
+struct blinkm_sync_stats {
+	int _lines_written;
+	int _length_written;
+	double _msecs;
+};
+
+/* 
+ * The compiled form is this header followed by _num_lines script_line 
+ * structs, which are plain bytes and need no decoding.
+ */
+struct blinkm_script_image {
+	uint32_t _magic;
+	uint32_t _src_size;
+	/* st_mtim in nanoseconds, seconds alone miss quick edits */
+	int64_t _src_mtime_nsecs;
+	uint8_t _num_lines;
+	uint8_t _repeats;
+	uint8_t _repeats_set;
+	uint8_t _pad[5];
+};
+
+int blinkm_script_parse(FILE *fp, struct blinkm_script *script);
+int blinkm_script_load(const char *path, struct blinkm_script *script);
+int blinkm_script_sync(struct i2c_session *bus, const uint8_t *leds, int num_leds,
+		const struct blinkm_script *script, int repeats, int delay_ms, 
+		struct blinkm_sync_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,242 @@
+/*
+	Copyright (c) 2009, Scott Ellis
+	All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+		* Redistributions of source code must retain the above copyright
+		  notice, this list of conditions and the following disclaimer.
+		* Redistributions in binary form must reproduce the above copyright
+		  notice, this list of conditions and the following disclaimer in the
+		  documentation and/or other materials provided with the distribution.
+		* Neither the name of the <organization> nor the
+		  names of its contributors may be used to endorse or promote products
+		  derived from this software without specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY Scott Ellis ''AS IS'' AND ANY
+	EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+	WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+	DISCLAIMED. IN NO EVENT SHALL Scott Ellis BE LIABLE FOR ANY
+	DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+	(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+	LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+	ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+	(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+	SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+
+#include "utility.h"
+#include "i2c_blinkm.h"
+#include "i2c_functions.h"
+#include "blinkm_cache.h"
+#include "blinkm_stream.h"
+
+
+static void add_pending(struct blinkm_batch *batch, uint8_t cmd, uint8_t pending[][3], uint8_t *has_pending);
+static void send_frame(struct i2c_session *bus, struct blinkm_batch *batch, struct blinkm_stream_stats *stats);
+static int read_full(int fd, uint8_t *buff, int len);
+static int input_pending(int fd);
+
+
+/*
+ * Push frames read from fd to the bus until end of file, one batched 
+ * transfer per frame. With fps > 0 frames are paced to that rate, and a
+ * frame is dropped if it arrives more than a frame period late while the
+ * next one is already waiting, so the leds always show the newest frame.
+ * The colors of a dropped frame go out with the next frame sent, for the
+ * leds that frame doesn't set itself.
+ * Return the number of frames sent or -1 on a malformed stream.
+ */
+int blinkm_stream_run(struct i2c_session *bus, int fd, uint8_t cmd, const uint8_t *leds, 
+		int num_leds, int fps, struct blinkm_stream_stats *stats)
+{
+	struct blinkm_batch batch;
+	struct timespec deadline;
+	uint8_t header[4], data[BLINKM_FRAME_MAX_ENTRIES * 4];
+	uint8_t addr[BLINKM_FRAME_MAX_ENTRIES], *color[BLINKM_FRAME_MAX_ENTRIES];
+	uint8_t pending[128][3], has_pending[128];
+	uint64_t start, period, next, now;
+	int i, n, count, entry_len, result;
+
+	if (!stats) 
+		return -1;
+
+	memset(stats, 0, sizeof(struct blinkm_stream_stats));
+
+	period = fps > 0 ? 1000000 / fps : 0;
+	start = monotonic_usecs();
+	next = start;
+	result = 0;
+	memset(has_pending, 0, sizeof(has_pending));
+
+	while (read_full(fd, header, 4) == 4) {
+		if (header[0] != BLINKM_FRAME_MAGIC) {
+			fprintf(stderr, "Bad frame header 0x%02X, stream out of sync\n", header[0]);
+			result = -1;
+			break;
+		}
+
+		count = header[2] | (header[3] << 8);
+
+		if (header[1] == BLINKM_FRAME_LIST) {
+			entry_len = 4;
+		}
+		else if (header[1] == BLINKM_FRAME_ARRAY) {
+			entry_len = 3;
+		}
+		else {
+			fprintf(stderr, "Unknown frame type 0x%02X\n", header[1]);
+			result = -1;
+			break;
+		}
+
+		if (count > BLINKM_FRAME_MAX_ENTRIES) {
+			fprintf(stderr, "Frame has %d entries, limit is %d\n", 
+					count, BLINKM_FRAME_MAX_ENTRIES);
+			result = -1;
+			break;
+		}
+
+		if (read_full(fd, data, count * entry_len) != count * entry_len) 
+			break;
+
+		stats->_frames++;
+
+		for (i = 0, n = 0; i < count; i++) {
+			if (entry_len == 4) {
+				if (data[i * 4] < 1 || data[i * 4] > 127)
+					continue;
+
+				addr[n] = data[i * 4];
+				color[n] = &data[i * 4 + 1];
+				n++;
+			}
+			else if (i < num_leds) {
+				addr[n] = leds[i];
+				color[n] = &data[i * 3];
+				n++;
+			}
+		}
+
+		if (period) {
+			now = monotonic_usecs();
+
+			if (now > next + period) {
+				/* late, and the producer is already ahead of us */
+				if (input_pending(fd)) {
+					for (i = 0; i < n; i++) {
+						memcpy(pending[addr[i]], color[i], 3);
+						has_pending[addr[i]] = 1;
+					}
+
+					stats->_dropped++;
+					next += period;
+					continue;
+				}
+
+				/* the producer is the slow one, start over from here */
+				next = now;
+			}
+			else if (now < next) {
+				deadline.tv_sec = next / 1000000;
+				deadline.tv_nsec = (next % 1000000) * 1000;
+				clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+			}
+
+			next += period;
+		}
+
+		blinkm_batch_init(&batch);
+
+		for (i = 0; i < n; i++) {
+			blinkm_batch_add(&batch, addr[i], cmd, color[i][0], color[i][1], color[i][2]);
+			has_pending[addr[i]] = 0;
+		}
+
+		add_pending(&batch, cmd, pending, has_pending);
+		send_frame(bus, &batch, stats);
+		result++;
+	}
+
+	/* the stream ended on dropped frames, the last one still goes out */
+	blinkm_batch_init(&batch);
+	add_pending(&batch, cmd, pending, has_pending);
+
+	if (batch._count > 0) {
+		send_frame(bus, &batch, stats);
+		stats->_dropped--;
+		result++;
+	}
+
+	stats->_msecs = (monotonic_usecs() - start) / 1000.0;
+
+	return result;
+}
+
+static void add_pending(struct blinkm_batch *batch, uint8_t cmd, uint8_t pending[][3], uint8_t *has_pending)
+{
+	int i;
+
+	for (i = 1; i < 128; i++) {
+		if (has_pending[i]) {
+			blinkm_batch_add(batch, i, cmd, pending[i][0], pending[i][1], pending[i][2]);
+			has_pending[i] = 0;
+		}
+	}
+}
+
+static void send_frame(struct i2c_session *bus, struct blinkm_batch *batch, struct blinkm_stream_stats *stats)
+{
+	int written, suppressed;
+
+	suppressed = bus->_cache ? bus->_cache->_suppressed : 0;
+
+	written = blinkm_batch_send(bus, batch);
+
+	if (bus->_cache)
+		suppressed = bus->_cache->_suppressed - suppressed;
+
+	stats->_writes += written;
+	stats->_suppressed += suppressed;
+	stats->_failed += batch->_count - written - suppressed;
+	stats->_sent++;
+}
+
+static int read_full(int fd, uint8_t *buff, int len)
+{
+	int n, total;
+
+	total = 0;
+
+	while (total < len) {
+		n = read(fd, buff + total, len - total);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+
+		if (n <= 0) 
+			break;
+
+		total += n;
+	}
+
+	return total;
+}
+
+static int input_pending(int fd)
+{
+	struct pollfd pfd;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+
+	return poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN);
+}
@@ -0,0 +1,71 @@
+/*
+	Copyright (c) 2009, Scott Ellis
+	All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+		* Redistributions of source code must retain the above copyright
+		  notice, this list of conditions and the following disclaimer.
+		* Redistributions in binary form must reproduce the above copyright
+		  notice, this list of conditions and the following disclaimer in the
+		  documentation and/or other materials provided with the distribution.
+		* Neither the name of the <organization> nor the
+		  names of its contributors may be used to endorse or promote products
+		  derived from this software without specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY Scott Ellis ''AS IS'' AND ANY
+	EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+	WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+	DISCLAIMED. IN NO EVENT SHALL Scott Ellis BE LIABLE FOR ANY
+	DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+	(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+	LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+	ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+	(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+	SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef BLINKM_STREAM_H
+#define BLINKM_STREAM_H
+
+/*
+ * A stream is a sequence of frames, each one a 4 byte header followed by
+ * the colors for that frame.
+ *
+ *   'B', type, count low byte, count high byte
+ *
+ * BLINKM_FRAME_LIST is followed by count (address, r, g, b) entries.
+ * BLINKM_FRAME_ARRAY is followed by count (r, g, b) entries sent to the
+ * stream's led list in order.
+ *
+ * For fade-hsb streams the three color bytes are h, s, b.
+ */
+#define BLINKM_FRAME_MAGIC 'B'
+#define BLINKM_FRAME_LIST 'L'
+#define BLINKM_FRAME_ARRAY 'A'
+#define BLINKM_FRAME_MAX_ENTRIES 127
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct i2c_session;
+
+struct blinkm_stream_stats {
+	int _frames;
+	int _sent;
+	int _dropped;
+	int _writes;
+	int _suppressed;
+	int _failed;
+	double _msecs;
+};
+
+int blinkm_stream_run(struct i2c_session *bus, int fd, uint8_t cmd, const uint8_t *leds, 
+		int num_leds, int fps, struct blinkm_stream_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
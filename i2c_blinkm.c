@@ -31,46 +31,93 @@
 #include <errno.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <linux/i2c.h>
 
 #include "utility.h"
 #include "i2c_blinkm.h"
 #include "blinkm_regs.h"
 #include "i2c_functions.h"
+#include "blinkm_cache.h"
 
 
 void read_error(uint8_t led);
 void write_error(uint8_t led);
+static int send_cmd(struct i2c_session *bus, uint8_t led, uint8_t cmd, 
+			const uint8_t *args, int nargs);
+static int query_cmd(struct i2c_session *bus, uint8_t led, uint8_t cmd, 
+			const uint8_t *args, int nargs, uint8_t *reply, int verbose);
 
-int blinkm_get_address(uint8_t led)
+#define OP_BATCH BLINKM_OP_BATCH
+#define OP_BCAST BLINKM_OP_BROADCAST
+#define OP_SCRIPT BLINKM_OP_SCRIPT
+
+/*
+ * Every opcode in blinkm_regs.h, indexed by opcode. The delays are the 
+ * waits after a write that goes to eeprom. Script lines, the script 
+ * length and the address keep the waits their functions always did,
+ * startup parameters are new and only wait for the eeprom. 
+ * blinkm_write_script() overlaps the script line waits and waits less.
+ */
+static const struct blinkm_opcode opcodes[256] = {
+	[SET_RGB_COLOR_NOW] = { "set-rgb", 3, 0, OP_BATCH | OP_BCAST | OP_SCRIPT, 0 },
+	[FADE_TO_RGB_COLOR] = { "fade-rgb", 3, 0, OP_BATCH | OP_BCAST | OP_SCRIPT, 0 },
+	[FADE_TO_HSB_COLOR] = { "fade-hsb", 3, 0, OP_BATCH | OP_BCAST | OP_SCRIPT, 0 },
+	[FADE_TO_RANDOM_RGB_COLOR] = { "fade-random-rgb", 3, 0, OP_BATCH | OP_BCAST | OP_SCRIPT, 0 },
+	[FADE_TO_RANDOM_HSB_COLOR] = { "fade-random-hsb", 3, 0, OP_BATCH | OP_BCAST | OP_SCRIPT, 0 },
+	[PLAY_LIGHT_SCRIPT] = { "play-script", 3, 0, OP_BATCH | OP_BCAST, 0 },
+	[STOP_SCRIPT] = { "stop-script", 0, 0, OP_BATCH | OP_BCAST, 0 },
+	[SET_FADE_SPEED] = { "set-fade-speed", 1, 0, OP_BATCH | OP_BCAST | OP_SCRIPT, 0 },
+	[SET_TIME_ADJUST] = { "set-time-adjust", 1, 0, OP_BATCH | OP_BCAST | OP_SCRIPT, 0 },
+	[GET_CURRENT_RGB_COLOR] = { "get-rgb", 0, 3, 0, 0 },
+	[WRITE_SCRIPT_LINE] = { "write-script-line", 7, 0, 0, BLINKM_SCRIPT_LINE_DELAY_MS },
+	[READ_SCRIPT_LINE] = { "read-script-line", 2, 5, 0, 0 },
+	[SET_SCRIPT_LENGTH_AND_REPEATS] = { "set-script-length-and-repeats", 2, 0, 0, BLINKM_SCRIPT_LENGTH_DELAY_MS },
+	[SET_BLINKM_ADDRESS] = { "set-address", 4, 0, 0, BLINKM_ADDRESS_DELAY_MS },
+	[GET_BLINKM_ADDRESS] = { "get-address", 0, 1, 0, 0 },
+	[GET_FIRMWARE_VERSION] = { "get-firmware-version", 0, 2, 0, 0 },
+	[SET_STARTUP_PARAMETERS] = { "set-startup-parameters", 5, 0, 0, BLINKM_EEPROM_DELAY_MS }
+};
+
+
+/*
+ * Return the descriptor for an opcode or NULL if it isn't one.
+ */
+const struct blinkm_opcode *blinkm_opcode(uint8_t cmd)
 {
-	int fh, result;
-	uint8_t data;
+	return opcodes[cmd]._name ? &opcodes[cmd] : NULL;
+}
 
-	fh = i2c_start_transaction(led);
+/*
+ * Serialize a command into data, which has room for size bytes. The 
+ * length comes from the opcode table, arguments past nargs are sent as 
+ * zero and extra ones are ignored.
+ * Return the length of the command or -1 for an unknown opcode or a 
+ * buffer that is too small.
+ */
+int blinkm_encode(uint8_t cmd, const uint8_t *args, int nargs, uint8_t *data, int size)
+{
+	const struct blinkm_opcode *op = &opcodes[cmd];
+	int i;
 
-	if (fh < 0) 
+	if (!op->_name || !data || size < 1 + op->_nargs)
 		return -1;
 
-	data = GET_BLINKM_ADDRESS;
+	data[0] = cmd;
 
-	result = write(fh, &data, 1);
+	for (i = 0; i < op->_nargs; i++)
+		data[i + 1] = (args && i < nargs) ? args[i] : 0;
 
-	if (result == 1) {
-		data = 0;
-		result = read(fh, &data, 1);
+	return 1 + op->_nargs;
+}
 
-		if (result != 1) {
-			read_error(led);
-			result = -1;
-		}	
-	} else {
-		write_error(led);
-		result = -1;
-	}
+int blinkm_get_address(struct i2c_session *bus, uint8_t led)
+{
+	uint8_t reply;
 
-	i2c_end_transaction(fh);
+	if (query_cmd(bus, led, GET_BLINKM_ADDRESS, NULL, 0, &reply, 1) < 0)
+		return -1;
 
-	return result;
+	return reply;
 }
 
 /*
@@ -79,502 +126,556 @@ int blinkm_get_address(uint8_t led)
  * power for both the overo and the led to get the bus working again. 
  * It does change the address though.
  */
-int blinkm_set_address(uint8_t new_addr)
+int blinkm_set_address(struct i2c_session *bus, uint8_t new_addr)
 {
-	int fh, result;
-	uint8_t data[8];
+	uint8_t args[4];
+	int result;
 
-	fh = i2c_start_transaction(0x00);
+	args[0] = new_addr;
+	args[1] = 0xd0;
+	args[2] = 0x0d;
+	args[3] = new_addr;
 
-	if (fh < 0) 
-		return -1;
+	/* sent to the general call address */
+	result = send_cmd(bus, 0x00, SET_BLINKM_ADDRESS, args, 4);
 
-	data[0] = SET_BLINKM_ADDRESS;
-	data[1] = new_addr;
-	data[2] = 0xd0;
-	data[3] = 0x0d;
-	data[4] = new_addr;
+	/* whether it worked or not, no led is known any more */
+	blinkm_cache_invalidate(bus->_cache, 0);
 
-	result = write(fh, &data, 5);
+	if (result < 0)
+		return -1;
 
-	if (result == 5) {
-		fprintf(stdout, "Set new blinkm address to 0x%02X\n", new_addr);
-		result = new_addr;
-	} else {
-		write_error(0x00);
-		result = -1;
-	}
+	fprintf(stdout, "Set new blinkm address to 0x%02X\n", new_addr);
 
-	i2c_end_transaction(fh);
+	return new_addr;
+}
 
-	msleep(100);
+int blinkm_set_rgb_color_now(struct i2c_session *bus, uint8_t led, uint8_t r, uint8_t g, uint8_t b)
+{
+	uint8_t args[3] = { r, g, b };
 
-	return result;
+	return send_cmd(bus, led, SET_RGB_COLOR_NOW, args, 3);
 }
 
-int blinkm_set_rgb_color_now(uint8_t led, uint8_t r, uint8_t g, uint8_t b)
+int blinkm_fade_to_rgb_color(struct i2c_session *bus, uint8_t led, uint8_t r, uint8_t g, uint8_t b)
 {
-	int fh, result;
-	uint8_t data[4];
+	uint8_t args[3] = { r, g, b };
 
-	fh = i2c_start_transaction(led);
+	return send_cmd(bus, led, FADE_TO_RGB_COLOR, args, 3);
+}
 
-	if (fh < 0) 
-		return -1;
+int blinkm_fade_to_hsb_color(struct i2c_session *bus, uint8_t led, uint8_t h, uint8_t s, uint8_t b)
+{
+	uint8_t args[3] = { h, s, b };
 
-	data[0] = SET_RGB_COLOR_NOW;
-	data[1] = r;
-	data[2] = g;
-	data[3] = b;
+	return send_cmd(bus, led, FADE_TO_HSB_COLOR, args, 3);
+}
 
-	result = write(fh, data, 4);
+int blinkm_fade_to_random_rgb_color(struct i2c_session *bus, uint8_t led, uint8_t r, uint8_t g, uint8_t b)
+{
+	uint8_t args[3] = { r, g, b };
 
-	if (result != 4) {
-		write_error(led);
-		result = -1;
-	}
+	return send_cmd(bus, led, FADE_TO_RANDOM_RGB_COLOR, args, 3);
+}
 
-	i2c_end_transaction(fh);
+int blinkm_fade_to_random_hsb_color(struct i2c_session *bus, uint8_t led, uint8_t h, uint8_t s, uint8_t b)
+{
+	uint8_t args[3] = { h, s, b };
 
-	return result;
+	return send_cmd(bus, led, FADE_TO_RANDOM_HSB_COLOR, args, 3);
 }
 
-int blinkm_fade_to_rgb_color(uint8_t led, uint8_t r, uint8_t g, uint8_t b)
+int blinkm_get_current_rgb_color(struct i2c_session *bus, uint8_t led)
 {
-	int fh, result;
-	uint8_t data[4];
+	uint8_t reply[3];
 
-	fh = i2c_start_transaction(led);
-
-	if (fh < 0) 
+	if (query_cmd(bus, led, GET_CURRENT_RGB_COLOR, NULL, 0, reply, 1) < 0)
 		return -1;
 
-	data[0] = FADE_TO_RGB_COLOR;
-	data[1] = r;
-	data[2] = g;
-	data[3] = b;
-
-	result = write(fh, data, 4);
-
-	if (result != 4) {
-		write_error(led);
-		result = -1;
-	}
-
-	i2c_end_transaction(fh);
-
-	return result;
+	/* pack the rgb values into the low three bytes of result */
+	return (reply[0] << 16) + (reply[1] << 8) + reply[2];
 }
 
-int blinkm_fade_to_hsb_color(uint8_t led, uint8_t h, uint8_t s, uint8_t b)
+int blinkm_stop_script(struct i2c_session *bus, uint8_t led)
 {
-	int fh, result;
-	uint8_t data[4];
-
-	fh = i2c_start_transaction(led);
-
-	if (fh < 0) 
-		return -1;
+	return send_cmd(bus, led, STOP_SCRIPT, NULL, 0);
+}
 
-	data[0] = FADE_TO_HSB_COLOR;
-	data[1] = h;
-	data[2] = s;
-	data[3] = b;
+int blinkm_play_script(struct i2c_session *bus, uint8_t led, uint8_t script_id, uint8_t num_repeats)
+{
+	/* always starting scripts from line zero for now */
+	uint8_t args[3] = { script_id, num_repeats, 0 };
 
-	result = write(fh, data, 4);
+	return send_cmd(bus, led, PLAY_LIGHT_SCRIPT, args, 3);
+}
 
-	if (result != 4) {
-		write_error(led);
-		result = -1;
-	}
+int blinkm_set_fade_speed(struct i2c_session *bus, uint8_t led, uint8_t speed)
+{
+	return send_cmd(bus, led, SET_FADE_SPEED, &speed, 1);
+}
 
-	i2c_end_transaction(fh);
+int blinkm_set_time_adjust(struct i2c_session *bus, uint8_t led, int8_t adjust)
+{
+	uint8_t arg = adjust;
 
-	return result;
+	return send_cmd(bus, led, SET_TIME_ADJUST, &arg, 1);
 }
 
-int blinkm_fade_to_random_rgb_color(uint8_t led, uint8_t r, uint8_t g, uint8_t b)
+int blinkm_read_script_line(struct i2c_session *bus, uint8_t led, uint8_t line_no, struct script_line *s)
 {
-	int fh, result;
-	uint8_t data[4];
+	uint8_t args[2], reply[5];
 
-	fh = i2c_start_transaction(led);
-
-	if (fh < 0) 
+	if (!s) 
 		return -1;
 
-	data[0] = FADE_TO_RANDOM_RGB_COLOR;
-	data[1] = r;
-	data[2] = g;
-	data[3] = b;
-
-	result = write(fh, data, 4);
+	/* 
+	 *  The blinkm doesn't bring the SDA line high again for any script number but zero. 
+	 *  Script zero is the only script you can change so maybe this is by design, not 
+	 *  very graceful though.
+	 */
+	args[0] = 0x00;
+	args[1] = line_no;
 
-	if (result != 4) {
-		write_error(led);
-		result = -1;
-	}
+	if (query_cmd(bus, led, READ_SCRIPT_LINE, args, 2, reply, 1) < 0)
+		return -1;
 
-	i2c_end_transaction(fh);
+	s->_ticks = reply[0];
+	s->_cmd = reply[1];
+	s->_arg[0] = reply[2];
+	s->_arg[1] = reply[3];
+	s->_arg[2] = reply[4];
 
-	return result;
+	return 5;
 }
 
-int blinkm_fade_to_random_hsb_color(uint8_t led, uint8_t h, uint8_t s, uint8_t b)
+int blinkm_write_script_line(struct i2c_session *bus, uint8_t led, uint8_t line_no, struct script_line *s)
 {
-	int fh, result;
-	uint8_t data[4];
+	uint8_t args[7];
 
-	fh = i2c_start_transaction(led);
+	if (!s) 
+		return -1;
 
-	if (fh < 0) 
+	if (line_no > 49) {
+		fprintf(stderr, "Invalid script line number %d\n", line_no);
 		return -1;
+	}
 
-	data[0] = FADE_TO_RANDOM_HSB_COLOR;
-	data[1] = h;
-	data[2] = s;
-	data[3] = b;
+	if (!(opcodes[s->_cmd]._flags & BLINKM_OP_SCRIPT)) {
+		fprintf(stderr, "Invalid script command 0x%02X\n", s->_cmd);
+		return -1;
+	}
 
-	result = write(fh, data, 4);
+	args[0] = 0x00;
+	args[1] = line_no;
+	args[2] = s->_ticks;
+	args[3] = s->_cmd;
+	args[4] = s->_arg[0];
+	args[5] = s->_arg[1];
+	args[6] = s->_arg[2];
 
-	if (result != 4) {
-		write_error(led);
-		result = -1;
-	}
+	return send_cmd(bus, led, WRITE_SCRIPT_LINE, args, 7);
+}
 
-	i2c_end_transaction(fh);
+int blinkm_set_script_length_and_repeats(struct i2c_session *bus, uint8_t led, uint8_t length, uint8_t repeats)
+{
+	uint8_t args[2] = { length, repeats };
 
-	return result;
+	return send_cmd(bus, led, SET_SCRIPT_LENGTH_AND_REPEATS, args, 2);
 }
 
-int blinkm_get_current_rgb_color(uint8_t led)
+/*
+ * The body every single led write shares. A write the session's cache
+ * says is redundant is skipped, a successful one is remembered, and 
+ * commands that go to eeprom get their wait whether they worked or not.
+ * Return the number of bytes written, or -1 on failure.
+ */
+static int send_cmd(struct i2c_session *bus, uint8_t led, uint8_t cmd, 
+			const uint8_t *args, int nargs)
 {
-	int fh, result;
-	uint8_t data[4];
+	uint8_t data[BLINKM_MAX_CMD_LEN];
+	int result, len;
 
-	fh = i2c_start_transaction(led);
+	len = blinkm_encode(cmd, args, nargs, data, sizeof(data));
 
-	if (fh < 0) 
+	if (len < 0)
 		return -1;
 
-	data[0] = GET_CURRENT_RGB_COLOR;
+	/* data[1..3] are in the buffer for any opcode, zero past the arguments */
+	if (len < 4)
+		memset(&data[len], 0, 4 - len);
 
-	result = write(fh, data, 1);
+	if (blinkm_cache_check(bus->_cache, led, cmd, data[1], data[2], data[3]))
+		return len;
 
-	if (result == 1) {
-		bzero(data, sizeof(data));
-		
-		result = read(fh, data, 3);
+	result = i2c_write(bus, led, data, len);
 
-		if (result == 3) {
-			/* pack the rgb values into the low three bytes of result */
-			result = (data[0] << 16) + (data[1] << 8) + data[2];
-		} else {
-			read_error(led);
-			result = -1;
-		}
-	} else {
+	if (result != len) {
 		write_error(led);
 		result = -1;
+	} else {
+		blinkm_cache_update(bus->_cache, led, cmd, data[1], data[2], data[3]);
 	}
 
-	i2c_end_transaction(fh);
+	if (opcodes[cmd]._delay_ms)
+		msleep(opcodes[cmd]._delay_ms);
 
 	return result;
 }
 
-int blinkm_stop_script(uint8_t led)
+/*
+ * Write a command and read back the reply length the table gives it, as
+ * one combined transaction.
+ * Return the number of bytes read, or -1 on failure.
+ */
+static int query_cmd(struct i2c_session *bus, uint8_t led, uint8_t cmd, 
+			const uint8_t *args, int nargs, uint8_t *reply, int verbose)
 {
-	int fh, result;
-	uint8_t data;
+	uint8_t data[BLINKM_MAX_CMD_LEN];
+	int len, reply_len;
 
-	fh = i2c_start_transaction(led);
+	len = blinkm_encode(cmd, args, nargs, data, sizeof(data));
+	reply_len = opcodes[cmd]._reply_len;
 
-	if (fh < 0) 
+	if (len < 0 || reply_len < 1)
 		return -1;
 
-	data = STOP_SCRIPT;
-
-	result = write(fh, &data, 1);
+	memset(reply, 0, reply_len);
 
-	i2c_end_transaction(fh);
+	if (i2c_write_read(bus, led, data, len, reply, reply_len) != reply_len) {
+		if (verbose) 
+			read_error(led);
 
-	if (result != 1) {
-		write_error(led);
-		result = -1;
+		return -1;
 	}
 
-	return result;
+	return reply_len;
 }
 
-int blinkm_play_script(uint8_t led, uint8_t script_id, uint8_t num_repeats)
+/*
+ * Read the same script line from every led in one transfer, a combined
+ * write/read pair per led. If any led NAKs, the whole transfer is lost, so
+ * fall back to reading the leds one at a time. ok[i] is set for each led
+ * whose line was read.
+ * Return the number of leds read.
+ */
+int blinkm_batch_read_script_line(struct i2c_session *bus, const uint8_t *leds, int num_leds,
+		uint8_t line_no, struct script_line *lines, int *ok)
 {
-	int fh, result;
-	uint8_t data[4];
+	struct i2c_msg msgs[2 * BLINKM_MAX_BATCH];
+	uint8_t cmd[BLINKM_MAX_BATCH][3];
+	uint8_t reply[BLINKM_MAX_BATCH][5];
+	uint8_t args[2];
+	int i, count;
 
-	fh = i2c_start_transaction(led);
-
-	if (fh < 0) 
+	if (!leds || num_leds < 1 || num_leds > BLINKM_MAX_BATCH || !lines || !ok) 
 		return -1;
 
-	data[0] = PLAY_LIGHT_SCRIPT;
-	data[1] = script_id;
-	data[2] = num_repeats;
-	/* always starting scripts from line zero for now */
-	data[3] = 0;
+	args[0] = 0x00;
+	args[1] = line_no;
 
-	result = write(fh, data, 4);
+	for (i = 0; i < num_leds; i++) {
+		blinkm_encode(READ_SCRIPT_LINE, args, 2, cmd[i], sizeof(cmd[i]));
 
-	i2c_end_transaction(fh);
+		msgs[2 * i].addr = leds[i];
+		msgs[2 * i].flags = 0;
+		msgs[2 * i].len = 3;
+		msgs[2 * i].buf = cmd[i];
 
-	if (result != 4) {
-		write_error(led);
-		result = -1;
+		msgs[(2 * i) + 1].addr = leds[i];
+		msgs[(2 * i) + 1].flags = I2C_M_RD;
+		msgs[(2 * i) + 1].len = 5;
+		msgs[(2 * i) + 1].buf = reply[i];
 	}
 
-	return result;
-}
-
-int blinkm_set_fade_speed(uint8_t led, uint8_t speed)
-{
-	int fh, result;
-	uint8_t data[2];
-
-	fh = i2c_start_transaction(led);
-
-	if (fh < 0) 
-		return -1;
+	count = 0;
 
-	data[0] = SET_FADE_SPEED;
-	data[1] = speed;
+	if (i2c_transfer(bus, msgs, 2 * num_leds) == 2 * num_leds) {
+		for (i = 0; i < num_leds; i++) {
+			lines[i]._ticks = reply[i][0];
+			lines[i]._cmd = reply[i][1];
+			lines[i]._arg[0] = reply[i][2];
+			lines[i]._arg[1] = reply[i][3];
+			lines[i]._arg[2] = reply[i][4];
+			ok[i] = 1;
+		}
 
-	result = write(fh, data, 2);
+		return num_leds;
+	}
 
-	i2c_end_transaction(fh);
+	for (i = 0; i < num_leds; i++) {
+		ok[i] = blinkm_read_script_line(bus, leds[i], line_no, &lines[i]) > 0;
 
-	if (result != 2) {
-		write_error(led);
-		result = -1;
+		if (ok[i])
+			count++;
 	}
 
-	return result;
+	return count;
 }
 
-int blinkm_set_time_adjust(uint8_t led, int8_t adjust)
+/*
+ * Write a whole script to script 0 of every led in the list. Each line goes
+ * to all the leds in one batched transfer, so while one led is still 
+ * busy writing its eeprom the bus is already talking to the next. After a
+ * line we only wait for whatever is left of delay_ms since that line's 
+ * transfer started. A negative delay_ms uses BLINKM_EEPROM_DELAY_MS.
+ * If skip is not NULL, skip[line * num_leds + led_index] set means that led
+ * already has that line, and a line nobody needs costs nothing. Row 
+ * num_lines of skip covers the length and repeats write.
+ * Return the number of leds that took every line, or -1 on bad arguments.
+ */
+int blinkm_write_script(struct i2c_session *bus, const uint8_t *leds, int num_leds,
+		const struct script_line *lines, int num_lines, uint8_t repeats, int delay_ms,
+		const uint8_t *skip)
 {
-	int fh, result;
-	uint8_t data[2];
-
-	fh = i2c_start_transaction(led);
-
-	if (fh < 0) 
+	struct blinkm_batch batch;
+	uint8_t data[BLINKM_MAX_CMD_LEN], args[7];
+	int failed[BLINKM_MAX_BATCH];
+	uint64_t start, elapsed;
+	int i, j, k, count;
+
+	if (!leds || num_leds < 1 || num_leds > BLINKM_MAX_BATCH || !lines 
+			|| num_lines < 1 || num_lines > MAX_SCRIPT_LINES) 
 		return -1;
 
-	data[0] = SET_TIME_ADJUST;
-	data[1] = adjust;
-
-	result = write(fh, data, 2);
+	if (delay_ms < 0)
+		delay_ms = BLINKM_EEPROM_DELAY_MS;
 
-	i2c_end_transaction(fh);
-
-	if (result != 2) {
-		write_error(led);
-		result = -1;
+	for (i = 0; i < num_lines; i++) {
+		if (!(opcodes[lines[i]._cmd]._flags & BLINKM_OP_SCRIPT)) {
+			fprintf(stderr, "Invalid script command 0x%02X on line %d\n", lines[i]._cmd, i);
+			return -1;
+		}
 	}
 
-	return result;
-}
-
-int blinkm_read_script_line(uint8_t led, uint8_t line_no, struct script_line *s)
-{
-	int fh, result;
-	uint8_t data[8];
+	memset(failed, 0, sizeof(failed));
 
-	if (!s) 
-		return -1;
+	for (i = 0; i <= num_lines; i++) {
+		if (i < num_lines) {
+			args[0] = 0x00;
+			args[1] = i;
+			args[2] = lines[i]._ticks;
+			args[3] = lines[i]._cmd;
+			memcpy(&args[4], lines[i]._arg, 3);
+			count = blinkm_encode(WRITE_SCRIPT_LINE, args, 7, data, sizeof(data));
+		}
+		else {
+			/* the length and repeats are stored in eeprom too */
+			args[0] = num_lines;
+			args[1] = repeats;
+			count = blinkm_encode(SET_SCRIPT_LENGTH_AND_REPEATS, args, 2, data, sizeof(data));
+		}
 
-	fh = i2c_start_transaction(led);
+		blinkm_batch_init(&batch);
 
-	if (fh < 0) 
-		return -1;
+		for (j = 0; j < num_leds; j++) {
+			if (failed[j])
+				continue;
 
-	data[0] = READ_SCRIPT_LINE;
-	/* 
-	 *  The blinkm doesn't bring the SDA line high again for any script number but zero. 
-	 *  Script zero is the only script you can change so maybe this is by design, not 
-	 *  very graceful though.
-	 */
-	data[1] = 0x00; 
-	data[2] = line_no;
+			if (skip && skip[(i * num_leds) + j])
+				continue;
 
-	result = write(fh, data, 3);
+			blinkm_batch_add_raw(&batch, leds[j], data, count);
+		}
 
-	if (result != 3) {
-		write_error(led);
-		result = -1;
-	} else {
-		bzero(data, sizeof(data));
+		if (batch._count == 0)
+			continue;
 
-		result = read(fh, data, 5);
+		start = monotonic_usecs();
 
-		if (result != 5) {
-			read_error(led);
-			result = -1;
-		} else {
-			s->_ticks = data[0];
-			s->_cmd = data[1];
-			s->_arg[0] = data[2];
-			s->_arg[1] = data[3];
-			s->_arg[2] = data[4];
+		if (blinkm_batch_send(bus, &batch) != batch._count) {
+			/* find out who didn't take it and leave them out from now on */
+			for (j = 0; j < batch._count; j++) 
+				if (!batch._cmd[j]._sent)
+					for (k = 0; k < num_leds; k++) 
+						if (leds[k] == batch._cmd[j]._led)
+							failed[k] = 1;
 		}
+
+		elapsed = (monotonic_usecs() - start) / 1000;
+
+		if (elapsed < (uint64_t) delay_ms)
+			msleep(delay_ms - elapsed);
 	}
 
-	i2c_end_transaction(fh);
+	count = 0;
 
-	return result;
+	for (j = 0; j < num_leds; j++) 
+		if (!failed[j])
+			count++;
+
+	return count;
 }
 
-int blinkm_write_script_line(uint8_t led, uint8_t line_no, struct script_line *s)
+/*
+ * The firmware version is either 'a'.'a' or 'a'.'b' for a BlinkM or MaxM 
+ * respectively.
+ * They get packed into the low order bytes of the result. 
+ * We use this to scan a bus for blinkm devices. The verbose flag will suppress
+ * error messages if false.
+ */
+int blinkm_get_firmware_version(struct i2c_session *bus, uint8_t led, int verbose)
 {
-	int fh, result;
-	uint8_t data[8];
-
-	if (!s) 
-		return -1;
+	uint8_t reply[2];
 
-	if (line_no > 49) {
-		fprintf(stderr, "Invalid script line number %d\n", line_no);
+	if (query_cmd(bus, led, GET_FIRMWARE_VERSION, NULL, 0, reply, verbose) < 0)
 		return -1;
-	}
 
-	switch (s->_cmd) {
-	case SET_RGB_COLOR_NOW:
-	case FADE_TO_RGB_COLOR:
-	case FADE_TO_HSB_COLOR:
-	case FADE_TO_RANDOM_RGB_COLOR:
-	case FADE_TO_RANDOM_HSB_COLOR:
-	case SET_FADE_SPEED:
-	case SET_TIME_ADJUST:
-		break;
-
-	default:
-		fprintf(stderr, "Invalid script command 0x%02X\n", s->_cmd);
-		return -1;
-	}
+	return (reply[0] << 8) | reply[1];
+}
 
-	fh = i2c_start_transaction(led);
+void blinkm_batch_init(struct blinkm_batch *b)
+{
+	if (b)
+		b->_count = 0;
+}
 
-	if (fh < 0) 
+/*
+ * Encode one command that can be batched into data, which needs room for
+ * 4 bytes. This is the fast path the batch, queue, stream and cue code 
+ * use. The argument count comes from the opcode table, unused arguments 
+ * are ignored.
+ * Return the length of the command or -1 if it can't be batched.
+ */
+int blinkm_encode_cmd(uint8_t cmd, uint8_t a1, uint8_t a2, uint8_t a3, uint8_t *data)
+{
+	if (!(opcodes[cmd]._flags & BLINKM_OP_BATCH))
 		return -1;
 
-	data[0] = WRITE_SCRIPT_LINE;
-	data[1] = 0x00; 
-	data[2] = line_no;
-	data[3] = s->_ticks;
-	data[4] = s->_cmd;
-	data[5] = s->_arg[0];
-	data[6] = s->_arg[1];
-	data[7] = s->_arg[2];
+	data[0] = cmd;
+	data[1] = a1;
+	data[2] = a2;
+	data[3] = a3;
 
-#if 1 
-	result = write(fh, data, 8);
+	return 1 + opcodes[cmd]._nargs;
+}
 
-	if (result != 8) {
-		write_error(led);
-		result = -1;
-	}
+/*
+ * Queue one write-only command. 
+ * Return the index of the queued command or -1 if the batch is full or the
+ * command can't be batched.
+ */
+int blinkm_batch_add(struct blinkm_batch *b, uint8_t led, uint8_t cmd, uint8_t a1, uint8_t a2, uint8_t a3)
+{
+	struct blinkm_cmd *c;
+	int len;
 
-#else
-	fprintf(stderr, "\nWriteScriptLine: ");
+	if (!b || b->_count >= BLINKM_MAX_BATCH) 
+		return -1;
 
-	for (i = 0; i < 8; i++) 
-		fprintf(stderr, "0x%02X ", data[i]);
-	
-	fprintf(stderr, "\n");
-#endif
+	c = &b->_cmd[b->_count];
 
-	msleep(100);
+	len = blinkm_encode_cmd(cmd, a1, a2, a3, c->_data);
 
-	i2c_end_transaction(fh);
+	if (len < 0) {
+		fprintf(stderr, "Command 0x%02X can't be batched\n", cmd);
+		return -1;
+	}
 
-	return result;
+	c->_led = led;
+	c->_len = len;
+	c->_sent = 0;
+
+	return b->_count++;
 }
 
-int blinkm_set_script_length_and_repeats(uint8_t led, uint8_t length, uint8_t repeats)
+/*
+ * Queue an already encoded command, for the ones that don't fit 
+ * blinkm_batch_add() like script lines.
+ */
+int blinkm_batch_add_raw(struct blinkm_batch *b, uint8_t led, const uint8_t *data, int len)
 {
-	int fh, result;
-	uint8_t data[4];
+	struct blinkm_cmd *c;
 
-	fh = i2c_start_transaction(led);
-
-	if (fh < 0) 
+	if (!b || b->_count >= BLINKM_MAX_BATCH || !data || len < 1 || len > BLINKM_MAX_CMD_LEN) 
 		return -1;
 
-	data[0] = SET_SCRIPT_LENGTH_AND_REPEATS;
-	data[1] = length;
-	data[2] = repeats;
-
-	result = write(fh, data, 3);
-	
-	if (result != 3) {
-		write_error(led);
-		result = -1;
-	}
-
-	msleep(50);
-
-	i2c_end_transaction(fh);
+	c = &b->_cmd[b->_count];
+	c->_led = led;
+	c->_len = len;
+	c->_sent = 0;
+	memset(c->_data, 0, sizeof(c->_data));
+	memcpy(c->_data, data, len);
 
-	return result;
+	return b->_count++;
 }
 
 /*
- * The firmware version is either 'a'.'a' or 'a'.'b' for a BlinkM or MaxM 
- * respectively.
- * They get packed into the low order bytes of the result. 
- * We use this to scan a bus for blinkm devices. The verbose flag will suppress
- * error messages if false.
+ * Send every queued command with a single I2C_RDWR call. Commands the 
+ * session's shadow cache says are redundant are left out.
+ * A NAK from any one device aborts the whole transfer, so on failure fall 
+ * back to sending the commands one at a time to find the bad ones.
+ * Return the number of commands that were written.
  */
-int blinkm_get_firmware_version(uint8_t led, int verbose)
+int blinkm_batch_send(struct i2c_session *bus, struct blinkm_batch *b)
 {
-	int fh, result;
-	uint8_t data[2];
+	struct i2c_msg msgs[BLINKM_MAX_BATCH];
+	struct blinkm_cmd *cmds[BLINKM_MAX_BATCH];
+	struct blinkm_cmd *c;
+	int i, n, count;
 
-	fh = i2c_start_transaction(led);
+	if (!bus || !b || b->_count < 1) 
+		return 0;
 
-	if (fh < 0) 
-		return -1;
+	n = 0;
 
-	data[0] = GET_FIRMWARE_VERSION;
+	for (i = 0; i < b->_count; i++) {
+		c = &b->_cmd[i];
 
-	result = write(fh, data, 1);
+		c->_sent = 0;
 
-	if (result == 1) {
-		data[0] = 0;
-		data[1] = 0;
+		/* suppressed commands count as sent, the led already has that state */
+		if (blinkm_cache_check(bus->_cache, c->_led, c->_data[0], 
+				c->_data[1], c->_data[2], c->_data[3])) {
+			c->_sent = 1;
+			continue;
+		}
+
+		/* better to leave a tripped led out than have the transfer refused */
+		if (!i2c_address_allowed(bus, c->_led))
+			continue;
 
-		result = read(fh, data, 2);
+		msgs[n].addr = c->_led;
+		msgs[n].flags = 0;
+		msgs[n].len = c->_len;
+		msgs[n].buf = c->_data;
+		cmds[n] = c;
+		n++;
+	}
 
-		if (result != 2) {
-			if (verbose) 
-				read_error(led);
+	if (n == 0)
+		return 0;
 
-			result = -1;
-		} else {
-			result = data[0];
-			result <<= 8;
-			result |= data[1];
+	if (i2c_transfer(bus, msgs, n) == n) {
+		for (i = 0; i < n; i++) {
+			cmds[i]->_sent = 1;
+			blinkm_cache_update(bus->_cache, cmds[i]->_led, cmds[i]->_data[0], 
+					cmds[i]->_data[1], cmds[i]->_data[2], cmds[i]->_data[3]);
 		}
-	} else {
-		if (verbose) 
-			write_error(led);
 
-		result = -1;
+		return n;
 	}
 
-	i2c_end_transaction(fh);
+	count = 0;
 
-	return result;
+	for (i = 0; i < n; i++) {
+		c = cmds[i];
+
+		/* tripped by an earlier failure in this batch */
+		if (!i2c_address_allowed(bus, c->_led))
+			continue;
+
+		if (i2c_transfer(bus, &msgs[i], 1) == 1) {
+			c->_sent = 1;
+			blinkm_cache_update(bus->_cache, c->_led, c->_data[0], 
+					c->_data[1], c->_data[2], c->_data[3]);
+			count++;
+		}
+		else {
+			write_error(c->_led);
+		}
+	}
+
+	return count;
 }
 
 void read_error(uint8_t led)
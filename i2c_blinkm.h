@@ -33,36 +33,94 @@
 
 #define MAX_SCRIPT_LINES 50
 
+/* time for the firmware to store one script line in eeprom */
+#define BLINKM_EEPROM_DELAY_MS 20
+
+/* the longer waits the single command functions have always done */
+#define BLINKM_SCRIPT_LINE_DELAY_MS 100
+#define BLINKM_SCRIPT_LENGTH_DELAY_MS 50
+#define BLINKM_ADDRESS_DELAY_MS 100
+
+/* one command for every address on the bus */
+#define BLINKM_MAX_BATCH 128
+#define BLINKM_MAX_CMD_LEN 8
+
+/* opcode flags, see blinkm_opcode() */
+/* no reply, no wait and at most 3 arguments, so it can go in a batch */
+#define BLINKM_OP_BATCH 0x01
+/* every led can take it at once through the general call */
+#define BLINKM_OP_BROADCAST 0x02
+/* allowed as the command of a script line */
+#define BLINKM_OP_SCRIPT 0x04
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+struct i2c_session;
+
 struct script_line {
 	uint8_t _ticks;
 	uint8_t _cmd;
 	uint8_t _arg[3];
 };
 
-int blinkm_get_address(uint8_t led);
-int blinkm_set_address(uint8_t new_addr);
-int blinkm_get_firmware_version(uint8_t led, int verbose);
-
-int blinkm_set_rgb_color_now(uint8_t led, uint8_t r, uint8_t g, uint8_t b);
-int blinkm_fade_to_rgb_color(uint8_t led, uint8_t r, uint8_t g, uint8_t b);
-int blinkm_fade_to_hsb_color(uint8_t led, uint8_t h, uint8_t s, uint8_t b);
-int blinkm_fade_to_random_rgb_color(uint8_t led, uint8_t r, uint8_t g, uint8_t b);
-int blinkm_fade_to_random_hsb_color(uint8_t led, uint8_t h, uint8_t s, uint8_t b);
+/* what the firmware expects for one opcode */
+struct blinkm_opcode {
+	const char *_name;
+	uint8_t _nargs;
+	uint8_t _reply_len;
+	uint8_t _flags;
+	uint16_t _delay_ms;
+};
 
-int blinkm_get_current_rgb_color(uint8_t led);
+/* a single encoded command waiting in a batch */
+struct blinkm_cmd {
+	uint8_t _led;
+	uint8_t _len;
+	uint8_t _sent;
+	uint8_t _data[BLINKM_MAX_CMD_LEN];
+};
 
-int blinkm_stop_script(uint8_t led);
-int blinkm_play_script(uint8_t led, uint8_t script_id, uint8_t num_repeats);
-int blinkm_set_fade_speed(uint8_t led, uint8_t speed);
-int blinkm_set_time_adjust(uint8_t led, int8_t adjust);
+struct blinkm_batch {
+	int _count;
+	struct blinkm_cmd _cmd[BLINKM_MAX_BATCH];
+};
 
-int blinkm_read_script_line(uint8_t led, uint8_t line_no, struct script_line *s);
-int blinkm_write_script_line(uint8_t led, uint8_t line_no, struct script_line *s);
-int blinkm_set_script_length_and_repeats(uint8_t led, uint8_t length, uint8_t repeats);
+int blinkm_get_address(struct i2c_session *bus, uint8_t led);
+int blinkm_set_address(struct i2c_session *bus, uint8_t new_addr);
+int blinkm_get_firmware_version(struct i2c_session *bus, uint8_t led, int verbose);
+
+int blinkm_set_rgb_color_now(struct i2c_session *bus, uint8_t led, uint8_t r, uint8_t g, uint8_t b);
+int blinkm_fade_to_rgb_color(struct i2c_session *bus, uint8_t led, uint8_t r, uint8_t g, uint8_t b);
+int blinkm_fade_to_hsb_color(struct i2c_session *bus, uint8_t led, uint8_t h, uint8_t s, uint8_t b);
+int blinkm_fade_to_random_rgb_color(struct i2c_session *bus, uint8_t led, uint8_t r, uint8_t g, uint8_t b);
+int blinkm_fade_to_random_hsb_color(struct i2c_session *bus, uint8_t led, uint8_t h, uint8_t s, uint8_t b);
+
+int blinkm_get_current_rgb_color(struct i2c_session *bus, uint8_t led);
+
+int blinkm_stop_script(struct i2c_session *bus, uint8_t led);
+int blinkm_play_script(struct i2c_session *bus, uint8_t led, uint8_t script_id, uint8_t num_repeats);
+int blinkm_set_fade_speed(struct i2c_session *bus, uint8_t led, uint8_t speed);
+int blinkm_set_time_adjust(struct i2c_session *bus, uint8_t led, int8_t adjust);
+
+int blinkm_read_script_line(struct i2c_session *bus, uint8_t led, uint8_t line_no, struct script_line *s);
+int blinkm_write_script_line(struct i2c_session *bus, uint8_t led, uint8_t line_no, struct script_line *s);
+int blinkm_set_script_length_and_repeats(struct i2c_session *bus, uint8_t led, uint8_t length, uint8_t repeats);
+int blinkm_batch_read_script_line(struct i2c_session *bus, const uint8_t *leds, int num_leds,
+		uint8_t line_no, struct script_line *lines, int *ok);
+int blinkm_write_script(struct i2c_session *bus, const uint8_t *leds, int num_leds,
+		const struct script_line *lines, int num_lines, uint8_t repeats, int delay_ms,
+		const uint8_t *skip);
+
+const struct blinkm_opcode *blinkm_opcode(uint8_t cmd);
+int blinkm_encode(uint8_t cmd, const uint8_t *args, int nargs, uint8_t *data, int size);
+int blinkm_encode_cmd(uint8_t cmd, uint8_t a1, uint8_t a2, uint8_t a3, uint8_t *data);
+
+void blinkm_batch_init(struct blinkm_batch *b);
+int blinkm_batch_add(struct blinkm_batch *b, uint8_t led, uint8_t cmd, uint8_t a1, uint8_t a2, uint8_t a3);
+int blinkm_batch_add_raw(struct blinkm_batch *b, uint8_t led, const uint8_t *data, int len);
+int blinkm_batch_send(struct i2c_session *bus, struct blinkm_batch *b);
 
 #ifdef __cplusplus
 }
@@ -37,8 +37,14 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 
+#include <linux/i2c.h> 
 #include <linux/i2c-dev.h> 
 
+#include "utility.h"
+#include "i2c_functions.h"
+#include "i2c_stats.h"
+#include "i2c_recovery.h"
+
 /* Gumstix Overo */
 static char i2c_bus[] = "/dev/i2c-3";
 
@@ -49,75 +55,547 @@ static char i2c_bus[] = "/dev/i2c-3";
 /* static char i2c_bus[] = "/dev/i2c-1"; */
 
 
-/* some local functions */
-static int i2c_open_device();
-static int i2c_set_slave_address(int file, uint8_t address);
+static int call_error(int result, int expected);
+static void note_result(struct i2c_session *s, int address, int error);
+
+/* the /dev/i2c-N backend */
+static int dev_open(struct i2c_session *s);
+static void dev_close(struct i2c_session *s);
+static int dev_set_slave(struct i2c_session *s, uint8_t address);
+static int dev_write(struct i2c_session *s, uint8_t address, const uint8_t *data, int len);
+static int dev_read(struct i2c_session *s, uint8_t address, uint8_t *data, int len);
+static int dev_transfer(struct i2c_session *s, struct i2c_msg *msgs, int count);
+static int dev_probe(struct i2c_session *s, uint8_t address);
+static int dev_recover(struct i2c_session *s);
+
+const struct i2c_transport i2c_dev_transport = {
+	"dev",
+	dev_open,
+	dev_close,
+	dev_write,
+	dev_read,
+	dev_transfer,
+	dev_probe,
+	dev_recover
+};
 
 
 /*
- *  Return a file handle if successful.
+ *  Open the bus once and keep it open for the life of the session.
+ *  A NULL bus uses $BLINKM_BUS if set, otherwise the compiled in default.
  *  Return a value less then zero on failure.
  */
-int i2c_start_transaction(uint8_t slave_address)
+int i2c_open_session(struct i2c_session *s, const char *bus)
+{
+	if (!s)
+		return -1;
+
+	memset(s, 0, sizeof(struct i2c_session));
+	s->_fh = -1;
+	s->_slave = -1;
+
+	if (!bus)
+		bus = getenv("BLINKM_BUS");
+
+	if (!bus || !*bus)
+		bus = i2c_bus;
+
+	strncpy(s->_bus, bus, sizeof(s->_bus) - 1);
+
+	if (!strncmp(s->_bus, "sim", 3))
+		s->_ops = &i2c_sim_transport;
+	else
+		s->_ops = &i2c_dev_transport;
+
+	if (s->_ops->_open(s) < 0) {
+		s->_ops = NULL;
+		return -1;
+	}
+
+	return 1;
+}
+
+void i2c_close_session(struct i2c_session *s)
+{
+	if (s && s->_ops) {
+		s->_ops->_close(s);
+		s->_ops = NULL;
+	}
+}
+
+/*
+ *  Return the number of bytes written or a value less then zero on failure.
+ */
+int i2c_write(struct i2c_session *s, uint8_t address, const uint8_t *data, int len)
+{
+	uint64_t start, usecs;
+	int result, error;
+
+	if (!s || !s->_ops) 
+		return -1;
+
+	if (!i2c_recovery_allow(s->_recovery, address)) {
+		errno = EHOSTDOWN;
+		return -1;
+	}
+
+	if (!s->_stats && !s->_recovery)
+		return s->_ops->_write(s, address, data, len);
+
+	start = monotonic_usecs();
+	result = s->_ops->_write(s, address, data, len);
+	usecs = monotonic_usecs() - start;
+	error = call_error(result, len);
+
+	if (s->_stats) {
+		i2c_stats_record(s->_stats, address, len > 0 ? data[0] : 0, len, error, usecs);
+		i2c_stats_record_call(s->_stats, len, error, usecs);
+	}
+
+	note_result(s, address, error);
+
+	return result;
+}
+
+/*
+ *  Return the number of bytes read or a value less then zero on failure.
+ */
+int i2c_read(struct i2c_session *s, uint8_t address, uint8_t *data, int len)
+{
+	uint64_t start, usecs;
+	int result, error;
+
+	if (!s || !s->_ops) 
+		return -1;
+
+	if (!i2c_recovery_allow(s->_recovery, address)) {
+		errno = EHOSTDOWN;
+		return -1;
+	}
+
+	if (!s->_stats && !s->_recovery)
+		return s->_ops->_read(s, address, data, len);
+
+	start = monotonic_usecs();
+	result = s->_ops->_read(s, address, data, len);
+	usecs = monotonic_usecs() - start;
+	error = call_error(result, len);
+
+	if (s->_stats) {
+		i2c_stats_record(s->_stats, address, -1, len, error, usecs);
+		i2c_stats_record_call(s->_stats, len, error, usecs);
+	}
+
+	note_result(s, address, error);
+
+	return result;
+}
+
+/*
+ *  Write a command and read the reply as one combined transaction with a
+ *  repeated start, so the slave can't be interrupted between the two. 
+ *  Adapters that can't do plain I2C transfers get a write() then a read().
+ *  Return the number of bytes read or a value less then zero on failure.
+ */
+int i2c_write_read(struct i2c_session *s, uint8_t address, const uint8_t *wdata, int wlen,
+		uint8_t *rdata, int rlen)
 {
-	int fh, result;
+	struct i2c_msg msgs[2];
 
-	fh = i2c_open_device();
+	if (!s || !s->_ops) 
+		return -1;
 
-	if (fh < 0) 
+	if (!(s->_funcs & I2C_FUNC_I2C)) {
+		if (i2c_write(s, address, wdata, wlen) != wlen)
+			return -1;
+
+		return i2c_read(s, address, rdata, rlen);
+	}
+
+	msgs[0].addr = address;
+	msgs[0].flags = 0;
+	msgs[0].len = wlen;
+	msgs[0].buf = (uint8_t *) wdata;
+
+	msgs[1].addr = address;
+	msgs[1].flags = I2C_M_RD;
+	msgs[1].len = rlen;
+	msgs[1].buf = rdata;
+
+	if (i2c_transfer(s, msgs, 2) != 2)
 		return -1;
 
-	result = i2c_set_slave_address(fh, slave_address);	
+	return rlen;
+}
+
+/*
+ *  Submit a list of messages as one combined transfer. Each message 
+ *  carries its own slave address. If any of them goes to an address with
+ *  an open breaker nothing is sent.
+ *  Return the number of messages transferred or a value less then zero
+ *  on failure.
+ */
+int i2c_transfer(struct i2c_session *s, struct i2c_msg *msgs, int count)
+{
+	uint64_t start, usecs;
+	int i, result, error, bytes, one_address;
+
+	if (!s || !s->_ops || !msgs || count < 0) 
+		return -1;
+
+	for (i = 0; s->_recovery && i < count; i++) {
+		if (!i2c_recovery_allow(s->_recovery, msgs[i].addr)) {
+			errno = EHOSTDOWN;
+			return -1;
+		}
+	}
+
+	if ((!s->_stats && !s->_recovery) || count == 0)
+		return s->_ops->_transfer(s, msgs, count);
+
+	start = monotonic_usecs();
+	result = s->_ops->_transfer(s, msgs, count);
+	usecs = monotonic_usecs() - start;
+	error = call_error(result, count);
+
+	bytes = 0;
+	one_address = 1;
+
+	for (i = 0; i < count; i++) {
+		bytes += msgs[i].len;
 
-	if (result < 0) {
-		close(fh);
+		if (msgs[i].addr != msgs[0].addr)
+			one_address = 0;
+	}
+
+	if (s->_stats)
+		i2c_stats_record_call(s->_stats, bytes, error, usecs);
+
+	/* 
+	 * The messages share the time. A failure can't be pinned on one 
+	 * address when several were involved, the callers fall back to single
+	 * writes for that and those get counted.
+	 */
+	if (error && !one_address)
 		return result;
+
+	for (i = 0; s->_stats && i < count; i++) {
+		i2c_stats_record(s->_stats, msgs[i].addr, 
+			(msgs[i].flags & I2C_M_RD) || msgs[i].len < 1 ? -1 : msgs[i].buf[0],
+			msgs[i].len, error, usecs / count);
+	}
+
+	if (one_address) {
+		note_result(s, msgs[0].addr, error);
+	}
+	else {
+		for (i = 0; s->_recovery && i < count; i++)
+			i2c_recovery_record(s->_recovery, msgs[i].addr, 0);
 	}
 
-	return fh;
+	return result;
 }
 
 /*
- *  Just closes the file handle returned by i2c_start_transaction.
+ *  Cheap presence check that doesn't send a command byte.
+ *  Return 1 if the address ACKed, 0 if not, less then zero on error.
  */
-int i2c_end_transaction(int fh)
+int i2c_probe(struct i2c_session *s, uint8_t address)
 {
-	if (fh > 0) 
-		close(fh);
+	int result;
 
-	return 1;
+	if (!s || !s->_ops) 
+		return -1;
+
+	result = s->_ops->_probe(s, address);
+
+	/* an empty address not answering is the expected case, not an error */
+	if (s->_stats) {
+		s->_stats->_probes++;
+
+		if (result > 0)
+			s->_stats->_probe_acks++;
+	}
+
+	return result;
+}
+
+/*
+ *  For callers building a transfer, so they can leave out the addresses
+ *  that would be skipped instead of having the whole transfer refused.
+ *  Return 1 if calls to the address go out on the bus.
+ */
+int i2c_address_allowed(struct i2c_session *s, uint8_t address)
+{
+	if (!s)
+		return 0;
+
+	return i2c_recovery_allow(s->_recovery, address);
 }
 
-int i2c_open_device()
+/*
+ *  Ask the transport to unstick the bus. Done automatically when a 
+ *  recovery is attached and every call starts failing.
+ *  Return 1 if the transport thinks it worked, 0 if it can't tell and
+ *  less then zero on failure.
+ */
+int i2c_recover_bus(struct i2c_session *s)
 {
-	int fh = -1;
+	int result;
+
+	if (!s || !s->_ops) 
+		return -1;
 
-	fh = open(i2c_bus, O_RDWR);
+	fprintf(stderr, "Recovering bus %s\n", s->_bus);
 
-	if (fh < 0) {
+	if (s->_ops->_recover)
+		result = s->_ops->_recover(s);
+	else
+		result = -1;
+
+	if (result < 0)
+		fprintf(stderr, "Error: Bus %s could not be recovered\n", s->_bus);
+
+	i2c_recovery_done(s->_recovery, result > 0);
+
+	return result;
+}
+
+int i2c_is_simulated(struct i2c_session *s)
+{
+	return s && s->_ops == &i2c_sim_transport;
+}
+
+/*
+ *  The errno of a failed call, EIO for a short one, zero on success.
+ */
+static int call_error(int result, int expected)
+{
+	if (result == expected)
+		return 0;
+
+	if (result < 0 && errno)
+		return errno;
+
+	return EIO;
+}
+
+/*
+ *  Feed the breakers and recover the bus when it looks stuck. The caller
+ *  still gets the errno of its own call.
+ */
+static void note_result(struct i2c_session *s, int address, int error)
+{
+	int saved;
+
+	if (!s->_recovery)
+		return;
+
+	i2c_recovery_record(s->_recovery, address, error);
+
+	if (i2c_recovery_needed(s->_recovery)) {
+		saved = errno;
+		i2c_recover_bus(s);
+		errno = saved;
+	}
+}
+
+static int dev_open(struct i2c_session *s)
+{
+	s->_fh = open(s->_bus, O_RDWR);
+
+	if (s->_fh < 0) {
 		fprintf(stderr, "Error: Could not open file %s: %s\n", 
-				i2c_bus, strerror(errno));
+				s->_bus, strerror(errno));
+		return -1;
 	}
 
-	return fh;
+	if (ioctl(s->_fh, I2C_FUNCS, &s->_funcs) < 0)
+		s->_funcs = 0;
+
+	return 1;
+}
+
+static void dev_close(struct i2c_session *s)
+{
+	if (s->_fh >= 0) {
+		close(s->_fh);
+		s->_fh = -1;
+		s->_slave = -1;
+	}
 }
 
-int i2c_set_slave_address(int fh, uint8_t address)
+/*
+ *  Only calls the I2C_SLAVE ioctl when the address changes.
+ */
+static int dev_set_slave(struct i2c_session *s, uint8_t address)
 {
-	if (fh < 0) 
+	if (s->_fh < 0) 
 		return -1;
 
-	if (ioctl(fh, I2C_SLAVE, address) < 0) {
+	if (s->_slave == address)
+		return 1;
+
+	s->_syscalls++;
+
+	if (ioctl(s->_fh, I2C_SLAVE, address) < 0) {
 		if (errno == EBUSY) 
 			fprintf(stderr, "Device %d is busy!\n", address);
 		else  
 			fprintf(stderr, "Could not set slave address to 0x%02x: %s\n",
 				address, strerror(errno));
 		
+		s->_slave = -1;
 
 		return -1;
 	}
 
+	s->_slave = address;
+
 	return 1;
 }
 
+static int dev_write(struct i2c_session *s, uint8_t address, const uint8_t *data, int len)
+{
+	int result;
+
+	if (dev_set_slave(s, address) < 0)
+		return -1;
+
+	s->_syscalls++;
+	result = write(s->_fh, data, len);
+
+	if (result > 0)
+		s->_bytes += result + 1;
+
+	return result;
+}
+
+static int dev_read(struct i2c_session *s, uint8_t address, uint8_t *data, int len)
+{
+	int result;
+
+	if (dev_set_slave(s, address) < 0)
+		return -1;
+
+	s->_syscalls++;
+	result = read(s->_fh, data, len);
+
+	if (result > 0)
+		s->_bytes += result + 1;
+
+	return result;
+}
+
+/*
+ *  As few I2C_RDWR ioctls as the kernel allows. The I2C_SLAVE setting of 
+ *  the session is left alone.
+ */
+static int dev_transfer(struct i2c_session *s, struct i2c_msg *msgs, int count)
+{
+	struct i2c_rdwr_ioctl_data rdwr;
+	int i, j, n;
+
+	if (s->_fh < 0) 
+		return -1;
+
+	for (i = 0; i < count; i += n) {
+		n = count - i;
+
+		if (n > I2C_RDWR_IOCTL_MAX_MSGS)
+			n = I2C_RDWR_IOCTL_MAX_MSGS;
+
+		rdwr.msgs = &msgs[i];
+		rdwr.nmsgs = n;
+		s->_syscalls++;
+
+		if (ioctl(s->_fh, I2C_RDWR, &rdwr) < 0) 
+			return -1;
+
+		for (j = i; j < i + n; j++) 
+			s->_bytes += msgs[j].len + 1;
+	}
+
+	return count;
+}
+
+/*
+ *  The same check i2cdetect does. A quick write for most addresses, a read 
+ *  byte for the ranges where a quick write can corrupt an eeprom. Adapters 
+ *  that support neither report every address as present.
+ */
+static int dev_probe(struct i2c_session *s, uint8_t address)
+{
+	struct i2c_smbus_ioctl_data args;
+	union i2c_smbus_data data;
+	int use_read;
+
+	if (dev_set_slave(s, address) < 0)
+		return -1;
+
+	use_read = (address >= 0x30 && address <= 0x37) 
+			|| (address >= 0x50 && address <= 0x5F)
+			|| !(s->_funcs & I2C_FUNC_SMBUS_QUICK);
+
+	if (use_read && !(s->_funcs & I2C_FUNC_SMBUS_READ_BYTE)) 
+		return 1;
+
+	if (use_read) {
+		args.read_write = I2C_SMBUS_READ;
+		args.command = 0;
+		args.size = I2C_SMBUS_BYTE;
+		args.data = &data;
+	} else {
+		args.read_write = I2C_SMBUS_WRITE;
+		args.command = 0;
+		args.size = I2C_SMBUS_QUICK;
+		args.data = NULL;
+	}
+
+	s->_syscalls++;
+
+	if (ioctl(s->_fh, I2C_SMBUS, &args) < 0) 
+		return 0;
+
+	s->_bytes += use_read ? 2 : 1;
+
+	return 1;
+}
+
+/*
+ *  Userspace can't start the kernel's own bus recovery, adapters that 
+ *  have it run it themselves when a transfer times out. What can be done
+ *  from here is clock out a stuck slave through gpios, when 
+ *  $BLINKM_RECOVERY_GPIO names them as scl[,sda], and reopen the device so
+ *  the next call starts from a fresh file and slave address.
+ */
+static int dev_recover(struct i2c_session *s)
+{
+	const char *gpios;
+	int scl, sda, result;
+
+	result = 1;
+	gpios = getenv("BLINKM_RECOVERY_GPIO");
+
+	if (gpios && *gpios) {
+		sda = -1;
+
+		if (sscanf(gpios, "%d,%d", &scl, &sda) < 1) {
+			fprintf(stderr, "Invalid BLINKM_RECOVERY_GPIO %s\n", gpios);
+			result = 0;
+		}
+		else {
+			result = i2c_gpio_clock_out(scl, sda);
+
+			if (result == 0)
+				fprintf(stderr, "SDA on gpio %d is still held low\n", sda);
+		}
+	}
+
+	dev_close(s);
+
+	if (dev_open(s) < 0)
+		return -1;
+
+	return result < 0 ? 0 : result;
+}
@@ -29,13 +29,66 @@
 #ifndef I2C_FUNCTIONS_H
 #define I2C_FUNCTIONS_H
 
+#define I2C_BUS_NAME_LEN 64
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-int i2c_get_bus_functions();
-int i2c_start_transaction(uint8_t slave_address);
-int i2c_end_transaction();
+struct i2c_msg;
+struct i2c_session;
+struct blinkm_cache;
+struct i2c_stats;
+struct i2c_recovery;
+
+/*
+ * A bus backend. The /dev/i2c-N driver is the default, a bus name starting
+ * with "sim" selects the simulated BlinkM bus in i2c_sim.c.
+ */
+struct i2c_transport {
+	const char *_name;
+	int (*_open)(struct i2c_session *s);
+	void (*_close)(struct i2c_session *s);
+	int (*_write)(struct i2c_session *s, uint8_t address, const uint8_t *data, int len);
+	int (*_read)(struct i2c_session *s, uint8_t address, uint8_t *data, int len);
+	int (*_transfer)(struct i2c_session *s, struct i2c_msg *msgs, int count);
+	int (*_probe)(struct i2c_session *s, uint8_t address);
+	int (*_recover)(struct i2c_session *s);
+};
+
+struct i2c_session {
+	const struct i2c_transport *_ops;
+	void *_priv;
+	int _fh;
+	int _slave;
+	unsigned long _funcs;
+	char _bus[I2C_BUS_NAME_LEN];
+	/* bytes on the wire including address bytes, and wire time where known */
+	uint64_t _syscalls;
+	uint64_t _bytes;
+	uint64_t _bus_usecs;
+	/* optional shadow state used by the blinkm layer to skip redundant writes */
+	struct blinkm_cache *_cache;
+	/* optional counters, see i2c_stats.h */
+	struct i2c_stats *_stats;
+	/* optional circuit breakers and bus recovery, see i2c_recovery.h */
+	struct i2c_recovery *_recovery;
+};
+
+extern const struct i2c_transport i2c_dev_transport;
+extern const struct i2c_transport i2c_sim_transport;
+
+int i2c_open_session(struct i2c_session *s, const char *bus);
+void i2c_close_session(struct i2c_session *s);
+int i2c_write(struct i2c_session *s, uint8_t address, const uint8_t *data, int len);
+int i2c_read(struct i2c_session *s, uint8_t address, uint8_t *data, int len);
+int i2c_write_read(struct i2c_session *s, uint8_t address, const uint8_t *wdata, int wlen,
+		uint8_t *rdata, int rlen);
+int i2c_transfer(struct i2c_session *s, struct i2c_msg *msgs, int count);
+int i2c_probe(struct i2c_session *s, uint8_t address);
+int i2c_address_allowed(struct i2c_session *s, uint8_t address);
+int i2c_recover_bus(struct i2c_session *s);
+int i2c_is_simulated(struct i2c_session *s);
 
 #ifdef __cplusplus
 }
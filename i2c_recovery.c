@@ -0,0 +1,421 @@
+/*
+	Copyright (c) 2009, Scott Ellis
+	All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+		* Redistributions of source code must retain the above copyright
+		  notice, this list of conditions and the following disclaimer.
+		* Redistributions in binary form must reproduce the above copyright
+		  notice, this list of conditions and the following disclaimer in the
+		  documentation and/or other materials provided with the distribution.
+		* Neither the name of the <organization> nor the
+		  names of its contributors may be used to endorse or promote products
+		  derived from this software without specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY Scott Ellis ''AS IS'' AND ANY
+	EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+	WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+	DISCLAIMED. IN NO EVENT SHALL Scott Ellis BE LIABLE FOR ANY
+	DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+	(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+	LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+	ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+	(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+	SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "utility.h"
+#include "i2c_stats.h"
+#include "i2c_recovery.h"
+
+static void trip(struct i2c_breaker *b);
+static int gpio_write(const char *attr, int gpio, const char *value);
+static int gpio_read(int gpio);
+static void half_clock(void);
+
+static const char *state_names[] = { "closed", "open", "half-open" };
+
+
+void i2c_recovery_init(struct i2c_recovery *r)
+{
+	if (r) {
+		memset(r, 0, sizeof(struct i2c_recovery));
+		r->_failed_address = -1;
+	}
+}
+
+/*
+ *  Return 1 if a call to the address should go out on the bus, 0 if it
+ *  should be skipped. Once the backoff has run out one trial call is let
+ *  through, its result decides whether the breaker closes again.
+ *  The general call address is never skipped.
+ */
+int i2c_recovery_allow(struct i2c_recovery *r, int address)
+{
+	struct i2c_breaker *b;
+
+	if (!r || address < 1 || address > 127)
+		return 1;
+
+	b = &r->_addr[address];
+
+	if (b->_state != I2C_BREAKER_OPEN)
+		return 1;
+
+	if (monotonic_usecs() >= b->_retry_usecs) {
+		b->_state = I2C_BREAKER_HALF_OPEN;
+		return 1;
+	}
+
+	b->_skipped++;
+
+	return 0;
+}
+
+/*
+ *  The result of a call to one address, error is zero or the errno.
+ */
+void i2c_recovery_record(struct i2c_recovery *r, int address, int error)
+{
+	struct i2c_breaker *b;
+	int valid;
+
+	if (!r)
+		return;
+
+	valid = (address > 0 && address < 128);
+
+	if (!error) {
+		r->_failures = 0;
+		r->_timeouts = 0;
+		r->_failed_address = -1;
+		r->_many_addresses = 0;
+
+		if (valid) {
+			b = &r->_addr[address];
+			b->_state = I2C_BREAKER_CLOSED;
+			b->_failures = 0;
+			b->_backoff_usecs = 0;
+		}
+
+		return;
+	}
+
+	r->_failures++;
+
+	if (error == ETIMEDOUT)
+		r->_timeouts++;
+	else
+		r->_timeouts = 0;
+
+	if (r->_failed_address < 0)
+		r->_failed_address = address;
+	else if (r->_failed_address != address)
+		r->_many_addresses = 1;
+
+	if (!valid)
+		return;
+
+	b = &r->_addr[address];
+	b->_failures++;
+
+	if (b->_state == I2C_BREAKER_HALF_OPEN || b->_failures >= I2C_BREAKER_THRESHOLD)
+		trip(b);
+}
+
+/*
+ *  One dead led fails on its own while the others keep answering, that is
+ *  left to its breaker. When every address fails, or the adapter times 
+ *  out, it is the bus. At most one recovery per interval.
+ */
+int i2c_recovery_needed(struct i2c_recovery *r)
+{
+	if (!r)
+		return 0;
+
+	if (r->_timeouts < I2C_RECOVER_AFTER_TIMEOUTS 
+			&& (r->_failures < I2C_RECOVER_AFTER_FAILURES || !r->_many_addresses))
+		return 0;
+
+	if (r->_recoveries > 0 
+			&& monotonic_usecs() - r->_last_usecs < I2C_RECOVER_INTERVAL_USECS)
+		return 0;
+
+	return 1;
+}
+
+/*
+ *  Called after a recovery attempt. The breakers are left alone, the 
+ *  addresses that tripped while the bus was stuck get their trial call
+ *  when their backoff runs out.
+ */
+void i2c_recovery_done(struct i2c_recovery *r, int ok)
+{
+	if (!r)
+		return;
+
+	r->_last_usecs = monotonic_usecs();
+	r->_recoveries++;
+
+	if (!ok)
+		r->_recover_errors++;
+
+	r->_failures = 0;
+	r->_timeouts = 0;
+	r->_failed_address = -1;
+	r->_many_addresses = 0;
+}
+
+static void trip(struct i2c_breaker *b)
+{
+	if (b->_backoff_usecs == 0)
+		b->_backoff_usecs = I2C_BREAKER_MIN_USECS;
+	else if (b->_backoff_usecs < I2C_BREAKER_MAX_USECS / 2)
+		b->_backoff_usecs *= 2;
+	else
+		b->_backoff_usecs = I2C_BREAKER_MAX_USECS;
+
+	b->_state = I2C_BREAKER_OPEN;
+	b->_retry_usecs = monotonic_usecs() + b->_backoff_usecs;
+	b->_trips++;
+}
+
+/*
+ *  The standard way to free a slave holding SDA low in the middle of a 
+ *  byte, clock SCL until it lets go, at most nine times, then send a STOP.
+ *  Uses the sysfs gpio interface, so the SCL and SDA pins have to be
+ *  usable as gpios while the adapter is idle. On the Overo that depends on
+ *  the pin mux. An sda of -1 clocks all nine times, skips the STOP and 
+ *  hopes for the best.
+ *  Return 1 if SDA was released, 0 if it is still low, -1 if SCL couldn't 
+ *  be driven.
+ */
+int i2c_gpio_clock_out(int scl, int sda)
+{
+	int i, released;
+
+	if (scl < 0)
+		return -1;
+
+	/* EBUSY here just means it is already exported */
+	gpio_write("export", scl, NULL);
+
+	if (gpio_write("direction", scl, "high") < 0) {
+		fprintf(stderr, "Error: Could not drive SCL on gpio %d\n", scl);
+		gpio_write("unexport", scl, NULL);
+		return -1;
+	}
+
+	if (sda >= 0) {
+		gpio_write("export", sda, NULL);
+		gpio_write("direction", sda, "in");
+	}
+
+	released = (sda < 0);
+
+	for (i = 0; i < 9; i++) {
+		if (sda >= 0 && gpio_read(sda) == 1) {
+			released = 1;
+			break;
+		}
+
+		gpio_write("value", scl, "0");
+		half_clock();
+		gpio_write("value", scl, "1");
+		half_clock();
+	}
+
+	if (sda >= 0) {
+		if (!released)
+			released = (gpio_read(sda) == 1);
+
+		/* STOP, SDA going high while SCL is high */
+		gpio_write("value", scl, "0");
+		half_clock();
+		gpio_write("direction", sda, "low");
+		half_clock();
+		gpio_write("value", scl, "1");
+		half_clock();
+		gpio_write("direction", sda, "in");
+		half_clock();
+		gpio_write("unexport", sda, NULL);
+	}
+
+	gpio_write("direction", scl, "in");
+	gpio_write("unexport", scl, NULL);
+
+	return released;
+}
+
+/*
+ *  Write to /sys/class/gpio/export or unexport when value is NULL, 
+ *  otherwise to /sys/class/gpio/gpio<n>/<attr>.
+ */
+static int gpio_write(const char *attr, int gpio, const char *value)
+{
+	char path[64], buff[16];
+	int fd, len, result;
+
+	if (value) {
+		snprintf(path, sizeof(path), "/sys/class/gpio/gpio%d/%s", gpio, attr);
+	}
+	else {
+		snprintf(path, sizeof(path), "/sys/class/gpio/%s", attr);
+		snprintf(buff, sizeof(buff), "%d", gpio);
+		value = buff;
+	}
+
+	fd = open(path, O_WRONLY);
+
+	if (fd < 0)
+		return -1;
+
+	len = strlen(value);
+	result = write(fd, value, len);
+	close(fd);
+
+	return result == len ? 1 : -1;
+}
+
+static int gpio_read(int gpio)
+{
+	char path[64], c;
+	int fd, result;
+
+	snprintf(path, sizeof(path), "/sys/class/gpio/gpio%d/value", gpio);
+
+	fd = open(path, O_RDONLY);
+
+	if (fd < 0)
+		return -1;
+
+	result = read(fd, &c, 1);
+	close(fd);
+
+	if (result != 1)
+		return -1;
+
+	return c == '1' ? 1 : 0;
+}
+
+/* 
+ * 5 usecs is standard mode, the sysfs writes are slower than that anyway
+ */
+static void half_clock(void)
+{
+	struct timespec ts;
+
+	ts.tv_sec = 0;
+	ts.tv_nsec = 5000;
+	nanosleep(&ts, NULL);
+}
+
+void i2c_recovery_print(FILE *fp, struct i2c_recovery *r, const char *bus_name)
+{
+	struct i2c_breaker *b;
+	uint64_t now, retry;
+	int i, header;
+
+	if (!r)
+		return;
+
+	fprintf(fp, "Bus %s, %llu recoveries (%llu failed)\n", bus_name,
+		(unsigned long long) r->_recoveries,
+		(unsigned long long) r->_recover_errors);
+
+	now = monotonic_usecs();
+	header = 0;
+
+	for (i = 1; i < 128; i++) {
+		b = &r->_addr[i];
+
+		if (b->_trips == 0)
+			continue;
+
+		if (!header) {
+			fprintf(fp, "\n%-9s %-9s %8s %7s %9s %9s\n", 
+				"address", "breaker", "failures", "trips", "skipped", "retry ms");
+			header = 1;
+		}
+
+		retry = 0;
+
+		if (b->_state == I2C_BREAKER_OPEN && b->_retry_usecs > now)
+			retry = (b->_retry_usecs - now) / 1000;
+
+		fprintf(fp, "0x%02X      %-9s %8d %7llu %9llu %9llu\n", i, 
+			state_names[b->_state], b->_failures, 
+			(unsigned long long) b->_trips,
+			(unsigned long long) b->_skipped,
+			(unsigned long long) retry);
+	}
+
+	fprintf(fp, "\n");
+}
+
+/*
+ * Same layout as i2c_stats_print_metrics(), one header per family.
+ */
+void i2c_recovery_print_metrics(FILE *fp, struct i2c_recovery **r, const char **bus_names, int num_buses)
+{
+	int b, i;
+
+	i2c_metrics_header(fp, "blinkm_i2c_recoveries_total", "counter", "Bus recoveries attempted.");
+
+	for (b = 0; b < num_buses; b++) {
+		if (r[b])
+			fprintf(fp, "blinkm_i2c_recoveries_total{bus=\"%s\"} %llu\n",
+				bus_names[b], (unsigned long long) r[b]->_recoveries);
+	}
+
+	i2c_metrics_header(fp, "blinkm_i2c_recovery_errors_total", "counter", 
+		"Bus recoveries that failed.");
+
+	for (b = 0; b < num_buses; b++) {
+		if (r[b])
+			fprintf(fp, "blinkm_i2c_recovery_errors_total{bus=\"%s\"} %llu\n",
+				bus_names[b], (unsigned long long) r[b]->_recover_errors);
+	}
+
+	i2c_metrics_header(fp, "blinkm_i2c_breaker_open", "gauge", "Addresses currently skipped.");
+
+	for (b = 0; b < num_buses; b++) {
+		for (i = 1; r[b] && i < 128; i++) {
+			if (r[b]->_addr[i]._trips)
+				fprintf(fp, "blinkm_i2c_breaker_open{bus=\"%s\",address=\"0x%02x\"} %d\n",
+					bus_names[b], i, r[b]->_addr[i]._state == I2C_BREAKER_OPEN);
+		}
+	}
+
+	i2c_metrics_header(fp, "blinkm_i2c_breaker_trips_total", "counter", 
+		"Times an address was tripped.");
+
+	for (b = 0; b < num_buses; b++) {
+		for (i = 1; r[b] && i < 128; i++) {
+			if (r[b]->_addr[i]._trips)
+				fprintf(fp, "blinkm_i2c_breaker_trips_total{bus=\"%s\",address=\"0x%02x\"} %llu\n",
+					bus_names[b], i, (unsigned long long) r[b]->_addr[i]._trips);
+		}
+	}
+
+	i2c_metrics_header(fp, "blinkm_i2c_breaker_skipped_total", "counter", 
+		"Calls skipped by an open breaker.");
+
+	for (b = 0; b < num_buses; b++) {
+		for (i = 1; r[b] && i < 128; i++) {
+			if (r[b]->_addr[i]._trips)
+				fprintf(fp, "blinkm_i2c_breaker_skipped_total{bus=\"%s\",address=\"0x%02x\"} %llu\n",
+					bus_names[b], i, (unsigned long long) r[b]->_addr[i]._skipped);
+		}
+	}
+}
@@ -0,0 +1,91 @@
+/*
+	Copyright (c) 2009, Scott Ellis
+	All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+		* Redistributions of source code must retain the above copyright
+		  notice, this list of conditions and the following disclaimer.
+		* Redistributions in binary form must reproduce the above copyright
+		  notice, this list of conditions and the following disclaimer in the
+		  documentation and/or other materials provided with the distribution.
+		* Neither the name of the <organization> nor the
+		  names of its contributors may be used to endorse or promote products
+		  derived from this software without specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY Scott Ellis ''AS IS'' AND ANY
+	EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+	WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+	DISCLAIMED. IN NO EVENT SHALL Scott Ellis BE LIABLE FOR ANY
+	DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+	(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+	LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+	ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+	(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+	SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+
+#ifndef I2C_RECOVERY_H
+#define I2C_RECOVERY_H
+
+/* consecutive failures before an address is skipped */
+#define I2C_BREAKER_THRESHOLD 3
+
+/* how long a tripped address is skipped, doubling on each failed retry */
+#define I2C_BREAKER_MIN_USECS 100000
+#define I2C_BREAKER_MAX_USECS 30000000
+
+/* failed calls in a row, across more than one address, before the bus is recovered */
+#define I2C_RECOVER_AFTER_FAILURES 6
+#define I2C_RECOVER_AFTER_TIMEOUTS 2
+#define I2C_RECOVER_INTERVAL_USECS 1000000
+
+#define I2C_BREAKER_CLOSED 0
+#define I2C_BREAKER_OPEN 1
+#define I2C_BREAKER_HALF_OPEN 2
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct i2c_breaker {
+	int _state;
+	int _failures;
+	uint64_t _backoff_usecs;
+	uint64_t _retry_usecs;
+	uint64_t _trips;
+	uint64_t _skipped;
+};
+
+/*
+ * Attached to a session the transport skips addresses whose breaker is 
+ * open and recovers the bus when everything starts failing. Calls that 
+ * are skipped fail with EHOSTDOWN without touching the bus.
+ */
+struct i2c_recovery {
+	struct i2c_breaker _addr[128];
+	int _failures;
+	int _timeouts;
+	int _failed_address;
+	int _many_addresses;
+	uint64_t _last_usecs;
+	uint64_t _recoveries;
+	uint64_t _recover_errors;
+};
+
+void i2c_recovery_init(struct i2c_recovery *r);
+int i2c_recovery_allow(struct i2c_recovery *r, int address);
+void i2c_recovery_record(struct i2c_recovery *r, int address, int error);
+int i2c_recovery_needed(struct i2c_recovery *r);
+void i2c_recovery_done(struct i2c_recovery *r, int ok);
+int i2c_gpio_clock_out(int scl, int sda);
+void i2c_recovery_print(FILE *fp, struct i2c_recovery *r, const char *bus_name);
+void i2c_recovery_print_metrics(FILE *fp, struct i2c_recovery **r, const char **bus_names, int num_buses);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,187 @@
+/*
+	Copyright (c) 2009, Scott Ellis
+	All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+		* Redistributions of source code must retain the above copyright
+		  notice, this list of conditions and the following disclaimer.
+		* Redistributions in binary form must reproduce the above copyright
+		  notice, this list of conditions and the following disclaimer in the
+		  documentation and/or other materials provided with the distribution.
+		* Neither the name of the <organization> nor the
+		  names of its contributors may be used to endorse or promote products
+		  derived from this software without specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY Scott Ellis ''AS IS'' AND ANY
+	EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+	WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+	DISCLAIMED. IN NO EVENT SHALL Scott Ellis BE LIABLE FOR ANY
+	DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+	(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+	LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+	ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+	(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+	SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "utility.h"
+#include "i2c_scan.h"
+#include "i2c_blinkm.h"
+#include "i2c_functions.h"
+#include "blinkm_cache.h"
+#include "blinkm_inventory.h"
+
+
+static void *scan_thread(void *arg);
+
+
+/*
+ * Scan addresses 1-127 on an already open bus. Only addresses that ACK the
+ * presence probe get the GET_FIRMWARE_VERSION query, so empty addresses
+ * cost one short transaction instead of a failed write/read pair.
+ * Return the number of devices found.
+ */
+int blinkm_scan_bus(struct i2c_session *bus, struct blinkm_scan *scan)
+{
+	uint64_t start;
+	int firmware;
+	uint8_t led;
+
+	if (!bus || !scan) 
+		return -1;
+
+	scan->_acked = 0;
+	scan->_count = 0;
+	scan->_error = 0;
+
+	start = monotonic_usecs();
+
+	for (led = 1; led < 128; led++) {
+		if (i2c_probe(bus, led) < 1)
+			continue;
+
+		scan->_acked++;
+
+		firmware = blinkm_get_firmware_version(bus, led, 0);
+
+		if (firmware < 1)
+			continue;
+
+		scan->_addr[scan->_count] = led;
+		scan->_firmware[scan->_count] = firmware;
+		scan->_count++;
+	}
+
+	scan->_msecs = (monotonic_usecs() - start) / 1000.0;
+
+	return scan->_count;
+}
+
+/*
+ * Scan several buses at once, one thread per bus. Each scan's _bus must
+ * be filled in by the caller, a bus that can't be opened has _error set.
+ * Return the total number of devices found.
+ */
+int blinkm_scan_buses(struct blinkm_scan *scans, int count)
+{
+	pthread_t tid[MAX_SCAN_BUSES];
+	int i, started[MAX_SCAN_BUSES];
+	int total;
+
+	if (!scans || count < 1) 
+		return 0;
+
+	if (count > MAX_SCAN_BUSES)
+		count = MAX_SCAN_BUSES;
+
+	for (i = 0; i < count; i++) 
+		started[i] = !pthread_create(&tid[i], NULL, scan_thread, &scans[i]);
+	
+	total = 0;
+
+	for (i = 0; i < count; i++) {
+		if (started[i]) 
+			pthread_join(tid[i], NULL);
+		else
+			scan_thread(&scans[i]);
+
+		if (!scans[i]._error)
+			total += scans[i]._count;
+	}
+
+	return total;
+}
+
+/*
+ * The devices from the cache's last scan, then the inventory if it 
+ * still checks out, and only then a new scan which updates the 
+ * inventory. Whatever is found is kept in the cache if there is one.
+ * leds needs room for 127 addresses.
+ * Return the number of devices or -1 if the bus couldn't be scanned.
+ */
+int blinkm_find_leds(struct i2c_session *bus, uint8_t *leds)
+{
+	struct blinkm_cache *c = bus->_cache;
+	struct blinkm_scan scan;
+	int i, n;
+
+	if (c && c->_scanned) {
+		for (i = 1, n = 0; i < 128; i++) {
+			if (c->_present[i])
+				leds[n++] = i;
+		}
+
+		return n;
+	}
+
+	n = blinkm_inventory_leds(bus, leds);
+
+	if (n < 0) {
+		memset(&scan, 0, sizeof(scan));
+		strcpy(scan._bus, bus->_bus);
+
+		if (blinkm_scan_bus(bus, &scan) < 0)
+			return -1;
+
+		blinkm_inventory_update(&scan, 1, 0);
+
+		n = scan._count;
+		memcpy(leds, scan._addr, n);
+	}
+
+	if (c) {
+		memset(c->_present, 0, sizeof(c->_present));
+
+		for (i = 0; i < n; i++)
+			c->_present[leds[i]] = 1;
+
+		c->_scanned = 1;
+	}
+
+	return n;
+}
+
+static void *scan_thread(void *arg)
+{
+	struct blinkm_scan *scan = (struct blinkm_scan *) arg;
+	struct i2c_session bus;
+
+	if (i2c_open_session(&bus, scan->_bus) < 0) {
+		scan->_error = 1;
+		scan->_count = 0;
+		return NULL;
+	}
+
+	blinkm_scan_bus(&bus, scan);
+
+	i2c_close_session(&bus);
+
+	return NULL;
+}
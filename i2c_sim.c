@@ -0,0 +1,588 @@
+/*
+	Copyright (c) 2009, Scott Ellis
+	All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+		* Redistributions of source code must retain the above copyright
+		  notice, this list of conditions and the following disclaimer.
+		* Redistributions in binary form must reproduce the above copyright
+		  notice, this list of conditions and the following disclaimer in the
+		  documentation and/or other materials provided with the distribution.
+		* Neither the name of the <organization> nor the
+		  names of its contributors may be used to endorse or promote products
+		  derived from this software without specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY Scott Ellis ''AS IS'' AND ANY
+	EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+	WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+	DISCLAIMED. IN NO EVENT SHALL Scott Ellis BE LIABLE FOR ANY
+	DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+	(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+	LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+	ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+	(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+	SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/*
+ *  A simulated i2c bus with BlinkM devices on it, selected with a bus name
+ *  of the form 
+ *
+ *    sim[:leds=<first>-<last>][:khz=<bus speed>][:nak=<percent>]
+ *       [:latency=<usecs>][:seed=<n>][:realtime=1][:nogc=<first>-<last>]
+ *       [:hang=<n>]
+ *
+ *  The devices answer the same commands a real BlinkM does, but fades
+ *  complete immediately and scripts are stored, not played. Wire time is
+ *  accounted for per message from the bus speed, plus a fixed latency per
+ *  transfer standing in for the syscall and adapter overhead. With realtime
+ *  set the simulator also sleeps for that time. The nogc leds ignore
+ *  general call writes. With hang set the bus locks up after that many 
+ *  messages, like a slave holding SDA low, and every message times out 
+ *  until the bus is recovered.
+ *
+ *  The state lives in the session, so each process sees a fresh bus.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <linux/i2c.h> 
+#include <linux/i2c-dev.h> 
+
+#include "i2c_functions.h"
+#include "i2c_blinkm.h"
+#include "blinkm_color.h"
+#include "blinkm_regs.h"
+
+#define SIM_DEFAULT_KHZ 100
+
+struct sim_blinkm {
+	int _present;
+	int _ignores_general_call;
+	uint8_t _rgb[3];
+	uint8_t _fade_speed;
+	uint8_t _time_adjust;
+	uint8_t _playing;
+	uint8_t _script_length;
+	uint8_t _script_repeats;
+	struct script_line _script[MAX_SCRIPT_LINES];
+	int _reply_len;
+	uint8_t _reply[8];
+};
+
+struct sim_bus {
+	int _khz;
+	int _nak_percent;
+	int _latency_usecs;
+	int _realtime;
+	int _hang_after;
+	int _hung;
+	unsigned int _seed;
+	struct sim_blinkm _dev[128];
+};
+
+static int sim_open(struct i2c_session *s);
+static void sim_close(struct i2c_session *s);
+static int sim_write(struct i2c_session *s, uint8_t address, const uint8_t *data, int len);
+static int sim_read(struct i2c_session *s, uint8_t address, uint8_t *data, int len);
+static int sim_transfer(struct i2c_session *s, struct i2c_msg *msgs, int count);
+static int sim_probe(struct i2c_session *s, uint8_t address);
+static int sim_recover(struct i2c_session *s);
+
+const struct i2c_transport i2c_sim_transport = {
+	"sim",
+	sim_open,
+	sim_close,
+	sim_write,
+	sim_read,
+	sim_transfer,
+	sim_probe,
+	sim_recover
+};
+
+static int sim_parse_spec(struct sim_bus *sim, const char *spec);
+static void sim_add_blinkm(struct sim_bus *sim, int addr);
+static int sim_message(struct i2c_session *s, struct i2c_msg *msg);
+static void sim_command(struct sim_bus *sim, struct sim_blinkm *dev, 
+			const uint8_t *data, int len);
+static uint8_t sim_random(struct sim_bus *sim, uint8_t value, uint8_t range);
+static void sim_wire_time(struct i2c_session *s, int bytes, int messages);
+static void sim_set_slave(struct i2c_session *s, uint8_t address);
+
+
+static int sim_open(struct i2c_session *s)
+{
+	struct sim_bus *sim;
+
+	sim = calloc(1, sizeof(struct sim_bus));
+
+	if (!sim) {
+		fprintf(stderr, "Error: Out of memory for %s\n", s->_bus);
+		return -1;
+	}
+
+	sim->_khz = SIM_DEFAULT_KHZ;
+	sim->_seed = 1;
+
+	if (sim_parse_spec(sim, s->_bus) < 0) {
+		free(sim);
+		return -1;
+	}
+
+	s->_priv = sim;
+	s->_funcs = I2C_FUNC_I2C | I2C_FUNC_SMBUS_QUICK | I2C_FUNC_SMBUS_READ_BYTE;
+
+	return 1;
+}
+
+static void sim_close(struct i2c_session *s)
+{
+	if (s->_priv) {
+		free(s->_priv);
+		s->_priv = NULL;
+	}
+}
+
+/*
+ *  The syscalls are counted the way the dev transport makes them, an 
+ *  I2C_SLAVE ioctl when the address changes and one call per operation.
+ */
+static void sim_set_slave(struct i2c_session *s, uint8_t address)
+{
+	if (s->_slave != address) {
+		s->_slave = address;
+		s->_syscalls++;
+	}
+}
+
+static int sim_write(struct i2c_session *s, uint8_t address, const uint8_t *data, int len)
+{
+	struct i2c_msg msg;
+
+	msg.addr = address;
+	msg.flags = 0;
+	msg.len = len;
+	msg.buf = (uint8_t *) data;
+
+	sim_set_slave(s, address);
+
+	s->_syscalls++;
+
+	if (sim_message(s, &msg) < 0)
+		return -1;
+
+	sim_wire_time(s, len, 1);
+
+	return len;
+}
+
+static int sim_read(struct i2c_session *s, uint8_t address, uint8_t *data, int len)
+{
+	struct i2c_msg msg;
+
+	msg.addr = address;
+	msg.flags = I2C_M_RD;
+	msg.len = len;
+	msg.buf = data;
+
+	sim_set_slave(s, address);
+
+	s->_syscalls++;
+
+	if (sim_message(s, &msg) < 0)
+		return -1;
+
+	sim_wire_time(s, len, 1);
+
+	return len;
+}
+
+/*
+ *  Like the kernel, a NAK stops the transfer at the failing message. The 
+ *  messages before it have already reached their devices.
+ */
+static int sim_transfer(struct i2c_session *s, struct i2c_msg *msgs, int count)
+{
+	int i, bytes, result;
+
+	bytes = 0;
+	result = count;
+
+	/* one I2C_RDWR ioctl per I2C_RDWR_IOCTL_MAX_MSGS messages */
+	s->_syscalls += (count + I2C_RDWR_IOCTL_MAX_MSGS - 1) / I2C_RDWR_IOCTL_MAX_MSGS;
+
+	for (i = 0; i < count; i++) {
+		bytes += msgs[i].len;
+
+		if (sim_message(s, &msgs[i]) < 0) {
+			count = i + 1;
+			result = -1;
+			break;
+		}
+	}
+
+	sim_wire_time(s, bytes, count);
+
+	return result;
+}
+
+static int sim_probe(struct i2c_session *s, uint8_t address)
+{
+	struct sim_bus *sim = (struct sim_bus *) s->_priv;
+
+	sim_set_slave(s, address);
+	s->_syscalls++;
+	sim_wire_time(s, 0, 1);
+
+	if (sim->_hung) {
+		errno = ETIMEDOUT;
+		return -1;
+	}
+
+	if (address > 127 || !sim->_dev[address]._present)
+		return 0;
+
+	return 1;
+}
+
+/*
+ *  Nine clocks and a STOP, which always frees the simulated slave.
+ */
+static int sim_recover(struct i2c_session *s)
+{
+	struct sim_bus *sim = (struct sim_bus *) s->_priv;
+
+	sim->_hung = 0;
+	s->_slave = -1;
+	sim_wire_time(s, 1, 1);
+
+	return 1;
+}
+
+/*
+ *  Deliver one message. Address 0 is the general call, every BlinkM on
+ *  the bus takes the write.
+ */
+static int sim_message(struct i2c_session *s, struct i2c_msg *msg)
+{
+	struct sim_bus *sim = (struct sim_bus *) s->_priv;
+	struct sim_blinkm *dev;
+	int i, acked;
+
+	if (msg->addr > 127) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (sim->_hang_after > 0 && --sim->_hang_after == 0)
+		sim->_hung = 1;
+
+	if (sim->_hung) {
+		errno = ETIMEDOUT;
+		return -1;
+	}
+
+	if (sim->_nak_percent > 0 && (int) (rand_r(&sim->_seed) % 100) < sim->_nak_percent) {
+		errno = EREMOTEIO;
+		return -1;
+	}
+
+	if (msg->addr == 0) {
+		if (msg->flags & I2C_M_RD) {
+			errno = EREMOTEIO;
+			return -1;
+		}
+
+		acked = 0;
+
+		for (i = 1; i < 128; i++) {
+			if (sim->_dev[i]._present && !sim->_dev[i]._ignores_general_call) {
+				sim_command(sim, &sim->_dev[i], msg->buf, msg->len);
+				acked = 1;
+			}
+		}
+
+		/* address changes are applied after everyone has seen the command */
+		if (acked && msg->len == 5 && msg->buf[0] == SET_BLINKM_ADDRESS 
+				&& msg->buf[2] == 0xd0 && msg->buf[3] == 0x0d 
+				&& msg->buf[1] == msg->buf[4] && msg->buf[1] > 0 && msg->buf[1] < 128) {
+			for (i = 1; i < 128; i++) {
+				if (sim->_dev[i]._present && i != msg->buf[1]) {
+					sim->_dev[msg->buf[1]] = sim->_dev[i];
+					memset(&sim->_dev[i], 0, sizeof(struct sim_blinkm));
+				}
+			}
+		}
+
+		if (!acked) {
+			errno = EREMOTEIO;
+			return -1;
+		}
+
+		return 1;
+	}
+
+	dev = &sim->_dev[msg->addr];
+
+	if (!dev->_present) {
+		errno = EREMOTEIO;
+		return -1;
+	}
+
+	if (msg->flags & I2C_M_RD) {
+		for (i = 0; i < msg->len; i++) 
+			msg->buf[i] = i < dev->_reply_len ? dev->_reply[i] : 0xff;
+	}
+	else {
+		sim_command(sim, dev, msg->buf, msg->len);
+	}
+
+	return 1;
+}
+
+static void sim_command(struct sim_bus *sim, struct sim_blinkm *dev, 
+			const uint8_t *data, int len)
+{
+	int i;
+
+	if (len < 1)
+		return;
+
+	switch (data[0]) {
+	case SET_RGB_COLOR_NOW:
+	case FADE_TO_RGB_COLOR:
+		if (len >= 4)
+			memcpy(dev->_rgb, &data[1], 3);
+
+		break;
+
+	case FADE_TO_HSB_COLOR:
+		if (len >= 4)
+			blinkm_hsb_to_rgb(data[1], data[2], data[3], dev->_rgb);
+
+		break;
+
+	case FADE_TO_RANDOM_RGB_COLOR:
+		if (len >= 4) {
+			for (i = 0; i < 3; i++)
+				dev->_rgb[i] = sim_random(sim, dev->_rgb[i], data[i + 1]);
+		}
+
+		break;
+
+	case FADE_TO_RANDOM_HSB_COLOR:
+		if (len >= 4) 
+			blinkm_hsb_to_rgb(sim_random(sim, 0, data[1]), data[2], data[3], dev->_rgb);
+
+		break;
+
+	case PLAY_LIGHT_SCRIPT:
+		dev->_playing = 1;
+		break;
+
+	case STOP_SCRIPT:
+		dev->_playing = 0;
+		break;
+
+	case SET_FADE_SPEED:
+		if (len >= 2)
+			dev->_fade_speed = data[1];
+
+		break;
+
+	case SET_TIME_ADJUST:
+		if (len >= 2)
+			dev->_time_adjust = data[1];
+
+		break;
+
+	case GET_CURRENT_RGB_COLOR:
+		memcpy(dev->_reply, dev->_rgb, 3);
+		dev->_reply_len = 3;
+		break;
+
+	case WRITE_SCRIPT_LINE:
+		if (len >= 8 && data[1] == 0 && data[2] < MAX_SCRIPT_LINES) {
+			dev->_script[data[2]]._ticks = data[3];
+			dev->_script[data[2]]._cmd = data[4];
+			memcpy(dev->_script[data[2]]._arg, &data[5], 3);
+		}
+
+		break;
+
+	case READ_SCRIPT_LINE:
+		memset(dev->_reply, 0, 5);
+
+		if (len >= 3 && data[1] == 0 && data[2] < MAX_SCRIPT_LINES) {
+			dev->_reply[0] = dev->_script[data[2]]._ticks;
+			dev->_reply[1] = dev->_script[data[2]]._cmd;
+			memcpy(&dev->_reply[2], dev->_script[data[2]]._arg, 3);
+		}
+
+		dev->_reply_len = 5;
+		break;
+
+	case SET_SCRIPT_LENGTH_AND_REPEATS:
+		if (len >= 3) {
+			dev->_script_length = data[1];
+			dev->_script_repeats = data[2];
+		}
+
+		break;
+
+	case GET_BLINKM_ADDRESS:
+		dev->_reply[0] = dev - sim->_dev;
+		dev->_reply_len = 1;
+		break;
+
+	case GET_FIRMWARE_VERSION:
+		dev->_reply[0] = 'a';
+		dev->_reply[1] = 'a';
+		dev->_reply_len = 2;
+		break;
+	}
+}
+
+/*
+ *  Everything after the "sim" prefix is a list of ':' separated options.
+ */
+static int sim_parse_spec(struct sim_bus *sim, const char *spec)
+{
+	char buff[I2C_BUS_NAME_LEN];
+	char *p, *save;
+	int first, last, nogc_first, nogc_last, i;
+
+	snprintf(buff, sizeof(buff), "%s", spec);
+
+	first = DEFAULT_BLINKM_I2C_ADDRESS;
+	last = DEFAULT_BLINKM_I2C_ADDRESS;
+	nogc_first = 0;
+	nogc_last = -1;
+
+	p = strtok_r(buff, ":", &save);
+
+	if (!p || strcmp(p, "sim")) {
+		fprintf(stderr, "Invalid simulated bus %s\n", spec);
+		return -1;
+	}
+
+	while ((p = strtok_r(NULL, ":", &save))) {
+		if (!strncmp(p, "leds=", 5)) {
+			if (sscanf(p + 5, "%d-%d", &first, &last) == 1)
+				last = first;
+		}
+		else if (!strncmp(p, "nogc=", 5)) {
+			if (sscanf(p + 5, "%d-%d", &nogc_first, &nogc_last) == 1)
+				nogc_last = nogc_first;
+		}
+		else if (!strncmp(p, "khz=", 4)) {
+			sim->_khz = atoi(p + 4);
+		}
+		else if (!strncmp(p, "nak=", 4)) {
+			sim->_nak_percent = atoi(p + 4);
+		}
+		else if (!strncmp(p, "latency=", 8)) {
+			sim->_latency_usecs = atoi(p + 8);
+		}
+		else if (!strncmp(p, "seed=", 5)) {
+			sim->_seed = strtoul(p + 5, NULL, 0);
+		}
+		else if (!strncmp(p, "realtime=", 9)) {
+			sim->_realtime = atoi(p + 9);
+		}
+		else if (!strncmp(p, "hang=", 5)) {
+			sim->_hang_after = atoi(p + 5);
+		}
+		else {
+			fprintf(stderr, "Unknown simulated bus option %s\n", p);
+			return -1;
+		}
+	}
+
+	if (first < 1 || last > 127 || first > last) {
+		fprintf(stderr, "Simulated leds must be in the range 1-127\n");
+		return -1;
+	}
+
+	if (sim->_khz < 1 || sim->_nak_percent < 0 || sim->_latency_usecs < 0
+			|| sim->_hang_after < 0) {
+		fprintf(stderr, "Invalid simulated bus %s\n", spec);
+		return -1;
+	}
+
+	for (i = first; i <= last; i++)
+		sim_add_blinkm(sim, i);
+
+	for (i = nogc_first; i <= nogc_last && i < 128; i++) {
+		if (i > 0)
+			sim->_dev[i]._ignores_general_call = 1;
+	}
+
+	return 1;
+}
+
+/*
+ *  A BlinkM as it comes from the factory, showing white. 
+ */
+static void sim_add_blinkm(struct sim_bus *sim, int addr)
+{
+	struct sim_blinkm *dev = &sim->_dev[addr];
+
+	memset(dev, 0, sizeof(struct sim_blinkm));
+
+	dev->_present = 1;
+	dev->_rgb[0] = 0xff;
+	dev->_rgb[1] = 0xff;
+	dev->_rgb[2] = 0xff;
+	dev->_fade_speed = 8;
+}
+
+/*
+ *  Each message costs a start or repeated start, the address byte and the
+ *  data bytes at 9 clocks a byte, plus one stop per transfer. 
+ */
+static void sim_wire_time(struct i2c_session *s, int bytes, int messages)
+{
+	struct sim_bus *sim = (struct sim_bus *) s->_priv;
+	struct timespec ts;
+	uint64_t bits, usecs;
+
+	bits = (messages * 10) + (bytes * 9) + 1;
+	usecs = ((bits * 1000) / sim->_khz) + sim->_latency_usecs;
+
+	s->_bytes += bytes + messages;
+	s->_bus_usecs += usecs;
+
+	if (sim->_realtime) {
+		ts.tv_sec = usecs / 1000000;
+		ts.tv_nsec = (usecs % 1000000) * 1000;
+		nanosleep(&ts, NULL);
+	}
+}
+
+/*
+ *  A random value within range of the current one, like the random fades.
+ */
+static uint8_t sim_random(struct sim_bus *sim, uint8_t value, uint8_t range)
+{
+	int v;
+
+	if (range == 0)
+		return value;
+
+	v = value + (int) (rand_r(&sim->_seed) % (2 * range + 1)) - range;
+
+	if (v < 0)
+		v = 0;
+	else if (v > 255)
+		v = 255;
+
+	return v;
+}
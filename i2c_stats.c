@@ -0,0 +1,394 @@
+/*
+	Copyright (c) 2009, Scott Ellis
+	All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+		* Redistributions of source code must retain the above copyright
+		  notice, this list of conditions and the following disclaimer.
+		* Redistributions in binary form must reproduce the above copyright
+		  notice, this list of conditions and the following disclaimer in the
+		  documentation and/or other materials provided with the distribution.
+		* Neither the name of the <organization> nor the
+		  names of its contributors may be used to endorse or promote products
+		  derived from this software without specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY Scott Ellis ''AS IS'' AND ANY
+	EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+	WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+	DISCLAIMED. IN NO EVENT SHALL Scott Ellis BE LIABLE FOR ANY
+	DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+	(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+	LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+	ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+	(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+	SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "utility.h"
+#include "i2c_stats.h"
+
+static const uint64_t bucket_bounds[I2C_STATS_BUCKETS] = I2C_STATS_BUCKET_BOUNDS;
+
+static void count(struct i2c_counter *c, int bytes, int error, uint64_t usecs);
+static uint64_t quantile_usecs(struct i2c_counter *c, double q);
+static void print_counter(FILE *fp, const char *label, struct i2c_counter *c);
+static void print_family(FILE *fp, const char *label, struct i2c_counter *counters, int num);
+static void print_histogram(FILE *fp, const char *key, const char *labels, struct i2c_counter *c);
+
+static struct i2c_counter *sort_counters;
+
+
+void i2c_stats_init(struct i2c_stats *st)
+{
+	if (!st)
+		return;
+
+	memset(st, 0, sizeof(struct i2c_stats));
+	st->_start_usecs = monotonic_usecs();
+}
+
+/*
+ * One message to one address. An opcode less then zero means a read, 
+ * which is charged to the opcode last written to the address.
+ */
+void i2c_stats_record(struct i2c_stats *st, int address, int opcode, int bytes, int error,
+		uint64_t usecs)
+{
+	if (!st || address < 0 || address > 127)
+		return;
+
+	if (opcode < 0)
+		opcode = st->_last_opcode[address];
+	else
+		st->_last_opcode[address] = opcode;
+
+	count(&st->_addr[address], bytes, error, usecs);
+	count(&st->_opcode[opcode & 0xff], bytes, error, usecs);
+}
+
+/*
+ * One call into the transport, however many messages it carried.
+ */
+void i2c_stats_record_call(struct i2c_stats *st, int bytes, int error, uint64_t usecs)
+{
+	if (st)
+		count(&st->_bus, bytes, error, usecs);
+}
+
+static void count(struct i2c_counter *c, int bytes, int error, uint64_t usecs)
+{
+	int i;
+
+	c->_transactions++;
+	c->_usecs += usecs;
+
+	if (bytes > 0)
+		c->_bytes += bytes;
+
+	if (usecs > c->_max_usecs)
+		c->_max_usecs = usecs;
+
+	for (i = 0; i < I2C_STATS_BUCKETS - 1; i++) {
+		if (usecs <= bucket_bounds[i])
+			break;
+	}
+
+	c->_hist[i]++;
+
+	if (!error)
+		return;
+
+	c->_errors++;
+
+	/* adapters report a NAK as either of these */
+	if (error == ENXIO || error == EREMOTEIO)
+		c->_naks++;
+
+	if (error == EREMOTEIO)
+		c->_remote_io++;
+	else if (error == ETIMEDOUT)
+		c->_timeouts++;
+}
+
+/*
+ * The upper bound of the bucket the quantile falls in, the max for the
+ * open ended bucket.
+ */
+static uint64_t quantile_usecs(struct i2c_counter *c, double q)
+{
+	uint64_t target, seen;
+	int i;
+
+	if (c->_transactions == 0)
+		return 0;
+
+	target = (uint64_t) (q * c->_transactions);
+
+	if (target < 1)
+		target = 1;
+
+	seen = 0;
+
+	for (i = 0; i < I2C_STATS_BUCKETS - 1; i++) {
+		seen += c->_hist[i];
+
+		if (seen >= target)
+			return bucket_bounds[i] < c->_max_usecs ? bucket_bounds[i] : c->_max_usecs;
+	}
+
+	return c->_max_usecs;
+}
+
+/* slowest total time first */
+static int compare_usecs(const void *a, const void *b)
+{
+	uint64_t x = sort_counters[*(const int *) a]._usecs;
+	uint64_t y = sort_counters[*(const int *) b]._usecs;
+
+	return (x < y) - (x > y);
+}
+
+void i2c_stats_print(FILE *fp, struct i2c_stats *st, const char *bus_name)
+{
+	if (!st) 
+		return;
+
+	fprintf(fp, "\nBus %s, up %.1f seconds\n", bus_name, 
+		(monotonic_usecs() - st->_start_usecs) / 1000000.0);
+
+	fprintf(fp, "%llu calls, %llu bytes, %llu errors, %llu probes (%llu acked)\n",
+		(unsigned long long) st->_bus._transactions, 
+		(unsigned long long) st->_bus._bytes,
+		(unsigned long long) st->_bus._errors,
+		(unsigned long long) st->_probes,
+		(unsigned long long) st->_probe_acks);
+
+	fprintf(fp, "\n%-9s %9s %10s %7s %7s %9s %9s %8s %8s %8s %8s\n",
+		"address", "txns", "bytes", "errors", "naks", "eremoteio", "etimedout",
+		"avg us", "p50 us", "p99 us", "max us");
+
+	print_family(fp, "0x%02X", st->_addr, 128);
+
+	fprintf(fp, "\n%-9s %9s %10s %7s %7s %9s %9s %8s %8s %8s %8s\n",
+		"opcode", "txns", "bytes", "errors", "naks", "eremoteio", "etimedout",
+		"avg us", "p50 us", "p99 us", "max us");
+
+	print_family(fp, "0x%02X", st->_opcode, 256);
+
+	fprintf(fp, "\n");
+}
+
+static void print_family(FILE *fp, const char *label_fmt, struct i2c_counter *counters, int num)
+{
+	char label[16];
+	int order[256];
+	int i, n;
+
+	n = 0;
+
+	for (i = 0; i < num; i++) {
+		if (counters[i]._transactions > 0)
+			order[n++] = i;
+	}
+
+	sort_counters = counters;
+	qsort(order, n, sizeof(int), compare_usecs);
+
+	for (i = 0; i < n; i++) {
+		snprintf(label, sizeof(label), label_fmt, order[i]);
+		print_counter(fp, label, &counters[order[i]]);
+	}
+}
+
+static void print_counter(FILE *fp, const char *label, struct i2c_counter *c)
+{
+	fprintf(fp, "%-9s %9llu %10llu %7llu %7llu %9llu %9llu %8.1f %8llu %8llu %8llu\n",
+		label,
+		(unsigned long long) c->_transactions,
+		(unsigned long long) c->_bytes,
+		(unsigned long long) c->_errors,
+		(unsigned long long) c->_naks,
+		(unsigned long long) c->_remote_io,
+		(unsigned long long) c->_timeouts,
+		(double) c->_usecs / c->_transactions,
+		(unsigned long long) quantile_usecs(c, 0.5),
+		(unsigned long long) quantile_usecs(c, 0.99),
+		(unsigned long long) c->_max_usecs);
+}
+
+/*
+ * One HELP and TYPE pair per family, the samples for every bus follow.
+ */
+void i2c_metrics_header(FILE *fp, const char *name, const char *type, const char *help)
+{
+	fprintf(fp, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/*
+ * Prometheus text exposition format. Latencies are in seconds as the
+ * convention asks. Each family has to be in one group, so the families
+ * are the outer loop and the buses the inner one.
+ */
+void i2c_stats_print_metrics(FILE *fp, struct i2c_stats **st, const char **bus_names, int num_buses)
+{
+	char name[64], help[64], labels[96];
+	int b, i, family;
+
+	i2c_metrics_header(fp, "blinkm_i2c_probes_total", "counter", "Presence probes sent.");
+
+	for (b = 0; b < num_buses; b++) {
+		if (st[b])
+			fprintf(fp, "blinkm_i2c_probes_total{bus=\"%s\"} %llu\n",
+				bus_names[b], (unsigned long long) st[b]->_probes);
+	}
+
+	i2c_metrics_header(fp, "blinkm_i2c_probe_acks_total", "counter", "Presence probes answered.");
+
+	for (b = 0; b < num_buses; b++) {
+		if (st[b])
+			fprintf(fp, "blinkm_i2c_probe_acks_total{bus=\"%s\"} %llu\n",
+				bus_names[b], (unsigned long long) st[b]->_probe_acks);
+	}
+
+	i2c_metrics_header(fp, "blinkm_i2c_calls_total", "counter", 
+		"Transport calls, one per write, read or transfer.");
+
+	for (b = 0; b < num_buses; b++) {
+		if (st[b])
+			fprintf(fp, "blinkm_i2c_calls_total{bus=\"%s\"} %llu\n",
+				bus_names[b], (unsigned long long) st[b]->_bus._transactions);
+	}
+
+	i2c_metrics_header(fp, "blinkm_i2c_call_errors_total", "counter", "Transport calls that failed.");
+
+	for (b = 0; b < num_buses; b++) {
+		if (st[b])
+			fprintf(fp, "blinkm_i2c_call_errors_total{bus=\"%s\"} %llu\n",
+				bus_names[b], (unsigned long long) st[b]->_bus._errors);
+	}
+
+	for (family = 0; family < 2; family++) {
+		const char *key = family ? "opcode" : "address";
+		int num = family ? 256 : 128;
+
+		snprintf(name, sizeof(name), "blinkm_i2c_%s_transactions_total", key);
+		snprintf(help, sizeof(help), "I2C messages by %s.", key);
+		i2c_metrics_header(fp, name, "counter", help);
+
+		for (b = 0; b < num_buses; b++) {
+			struct i2c_counter *counters;
+
+			if (!st[b])
+				continue;
+
+			counters = family ? st[b]->_opcode : st[b]->_addr;
+
+			for (i = 0; i < num; i++) {
+				if (counters[i]._transactions)
+					fprintf(fp, "%s{bus=\"%s\",%s=\"0x%02x\"} %llu\n",
+						name, bus_names[b], key, i, 
+						(unsigned long long) counters[i]._transactions);
+			}
+		}
+
+		snprintf(name, sizeof(name), "blinkm_i2c_%s_bytes_total", key);
+		snprintf(help, sizeof(help), "Payload bytes by %s.", key);
+		i2c_metrics_header(fp, name, "counter", help);
+
+		for (b = 0; b < num_buses; b++) {
+			struct i2c_counter *counters;
+
+			if (!st[b])
+				continue;
+
+			counters = family ? st[b]->_opcode : st[b]->_addr;
+
+			for (i = 0; i < num; i++) {
+				if (counters[i]._transactions)
+					fprintf(fp, "%s{bus=\"%s\",%s=\"0x%02x\"} %llu\n",
+						name, bus_names[b], key, i, 
+						(unsigned long long) counters[i]._bytes);
+			}
+		}
+
+		snprintf(name, sizeof(name), "blinkm_i2c_%s_errors_total", key);
+		snprintf(help, sizeof(help), "Failed I2C messages by %s and kind.", key);
+		i2c_metrics_header(fp, name, "counter", help);
+
+		for (b = 0; b < num_buses; b++) {
+			struct i2c_counter *counters;
+
+			if (!st[b])
+				continue;
+
+			counters = family ? st[b]->_opcode : st[b]->_addr;
+
+			for (i = 0; i < num; i++) {
+				if (!counters[i]._transactions)
+					continue;
+
+				snprintf(labels, sizeof(labels), "bus=\"%s\",%s=\"0x%02x\"", 
+					bus_names[b], key, i);
+
+				fprintf(fp, "%s{%s,error=\"any\"} %llu\n"
+					"%s{%s,error=\"nak\"} %llu\n"
+					"%s{%s,error=\"eremoteio\"} %llu\n"
+					"%s{%s,error=\"etimedout\"} %llu\n",
+					name, labels, (unsigned long long) counters[i]._errors,
+					name, labels, (unsigned long long) counters[i]._naks,
+					name, labels, (unsigned long long) counters[i]._remote_io,
+					name, labels, (unsigned long long) counters[i]._timeouts);
+			}
+		}
+
+		snprintf(name, sizeof(name), "blinkm_i2c_%s_latency_seconds", key);
+		snprintf(help, sizeof(help), "I2C message latency by %s.", key);
+		i2c_metrics_header(fp, name, "histogram", help);
+
+		for (b = 0; b < num_buses; b++) {
+			struct i2c_counter *counters;
+
+			if (!st[b])
+				continue;
+
+			counters = family ? st[b]->_opcode : st[b]->_addr;
+
+			for (i = 0; i < num; i++) {
+				if (!counters[i]._transactions)
+					continue;
+
+				snprintf(labels, sizeof(labels), "bus=\"%s\",%s=\"0x%02x\"", 
+					bus_names[b], key, i);
+				print_histogram(fp, key, labels, &counters[i]);
+			}
+		}
+	}
+}
+
+static void print_histogram(FILE *fp, const char *key, const char *labels, struct i2c_counter *c)
+{
+	uint64_t total;
+	int i;
+
+	total = 0;
+
+	for (i = 0; i < I2C_STATS_BUCKETS - 1; i++) {
+		total += c->_hist[i];
+		fprintf(fp, "blinkm_i2c_%s_latency_seconds_bucket{%s,le=\"%g\"} %llu\n", key, labels, 
+			bucket_bounds[i] / 1000000.0, (unsigned long long) total);
+	}
+
+	fprintf(fp, "blinkm_i2c_%s_latency_seconds_bucket{%s,le=\"+Inf\"} %llu\n", key, labels, 
+		(unsigned long long) c->_transactions);
+	fprintf(fp, "blinkm_i2c_%s_latency_seconds_sum{%s} %g\n", key, labels, 
+		c->_usecs / 1000000.0);
+	fprintf(fp, "blinkm_i2c_%s_latency_seconds_count{%s} %llu\n", key, labels, 
+		(unsigned long long) c->_transactions);
+}
@@ -0,0 +1,79 @@
+/*
+	Copyright (c) 2009, Scott Ellis
+	All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+		* Redistributions of source code must retain the above copyright
+		  notice, this list of conditions and the following disclaimer.
+		* Redistributions in binary form must reproduce the above copyright
+		  notice, this list of conditions and the following disclaimer in the
+		  documentation and/or other materials provided with the distribution.
+		* Neither the name of the <organization> nor the
+		  names of its contributors may be used to endorse or promote products
+		  derived from this software without specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY Scott Ellis ''AS IS'' AND ANY
+	EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+	WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+	DISCLAIMED. IN NO EVENT SHALL Scott Ellis BE LIABLE FOR ANY
+	DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+	(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+	LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+	ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+	(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+	SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef I2C_STATS_H
+#define I2C_STATS_H
+
+/* latency histogram upper bounds in usecs, the last bucket is everything slower */
+#define I2C_STATS_BUCKETS 13
+#define I2C_STATS_BUCKET_BOUNDS { 50, 100, 200, 500, 1000, 2000, 5000, 10000, \
+				20000, 50000, 100000, 200000, 0 }
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct i2c_counter {
+	uint64_t _transactions;
+	uint64_t _bytes;
+	uint64_t _errors;
+	uint64_t _naks;
+	uint64_t _remote_io;
+	uint64_t _timeouts;
+	uint64_t _usecs;
+	uint64_t _max_usecs;
+	uint64_t _hist[I2C_STATS_BUCKETS];
+};
+
+/* 
+ * Filled in by the transport layer when attached to a session. Messages
+ * are counted per address and per opcode, reads under the opcode last 
+ * written to that address. Whole calls are counted in _bus.
+ */
+struct i2c_stats {
+	uint64_t _start_usecs;
+	uint64_t _probes;
+	uint64_t _probe_acks;
+	struct i2c_counter _bus;
+	struct i2c_counter _addr[128];
+	struct i2c_counter _opcode[256];
+	uint8_t _last_opcode[128];
+};
+
+void i2c_stats_init(struct i2c_stats *st);
+void i2c_stats_record(struct i2c_stats *st, int address, int opcode, int bytes, int error,
+		uint64_t usecs);
+void i2c_stats_record_call(struct i2c_stats *st, int bytes, int error, uint64_t usecs);
+void i2c_stats_print(FILE *fp, struct i2c_stats *st, const char *bus_name);
+void i2c_stats_print_metrics(FILE *fp, struct i2c_stats **st, const char **bus_names, int num_buses);
+void i2c_metrics_header(FILE *fp, const char *name, const char *type, const char *help);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
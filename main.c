@@ -31,8 +31,24 @@
 #include <string.h>
 #include <stdint.h> 
 #include <ctype.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
 
+#include "utility.h"
+#include "i2c_functions.h"
 #include "i2c_blinkm.h"
+#include "i2c_scan.h"
+#include "blinkm_daemon.h"
+#include "blinkm_stream.h"
+#include "blinkm_cache.h"
+#include "blinkm_script.h"
+#include "i2c_stats.h"
+#include "i2c_recovery.h"
+#include "blinkm_broadcast.h"
+#include "blinkm_sched.h"
+#include "blinkm_anim.h"
+#include "blinkm_inventory.h"
 #include "blinkm_regs.h"
 
 struct cmd {
@@ -57,11 +73,23 @@ struct cmd {
 #define CMD_WRITE_SCRIPT_LINE 14
 #define CMD_SET_SCRIPT_LENGTH_AND_REPEATS 15
 #define CMD_SET_ADDRESS 16 
-#define NUM_COMMANDS 17
+#define CMD_DAEMON 17
+#define CMD_CLIENT 18
+#define CMD_STREAM 19
+#define CMD_RESYNC 20
+#define CMD_WRITE_SCRIPT 21
+#define CMD_LOAD_SCRIPT 22
+#define CMD_SYNC_SCRIPT 23
+#define CMD_STATS 24
+#define CMD_METRICS 25
+#define CMD_CUES 26
+#define CMD_ANIMATE 27
+#define CMD_RUN 28
+#define NUM_COMMANDS 29
 
 struct cmd commands[NUM_COMMANDS] = {
 	{ "usage", "" },
-	{ "find-leds", "" },
+	{ "find-leds", "[-B bus[,bus...]]" },
 	{ "set-rgb", "[-d led] [-r red] [-g green] [-b blue]" },
 	{ "get-rgb", "[-d led]" },
 	{ "fade-rgb", "[-d led] [-r red] [-g green] [-b blue]" },
@@ -76,7 +104,19 @@ struct cmd commands[NUM_COMMANDS] = {
 	{ "read-script", "[-d led]" },
 	{ "write-script-line", "[-d led] -n line_no -t ticks -c cmd -a arg1[,arg2[,arg3]]" },
 	{ "set-script-length-and-repeats", "[-d led] -l length -n repeats" },
-	{ "set-address", "-d new_led_address" }
+	{ "set-address", "-d new_led_address" },
+	{ "daemon", "[-S socket]" },
+	{ "client", "[-S socket] [<command> <args>]" },
+	{ "stream", "[-d led] [-f fps] [-c set-rgb|fade-rgb|fade-hsb] [-i input]" },
+	{ "resync", "[-d led]" },
+	{ "write-script", "[-d led] [-n repeats] [-w delay_ms] [-i file]" },
+	{ "load-script", "[-d led] [-w delay_ms] -i file" },
+	{ "sync-script", "[-d led] [-n repeats] [-w delay_ms] -i file" },
+	{ "stats", "" },
+	{ "metrics", "" },
+	{ "cues", "[-w lead_ms] [-i file]" },
+	{ "animate", "[-d led] [-f fps] [-i file]" },
+	{ "run", "[-i file]" }
 };
 
 
@@ -108,12 +148,23 @@ struct script scripts[MAX_SCRIPTS] = {
 	{ "morse-code", "S.O.S. in white" }
 };
 
-#define MAX_LEDS_PER_CMD 32 
+/* every address on every bus */
+#define MAX_LEDS_PER_CMD (127 * MAX_SCAN_BUSES)
+
+/* nested groups deeper than this are taken to be a loop */
+#define MAX_GROUP_DEPTH 8
+
+#define DEFAULT_GROUPS_FILE "/etc/blinkm/groups"
 
 struct blinkm_args {
 	int _cmd;
 	int _num_leds;
+	/* a led of 0 stands for every led found on its bus, see expand_found() */
 	int _led[MAX_LEDS_PER_CMD];
+	/* index into _bus for each led, -1 for the default bus */
+	int _led_bus[MAX_LEDS_PER_CMD];
+	/* -d all, every led on the bus through the general call address */
+	int _all;
 	int _red;
 	int _green;
 	int _blue;
@@ -126,32 +177,311 @@ struct blinkm_args {
 	int _time_adjust;
 	int _line_no;
 	struct script_line _script_line;
+	int _num_buses;
+	int _default_bus;
+	char _bus[MAX_SCAN_BUSES][64];
+	char _socket[108];
+	char _input[256];
+	int _delay;
+	int _repeats_set;
+};
+
+/* 
+ * The sessions a process has open, one per bus, opened the first time a 
+ * command uses the bus. Long running modes keep cache and stats for each.
+ */
+struct bus_set {
+	int _count;
+	int _keep_state;
+	char _name[MAX_SCAN_BUSES][64];
+	struct i2c_session _session[MAX_SCAN_BUSES];
+};
+
+/* one thread's share of a command that spans several buses */
+struct bus_job {
+	struct i2c_session *_bus;
+	struct blinkm_args _ba;
+	int _result;
 };
 
 int parse_args(int argc, char **argv, struct blinkm_args *ba);
 int get_led_arg(char *arg, struct blinkm_args *ba);
+int parse_led_list(char *list, struct blinkm_args *ba, int count, int bus, int depth);
+int find_group(const char *name, char *list, int size);
+void unique_leds(struct blinkm_args *ba);
+int expand_found(struct bus_set *set, struct blinkm_args *ba);
+int get_bus_arg(char *arg, struct blinkm_args *ba);
+int add_bus(struct blinkm_args *ba, const char *arg);
+struct i2c_session *get_session(struct bus_set *set, const char *name);
+void close_sessions(struct bus_set *set);
+int run_on_buses(struct bus_set *set, struct blinkm_args *ba);
+void print_metrics(struct i2c_session *sessions, int count);
+void *bus_job_thread(void *arg);
 int get_script_arg(char *arg);
 int check_args(struct blinkm_args *ba);
-void run_led_command(struct blinkm_args *ba, int led_index);
-void run_command(struct blinkm_args *ba);
-void scan_bus_for_leds();
-void read_script(uint8_t led_addr);
+int command_needs_bus(struct blinkm_args *ba);
+int run_led_command(struct i2c_session *bus, struct blinkm_args *ba, int led_index);
+int run_batch_command(struct i2c_session *bus, struct blinkm_args *ba);
+int get_write_only_cmd(struct blinkm_args *ba, uint8_t *cmd, uint8_t *args);
+int run_broadcast(struct i2c_session *bus, struct blinkm_args *ba);
+int run_command(struct i2c_session *bus, struct blinkm_args *ba);
+void run_command_line(char *line, void *ctx);
+int parse_command_line(char *line, struct blinkm_args *ba);
+int check_nested_command(struct blinkm_args *ba, const char *from);
+int run_file(struct bus_set *set, struct blinkm_args *ba);
+int run_cues(struct i2c_session *bus, struct blinkm_args *ba);
+int run_animate(struct i2c_session *bus, struct blinkm_args *ba);
+int run_stream(struct i2c_session *bus, struct blinkm_args *ba);
+int run_client(int argc, char **argv);
+int scan_bus_for_leds(struct i2c_session *bus, struct blinkm_args *ba);
+void print_scan(struct blinkm_scan *scan);
+void read_script(struct i2c_session *bus, uint8_t led_addr);
 int get_write_script_line_cmd(char *arg);
-int get_write_script_line_cmd_args(char *arg, struct blinkm_args *ba);
+int get_write_script_line_cmd_args(char *arg, struct script_line *sl);
+int run_write_script(struct i2c_session *bus, struct blinkm_args *ba);
+int run_sync_script(struct i2c_session *bus, struct blinkm_args *ba);
 
 
 int main(int argc, char **argv)
 {
 	struct blinkm_args ba;
+	struct bus_set set;
+	int result;
+
+	/* the client passes its arguments through to the daemon untouched */
+	if (argc > 1 && !strcasecmp(argv[1], commands[CMD_CLIENT]._cmd)) 
+		return run_client(argc, argv) < 0 ? 1 : 0;
 
 	if (!parse_args(argc, argv, &ba)) 
 		ba._cmd = CMD_SHOW_USAGE;
 	else if (!check_args(&ba)) 
 		ba._cmd = CMD_SHOW_USAGE;
 	
-	run_command(&ba);
+	memset(&set, 0, sizeof(set));
 
-	return 0;
+	/* long running modes remember what each led is showing to skip redundant writes */
+	set._keep_state = (ba._cmd == CMD_DAEMON || ba._cmd == CMD_STREAM);
+
+	result = run_on_buses(&set, &ba);
+
+	close_sessions(&set);
+
+	return result < 0 ? 1 : 0;
+}
+
+/*
+ * A NULL name is the default bus, $BLINKM_BUS or the compiled in one.
+ * Return NULL if the bus can't be opened.
+ */
+struct i2c_session *get_session(struct bus_set *set, const char *name)
+{
+	static struct blinkm_cache caches[MAX_SCAN_BUSES];
+	static struct i2c_stats stats[MAX_SCAN_BUSES];
+	static struct i2c_recovery recovery[MAX_SCAN_BUSES];
+	struct i2c_session *bus;
+	int i;
+
+	if (!name)
+		name = "";
+
+	for (i = 0; i < set->_count; i++) {
+		if (!strcmp(set->_name[i], name))
+			return &set->_session[i];
+	}
+
+	if (set->_count >= MAX_SCAN_BUSES) {
+		fprintf(stderr, "No more than %d buses can be open\n", MAX_SCAN_BUSES);
+		return NULL;
+	}
+
+	bus = &set->_session[set->_count];
+
+	if (i2c_open_session(bus, *name ? name : NULL) < 0)
+		return NULL;
+
+	i2c_recovery_init(&recovery[set->_count]);
+	bus->_recovery = &recovery[set->_count];
+
+	if (set->_keep_state) {
+		blinkm_cache_init(&caches[set->_count]);
+		bus->_cache = &caches[set->_count];
+		i2c_stats_init(&stats[set->_count]);
+		bus->_stats = &stats[set->_count];
+	}
+
+	strcpy(set->_name[set->_count], name);
+	set->_count++;
+
+	return bus;
+}
+
+void close_sessions(struct bus_set *set)
+{
+	struct i2c_session *bus;
+	int i;
+
+	for (i = 0; i < set->_count; i++) {
+		bus = &set->_session[i];
+
+		if (i2c_is_simulated(bus))
+			fprintf(stderr, "%s: %llu bytes, %.3f ms of bus time\n", bus->_bus,
+				(unsigned long long) bus->_bytes, bus->_bus_usecs / 1000.0);
+
+		i2c_close_session(bus);
+	}
+
+	set->_count = 0;
+}
+
+/*
+ * Leds on different buses are split up and each bus gets its own thread,
+ * so independent buses are driven in parallel.
+ * Return -1 if a bus could not be opened.
+ */
+int run_on_buses(struct bus_set *set, struct blinkm_args *ba)
+{
+	struct bus_job jobs[MAX_SCAN_BUSES];
+	pthread_t threads[MAX_SCAN_BUSES];
+	struct i2c_session *bus;
+	const char *name;
+	int bus_index[MAX_SCAN_BUSES];
+	int i, j, num_jobs, result;
+
+	name = ba->_default_bus >= 0 ? ba->_bus[ba->_default_bus] : NULL;
+
+	switch (ba->_cmd) {
+	case CMD_DAEMON:
+		/* open the default bus now so a bad one is reported before listening */
+		if (!get_session(set, name))
+			return -1;
+
+		return blinkm_daemon_run(ba->_socket[0] ? ba->_socket : NULL, run_command_line, set) < 0 ? -1 : 0;
+
+	case CMD_RUN:
+		return run_file(set, ba);
+
+	case CMD_STATS:
+	case CMD_METRICS:
+		if (set->_count == 0)
+			return run_command(NULL, ba);
+
+		if (ba->_cmd == CMD_METRICS) {
+			print_metrics(set->_session, set->_count);
+			return 0;
+		}
+
+		for (i = 0, result = 0; i < set->_count; i++) {
+			if (run_command(&set->_session[i], ba) < 0)
+				result = -1;
+		}
+
+		return result;
+	}
+
+	if (!command_needs_bus(ba)) 
+		return run_command(NULL, ba);
+
+	/* only commands that send to a -d list have all-found to expand */
+	if (ba->_cmd != CMD_FIND_LEDS && expand_found(set, ba) < 0)
+		return -1;
+
+	num_jobs = 0;
+
+	for (i = 0; i < ba->_num_leds; i++) {
+		for (j = 0; j < num_jobs; j++) {
+			if (bus_index[j] == ba->_led_bus[i])
+				break;
+		}
+
+		if (j == num_jobs)
+			bus_index[num_jobs++] = ba->_led_bus[i];
+	}
+
+	if (num_jobs < 2) {
+		if (num_jobs == 1 && bus_index[0] >= 0)
+			name = ba->_bus[bus_index[0]];
+
+		bus = get_session(set, name);
+
+		if (!bus)
+			return -1;
+
+		return run_command(bus, ba);
+	}
+
+	/* frames address leds by position in the -d list */
+	if (ba->_cmd == CMD_STREAM || ba->_cmd == CMD_ANIMATE) {
+		printf("The %s leds must all be on one bus\n", commands[ba->_cmd]._cmd);
+		return -1;
+	}
+
+	/* sessions are opened here, the threads only use them */
+	for (j = 0; j < num_jobs; j++) {
+		name = bus_index[j] >= 0 ? ba->_bus[bus_index[j]] : NULL;
+
+		jobs[j]._bus = get_session(set, name);
+
+		if (!jobs[j]._bus)
+			return -1;
+
+		jobs[j]._ba = *ba;
+		jobs[j]._ba._num_leds = 0;
+
+		for (i = 0; i < ba->_num_leds; i++) {
+			if (ba->_led_bus[i] == bus_index[j]) {
+				jobs[j]._ba._led[jobs[j]._ba._num_leds] = ba->_led[i];
+				jobs[j]._ba._led_bus[jobs[j]._ba._num_leds] = bus_index[j];
+				jobs[j]._ba._num_leds++;
+			}
+		}
+	}
+
+	for (j = 0; j < num_jobs; j++) {
+		if (pthread_create(&threads[j], NULL, bus_job_thread, &jobs[j])) {
+			fprintf(stderr, "Could not start a thread for %s\n", jobs[j]._bus->_bus);
+			bus_job_thread(&jobs[j]);
+			threads[j] = 0;
+		}
+	}
+
+	for (j = 0, result = 0; j < num_jobs; j++) {
+		if (threads[j])
+			pthread_join(threads[j], NULL);
+
+		if (jobs[j]._result < 0)
+			result = -1;
+	}
+
+	return result;
+}
+
+/*
+ * Every bus goes into one exposition, each family printed once.
+ */
+void print_metrics(struct i2c_session *sessions, int count)
+{
+	struct i2c_stats *stats[MAX_SCAN_BUSES];
+	struct i2c_recovery *recovery[MAX_SCAN_BUSES];
+	const char *names[MAX_SCAN_BUSES];
+	int i;
+
+	for (i = 0; i < count; i++) {
+		stats[i] = sessions[i]._stats;
+		recovery[i] = sessions[i]._recovery;
+		names[i] = sessions[i]._bus;
+	}
+
+	i2c_stats_print_metrics(stdout, stats, names, count);
+	i2c_recovery_print_metrics(stdout, recovery, names, count);
+}
+
+void *bus_job_thread(void *arg)
+{
+	struct bus_job *job = (struct bus_job *) arg;
+
+	job->_result = run_command(job->_bus, &job->_ba);
+
+	return NULL;
 }
 
 int parse_args(int argc, char **argv, struct blinkm_args *ba)
@@ -159,13 +489,18 @@ int parse_args(int argc, char **argv, struct blinkm_args *ba)
 	int opt, i;
 	char *end;
 
+	bzero(ba, sizeof(struct blinkm_args));
+	ba->_script_id = -1;
+	ba->_delay = -1;
+	ba->_default_bus = -1;
+
 	if (argc < 2) 
 		return 0;
 
-	bzero(ba, sizeof(struct blinkm_args));
-	ba->_script_id = -1;
+	/* the daemon parses many command lines in one process */
+	optind = 0;
 
-	while ((opt = getopt(argc, argv, "d:r:g:b:s:h:n:f:t:c:a:")) != -1) {
+	while ((opt = getopt(argc, argv, "d:r:g:b:s:h:n:f:t:c:a:B:S:i:w:")) != -1) {
 	
 		switch (opt) {
 		case 'd':
@@ -198,6 +533,7 @@ int parse_args(int argc, char **argv, struct blinkm_args *ba)
 		case 'n':
 			ba->_num_repeats = strtol(optarg, &end, 0);
 			ba->_line_no = ba->_num_repeats;
+			ba->_repeats_set = 1;
 			break;
 
 		case 'f':
@@ -214,11 +550,35 @@ int parse_args(int argc, char **argv, struct blinkm_args *ba)
 			break;
 
 		case 'a':
-			get_write_script_line_cmd_args(optarg, ba);
+			get_write_script_line_cmd_args(optarg, &ba->_script_line);
+			break;
+
+		case 'B':
+			ba->_num_buses = get_bus_arg(optarg, ba);
+			break;
+
+		case 'S':
+			snprintf(ba->_socket, sizeof(ba->_socket), "%s", optarg);
+			break;
+
+		case 'i':
+			snprintf(ba->_input, sizeof(ba->_input), "%s", optarg);
+			break;
+
+		case 'w':
+			ba->_delay = strtol(optarg, &end, 0);
 			break;
 		}
 	}
 
+	/* leds without an @bus go to the first -B bus, or the default */
+	for (i = 0; i < ba->_num_leds; i++) {
+		if (ba->_led_bus[i] < 0)
+			ba->_led_bus[i] = ba->_default_bus;
+	}
+
+	unique_leds(ba);
+
 	if (optind < argc) 
 		for (i = 1; i < NUM_COMMANDS; i++) 
 			if (!strcasecmp(argv[optind], commands[i]._cmd)) {
@@ -230,40 +590,296 @@ int parse_args(int argc, char **argv, struct blinkm_args *ba)
 }
 
 /*
- * The -d arg can take a comma separated list of up to MAX_LEDS_PER_CMD numbers. 
+ * The -d arg is a comma separated list of leds. Each item can be
+ *
+ *   an address or a first-last range of addresses
+ *   the name of a group from $BLINKM_GROUPS or /etc/blinkm/groups
+ *   all-found, every led the last scan of the bus found
+ *   all, every led on the bus through the general call, see run_broadcast()
+ *
+ * followed by @bus for another bus, like 9@1 or 1-10@1. A bus on a group
+ * applies to its members that don't have their own.
  */
 int get_led_arg(char *arg, struct blinkm_args *ba)
 {
-	char buff[64];
-	char *p, *end;
-	int i;
-	
-	if (strlen(arg) > sizeof(buff) - 1) {
-		printf("Unreasonably long list for the led argument: %s\n", arg);
+	char *list;
+	int count;
+
+	list = strdup(arg);
+
+	if (!list) {
+		printf("Out of memory for the led argument\n");
 		return 0;
 	}
 
-	strcpy(buff, arg);
+	count = parse_led_list(list, ba, 0, -1, 0);
 
-	i = 0;
-	p = strtok(buff, ",");
+	free(list);
 
-	while (p && i < MAX_LEDS_PER_CMD) {
-		ba->_led[i] = strtol(p, &end, 0);
-	
-		/* skip the bad ones */
-		if (ba->_led[i] < 1 ||  ba->_led[i] > 127) {
-			printf("Invalid led address %d ignored\n", ba->_led[i]);
-			ba->_led[i] = 0;
+	return count;
+}
+
+/*
+ * Add the leds in list to ba->_led starting at count. The list is 
+ * modified. Leds without an @bus get bus, -1 for the default.
+ * Return the new count.
+ */
+int parse_led_list(char *list, struct blinkm_args *ba, int count, int bus, int depth)
+{
+	char group[1024];
+	char *p, *end, *at, *save;
+	int first, last, led_bus, led;
+
+	p = strtok_r(list, ",", &save);
+
+	while (p) {
+		at = strchr(p, '@');
+
+		if (at)
+			*at++ = 0;
+
+		led_bus = at ? add_bus(ba, at) : bus;
+
+		if (at && led_bus < 0) {
+			printf("Leds %s on bus %s ignored\n", p, at);
+		}
+		else if (!strcasecmp(p, "all")) {
+			ba->_all = 1;
+
+			if (at)
+				ba->_default_bus = led_bus;
+		}
+		else if (!strcasecmp(p, "all-found")) {
+			if (count < MAX_LEDS_PER_CMD) {
+				ba->_led[count] = 0;
+				ba->_led_bus[count] = led_bus;
+				count++;
+			}
+		}
+		else if (isalpha(*p)) {
+			if (depth >= MAX_GROUP_DEPTH)
+				printf("Led group %s nested too deep, ignored\n", p);
+			else if (!find_group(p, group, sizeof(group)))
+				printf("Unknown led group %s ignored\n", p);
+			else
+				count = parse_led_list(group, ba, count, led_bus, depth + 1);
 		}
 		else {
-			i++;
+			first = strtol(p, &end, 0);
+			last = first;
+
+			if (*end == '-')
+				last = strtol(end + 1, &end, 0);
+
+			if (*end || first < 1 || last > 127 || first > last) {
+				printf("Invalid led address %s ignored\n", p);
+			}
+			else {
+				for (led = first; led <= last && count < MAX_LEDS_PER_CMD; led++) {
+					ba->_led[count] = led;
+					ba->_led_bus[count] = led_bus;
+					count++;
+				}
+			}
 		}
 
-		p = strtok(NULL, ",");
+		p = strtok_r(NULL, ",", &save);
 	}
-	
-	return i;		
+
+	return count;
+}
+
+/*
+ * The groups file has one group per line, a name and a led list in -d 
+ * syntax, which can name other groups.
+ *
+ *   # name   leds
+ *   wall     1-64
+ *   door     65-70,3@1
+ *   front    wall,door
+ *
+ * Return 1 with the list copied if the group was found.
+ */
+int find_group(const char *name, char *list, int size)
+{
+	const char *path;
+	char line[1024], *p, *leds, *save;
+	FILE *fp;
+	int found;
+
+	path = getenv("BLINKM_GROUPS");
+
+	if (!path || !*path)
+		path = DEFAULT_GROUPS_FILE;
+
+	fp = fopen(path, "r");
+
+	if (!fp)
+		return 0;
+
+	found = 0;
+
+	while (!found && fgets(line, sizeof(line), fp)) {
+		p = strchr(line, '#');
+
+		if (p)
+			*p = 0;
+
+		p = strtok_r(line, " \t\r\n", &save);
+
+		if (!p || strcmp(p, name))
+			continue;
+
+		leds = strtok_r(NULL, " \t\r\n", &save);
+
+		if (leds) {
+			snprintf(list, size, "%s", leds);
+			found = 1;
+		}
+	}
+
+	fclose(fp);
+
+	return found;
+}
+
+/*
+ * Drop repeats, so a led covered by both a range and a group only gets 
+ * the command once and one bus never has more leds than a batch holds.
+ */
+void unique_leds(struct blinkm_args *ba)
+{
+	uint8_t seen[MAX_SCAN_BUSES + 1][128];
+	int i, n, row;
+
+	memset(seen, 0, sizeof(seen));
+
+	for (i = 0, n = 0; i < ba->_num_leds; i++) {
+		row = ba->_led_bus[i] + 1;
+
+		if (seen[row][ba->_led[i]])
+			continue;
+
+		seen[row][ba->_led[i]] = 1;
+		ba->_led[n] = ba->_led[i];
+		ba->_led_bus[n] = ba->_led_bus[i];
+		n++;
+	}
+
+	ba->_num_leds = n;
+}
+
+/*
+ * Replace each all-found entry with the leds found on its bus, from the
+ * session's last scan or a new one.
+ * Return -1 if a bus could not be opened.
+ */
+int expand_found(struct bus_set *set, struct blinkm_args *ba)
+{
+	struct i2c_session *bus;
+	uint8_t leds[128];
+	int found_bus[MAX_SCAN_BUSES + 1];
+	int i, j, n, num_found, count;
+
+	num_found = 0;
+
+	for (i = 0, n = 0; i < ba->_num_leds; i++) {
+		if (ba->_led[i] == 0) {
+			found_bus[num_found++] = ba->_led_bus[i];
+		}
+		else {
+			ba->_led[n] = ba->_led[i];
+			ba->_led_bus[n] = ba->_led_bus[i];
+			n++;
+		}
+	}
+
+	if (num_found == 0)
+		return 0;
+
+	for (i = 0; i < num_found; i++) {
+		bus = get_session(set, found_bus[i] >= 0 ? ba->_bus[found_bus[i]] : NULL);
+
+		if (!bus)
+			return -1;
+
+		count = blinkm_find_leds(bus, leds);
+
+		if (count < 0)
+			printf("Could not scan %s for leds\n", bus->_bus);
+
+		for (j = 0; j < count && n < MAX_LEDS_PER_CMD; j++) {
+			ba->_led[n] = leds[j];
+			ba->_led_bus[n] = found_bus[i];
+			n++;
+		}
+	}
+
+	ba->_num_leds = n;
+
+	unique_leds(ba);
+
+	return 0;
+}
+
+/*
+ * The -B arg takes a comma separated list of up to MAX_SCAN_BUSES i2c devices. 
+ * The first is the default bus for the command. 
+ */
+int get_bus_arg(char *arg, struct blinkm_args *ba)
+{
+	char buff[256];
+	char *p, *save;
+	int i;
+
+	if (strlen(arg) > sizeof(buff) - 1) {
+		printf("Unreasonably long list for the bus argument: %s\n", arg);
+		return ba->_num_buses;
+	}
+
+	strcpy(buff, arg);
+
+	p = strtok_r(buff, ",", &save);
+
+	while (p) {
+		i = add_bus(ba, p);
+
+		if (i >= 0 && ba->_default_bus < 0)
+			ba->_default_bus = i;
+
+		p = strtok_r(NULL, ",", &save);
+	}
+
+	return ba->_num_buses;
+}
+
+/*
+ * A plain number N is short for /dev/i2c-N.
+ * Return the index of the bus in ba->_bus or -1 if there are too many.
+ */
+int add_bus(struct blinkm_args *ba, const char *arg)
+{
+	char name[64];
+	int i;
+
+	if (isdigit(arg[0])) 
+		snprintf(name, sizeof(name), "/dev/i2c-%s", arg);
+	else
+		snprintf(name, sizeof(name), "%s", arg);
+
+	for (i = 0; i < ba->_num_buses; i++) {
+		if (!strcmp(ba->_bus[i], name))
+			return i;
+	}
+
+	if (ba->_num_buses >= MAX_SCAN_BUSES) {
+		printf("No more than %d buses in one command\n", MAX_SCAN_BUSES);
+		return -1;
+	}
+
+	strcpy(ba->_bus[ba->_num_buses], name);
+
+	return ba->_num_buses++;
 }
 
 /*
@@ -335,7 +951,7 @@ int get_write_script_line_cmd(char *arg)
 	return cmd;
 }
 
-int get_write_script_line_cmd_args(char *arg, struct blinkm_args *ba)
+int get_write_script_line_cmd_args(char *arg, struct script_line *sl)
 {
 	char buff[64];
 	char *p, *end;
@@ -357,7 +973,7 @@ int get_write_script_line_cmd_args(char *arg, struct blinkm_args *ba)
 		if (val < 0 || val > 255) 
 			break;
 
-		ba->_script_line._arg[i] = val;
+		sl->_arg[i] = val;
 		i++;
 		p = strtok(NULL, ",");
 	}
@@ -462,42 +1078,150 @@ int check_args(struct blinkm_args *ba)
 
 		break;
 
-	case CMD_GET_RGB:
-	case CMD_STOP_SCRIPT:
-	case CMD_READ_SCRIPT:
-	case CMD_SET_ADDRESS:
-		need_led = 1;
-		break;
+	case CMD_STREAM:
+		/* the -f fade speed doubles as the frame rate */
+		if (ba->_fade_speed < 0 || ba->_fade_speed > 1000) {
+			result = 0;
+			printf("Stream frame rate range is 0-1000. Zero sends frames as fast as they arrive.\n");
+		}
 
-	/* these commands don't require any arguments */
-	case CMD_FIND_LEDS:
-	case CMD_SHOW_SCRIPTS:
-	case CMD_SHOW_USAGE:
-		break;
+		switch (ba->_script_line._cmd) {
+		case 0:
+			ba->_script_line._cmd = SET_RGB_COLOR_NOW;
+			break;
 
-	default:
-		result = 0;
-	}
+		case SET_RGB_COLOR_NOW:
+		case FADE_TO_RGB_COLOR:
+		case FADE_TO_HSB_COLOR:
+			break;
+
+		default:
+			result = 0;
+			printf("Stream command must be set-rgb, fade-rgb or fade-hsb\n");
+		}
+
+		break;
+
+	case CMD_WRITE_SCRIPT:
+		need_led = 1;
+
+		if (ba->_num_repeats < 0 || ba->_num_repeats > 255) {
+			result = 0;
+			printf("Script repeat range is 0-255. Zero repeats forever.\n");
+		}
+		else if (ba->_delay < -1 || ba->_delay > 1000) {
+			result = 0;
+			printf("Eeprom write delay range is 0-1000 ms\n");
+		}
+
+		break;
+
+	case CMD_LOAD_SCRIPT:
+	case CMD_SYNC_SCRIPT:
+		need_led = 1;
+
+		if (!ba->_input[0]) {
+			result = 0;
+			printf("%s needs a script file, -i file\n", commands[ba->_cmd]._cmd);
+		}
+		else if (ba->_repeats_set && (ba->_num_repeats < 0 || ba->_num_repeats > 255)) {
+			result = 0;
+			printf("Script repeat range is 0-255. Zero repeats forever.\n");
+		}
+		else if (ba->_delay < -1 || ba->_delay > 1000) {
+			result = 0;
+			printf("Eeprom write delay range is 0-1000 ms\n");
+		}
+
+		break;
+
+	case CMD_ANIMATE:
+		need_led = 1;
+
+		/* the -f fade speed doubles as the frame rate */
+		if (ba->_fade_speed < 0 || ba->_fade_speed > 1000) {
+			result = 0;
+			printf("Animation frame rate range is 0-1000. Zero uses %d.\n", 
+				BLINKM_ANIM_DEFAULT_FPS);
+		}
+
+		break;
+
+	case CMD_RUN:
+		break;
+
+	case CMD_CUES:
+		if (ba->_delay < -1 || ba->_delay > 10000) {
+			result = 0;
+			printf("Cue lead time range is 0-10000 ms\n");
+		}
+
+		break;
+
+	case CMD_GET_RGB:
+	case CMD_RESYNC:
+	case CMD_STOP_SCRIPT:
+	case CMD_READ_SCRIPT:
+	case CMD_SET_ADDRESS:
+		need_led = 1;
+		break;
+
+	/* these commands don't require any arguments */
+	case CMD_STATS:
+	case CMD_METRICS:
+	case CMD_DAEMON:
+	case CMD_FIND_LEDS:
+	case CMD_SHOW_SCRIPTS:
+	case CMD_SHOW_USAGE:
+		break;
+
+	default:
+		result = 0;
+	}
 
-	if (result && need_led && ba->_num_leds == 0) {
+	if (result && need_led && ba->_num_leds == 0 && !ba->_all) {
 		ba->_led[0] = DEFAULT_BLINKM_I2C_ADDRESS;
+		ba->_led_bus[0] = ba->_default_bus;
 		ba->_num_leds = 1;
 	}
 
 	return result;
 }
 
-void run_led_command(struct blinkm_args *ba, int led_index)
+int command_needs_bus(struct blinkm_args *ba)
 {
-	int rgb;
+	switch (ba->_cmd) {
+	case CMD_SHOW_USAGE:
+	case CMD_SHOW_SCRIPTS:
+		return 0;
+
+	/* only the daemon has anything to report */
+	case CMD_STATS:
+	case CMD_METRICS:
+		return 0;
+
+	/* an explicit bus list is scanned with a session per bus */
+	case CMD_FIND_LEDS:
+		return ba->_num_buses == 0;
+
+	default:
+		return 1;
+	}
+}
+
+int run_led_command(struct i2c_session *bus, struct blinkm_args *ba, int led_index)
+{
+	int rgb, result;
+
+	result = 0;
 
 	switch (ba->_cmd) {
 	case CMD_SET_RGB:
-		blinkm_set_rgb_color_now(ba->_led[led_index], ba->_red, ba->_green, ba->_blue);
+		result = blinkm_set_rgb_color_now(bus, ba->_led[led_index], ba->_red, ba->_green, ba->_blue);
 		break;
 
 	case CMD_GET_RGB:
-		rgb = blinkm_get_current_rgb_color(ba->_led[led_index]);
+		rgb = result = blinkm_get_current_rgb_color(bus, ba->_led[led_index]);
 
 		if (rgb > 0) 
 			printf("Led %d rgb(%d, %d, %d)\t[Led 0x%02x (0x%02x, 0x%02x, 0x%02x)]\n",
@@ -507,39 +1231,51 @@ void run_led_command(struct blinkm_args *ba, int led_index)
 		break;
 
 	case CMD_FADE_RGB:
-		blinkm_fade_to_rgb_color(ba->_led[led_index], ba->_red, ba->_green, ba->_blue);
+		result = blinkm_fade_to_rgb_color(bus, ba->_led[led_index], ba->_red, ba->_green, ba->_blue);
 		break;
 
 	case CMD_FADE_HSB:
-		blinkm_fade_to_hsb_color(ba->_led[led_index], ba->_hue, ba->_saturation, ba->_brightness);
+		result = blinkm_fade_to_hsb_color(bus, ba->_led[led_index], ba->_hue, ba->_saturation, ba->_brightness);
 		break;
 
 	case CMD_FADE_RANDOM_RGB:
-		blinkm_fade_to_random_rgb_color(ba->_led[led_index], ba->_red, ba->_green, ba->_blue);
+		result = blinkm_fade_to_random_rgb_color(bus, ba->_led[led_index], ba->_red, ba->_green, ba->_blue);
 		break;
 
 	case CMD_FADE_RANDOM_HSB:
-		blinkm_fade_to_random_hsb_color(ba->_led[led_index], ba->_hue, ba->_saturation, ba->_brightness);
+		result = blinkm_fade_to_random_hsb_color(bus, ba->_led[led_index], ba->_hue, ba->_saturation, ba->_brightness);
 		break;
 
 	case CMD_PLAY_SCRIPT:
-		blinkm_play_script(ba->_led[led_index], ba->_script_id, ba->_num_repeats);
+		result = blinkm_play_script(bus, ba->_led[led_index], ba->_script_id, ba->_num_repeats);
 		break;
 
 	case CMD_STOP_SCRIPT:
-		blinkm_stop_script(ba->_led[led_index]);
+		result = blinkm_stop_script(bus, ba->_led[led_index]);
 		break;
 
 	case CMD_SET_FADE_SPEED:
-		blinkm_set_fade_speed(ba->_led[led_index], ba->_fade_speed);
+		result = blinkm_set_fade_speed(bus, ba->_led[led_index], ba->_fade_speed);
 		break;
 
 	case CMD_SET_TIME_ADJUST:
-		blinkm_set_time_adjust(ba->_led[led_index], (int8_t) ba->_time_adjust);
+		result = blinkm_set_time_adjust(bus, ba->_led[led_index], (int8_t) ba->_time_adjust);
 		break;
 
 	case CMD_SET_ADDRESS:
-		blinkm_set_address(ba->_led[led_index]);
+		result = blinkm_set_address(bus, ba->_led[led_index]);
+		break;
+
+	case CMD_RESYNC:
+		if (!bus->_cache) 
+			break;
+
+		rgb = result = blinkm_cache_resync(bus, ba->_led[led_index]);
+
+		if (rgb >= 0) 
+			printf("Led %d resynced to rgb(%d, %d, %d)\n", ba->_led[led_index],
+					(rgb >> 16) & 0xff, (rgb >> 8) & 0xff, rgb & 0xff);
+
 		break;
 
 	case CMD_READ_SCRIPT:
@@ -547,24 +1283,149 @@ void run_led_command(struct blinkm_args *ba, int led_index)
 		 * Have to stop the script first or the leds sometimes stop talking
 		 *  and hangs the whole i2c bus, i.e. sda never comes high again 
 	         */
-		if (blinkm_stop_script(ba->_led[led_index]) > 0) 
-			read_script(ba->_led[led_index]);
+		result = blinkm_stop_script(bus, ba->_led[led_index]);
+
+		if (result > 0) 
+			read_script(bus, ba->_led[led_index]);
 		
 		break;
 
 	case CMD_WRITE_SCRIPT_LINE:
-		blinkm_write_script_line(ba->_led[led_index], ba->_line_no, &ba->_script_line);
+		result = blinkm_write_script_line(bus, ba->_led[led_index], ba->_line_no, &ba->_script_line);
 		break;
 	}
+
+	return result < 0 ? -1 : 0;
 }
 
-void run_command(struct blinkm_args *ba) 
+/*
+ * The opcode and arguments of the commands that are the same for every led.
+ * Return 0 if the command isn't one of those.
+ */
+int get_write_only_cmd(struct blinkm_args *ba, uint8_t *cmd, uint8_t *args)
 {
-	int i;
+	args[0] = args[1] = args[2] = 0;
+
+	switch (ba->_cmd) {
+	case CMD_SET_RGB:
+	case CMD_FADE_RGB:
+	case CMD_FADE_RANDOM_RGB:
+		args[0] = ba->_red;
+		args[1] = ba->_green;
+		args[2] = ba->_blue;
+
+		if (ba->_cmd == CMD_SET_RGB)
+			*cmd = SET_RGB_COLOR_NOW;
+		else if (ba->_cmd == CMD_FADE_RGB)
+			*cmd = FADE_TO_RGB_COLOR;
+		else
+			*cmd = FADE_TO_RANDOM_RGB_COLOR;
+
+		break;
+
+	case CMD_FADE_HSB:
+	case CMD_FADE_RANDOM_HSB:
+		args[0] = ba->_hue;
+		args[1] = ba->_saturation;
+		args[2] = ba->_brightness;
+
+		if (ba->_cmd == CMD_FADE_HSB)
+			*cmd = FADE_TO_HSB_COLOR;
+		else
+			*cmd = FADE_TO_RANDOM_HSB_COLOR;
+
+		break;
+
+	case CMD_PLAY_SCRIPT:
+		*cmd = PLAY_LIGHT_SCRIPT;
+		args[0] = ba->_script_id;
+		args[1] = ba->_num_repeats;
+		break;
+
+	case CMD_STOP_SCRIPT:
+		*cmd = STOP_SCRIPT;
+		break;
+
+	case CMD_SET_FADE_SPEED:
+		*cmd = SET_FADE_SPEED;
+		args[0] = ba->_fade_speed;
+		break;
+
+	case CMD_SET_TIME_ADJUST:
+		*cmd = SET_TIME_ADJUST;
+		args[0] = (int8_t) ba->_time_adjust;
+		break;
+
+	default:
+		return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Return 0 if the command can't be batched and should be run one led at a time,
+ * -1 if it didn't reach every led.
+ */
+int run_batch_command(struct i2c_session *bus, struct blinkm_args *ba)
+{
+	struct blinkm_batch batch;
+	uint8_t cmd, args[3];
+	int i, written, suppressed;
+
+	if (!get_write_only_cmd(ba, &cmd, args))
+		return 0;
+
+	blinkm_batch_init(&batch);
+
+	for (i = 0; i < ba->_num_leds; i++) 
+		blinkm_batch_add(&batch, ba->_led[i], cmd, args[0], args[1], args[2]);
+
+	suppressed = bus->_cache ? bus->_cache->_suppressed : 0;
+
+	written = blinkm_batch_send(bus, &batch);
+
+	if (bus->_cache)
+		suppressed = bus->_cache->_suppressed - suppressed;
+
+	return written + suppressed < batch._count ? -1 : 1;
+}
+
+/*
+ * -d all, one general call write with unicast for the devices that miss it.
+ */
+int run_broadcast(struct i2c_session *bus, struct blinkm_args *ba)
+{
+	struct blinkm_broadcast_stats stats;
+	uint8_t cmd, args[3];
+
+	if (!get_write_only_cmd(ba, &cmd, args) || !blinkm_can_broadcast(cmd)) {
+		printf("%s can't be sent to all leds\n", commands[ba->_cmd]._cmd);
+		return -1;
+	}
+
+	if (blinkm_broadcast(bus, cmd, args[0], args[1], args[2], &stats) < 0) {
+		fprintf(stderr, "Broadcast failed on %s\n", bus->_bus);
+		return -1;
+	}
+
+	if (stats._unicast > 0 || stats._failed > 0)
+		printf("Broadcast %s, %d of %d leds sent by address, %d failed\n", 
+			stats._acked ? "acked" : "not acked", stats._unicast, 
+			stats._devices, stats._failed);
+
+	return stats._failed > 0 ? -1 : 0;
+}
+
+int run_command(struct i2c_session *bus, struct blinkm_args *ba) 
+{
+	int i, result;
+
+	result = 0;
 
 	switch (ba->_cmd) {
 	case CMD_FIND_LEDS:
-		scan_bus_for_leds();
+		result = scan_bus_for_leds(bus, ba);
 		break;
 
 	case CMD_SHOW_SCRIPTS:
@@ -576,10 +1437,53 @@ void run_command(struct blinkm_args *ba)
 		printf("\n");
 		break;
 
+	case CMD_CLIENT:
+		break;
+
+	case CMD_STREAM:
+		result = run_stream(bus, ba);
+		break;
+
+	case CMD_WRITE_SCRIPT:
+		result = run_write_script(bus, ba);
+		break;
+
+	case CMD_LOAD_SCRIPT:
+	case CMD_SYNC_SCRIPT:
+		result = run_sync_script(bus, ba);
+		break;
+
+	case CMD_CUES:
+		result = run_cues(bus, ba);
+		break;
+
+	case CMD_ANIMATE:
+		result = run_animate(bus, ba);
+		break;
+
+	case CMD_STATS:
+	case CMD_METRICS:
+		if (!bus || !bus->_stats)
+			printf("Bus statistics are kept by the daemon, try blinkm client %s\n", 
+				commands[ba->_cmd]._cmd);
+		else if (ba->_cmd == CMD_STATS) {
+			i2c_stats_print(stdout, bus->_stats, bus->_bus);
+			i2c_recovery_print(stdout, bus->_recovery, bus->_bus);
+		}
+		else {
+			print_metrics(bus, 1);
+		}
+
+		break;
+
 	case CMD_SHOW_USAGE:
 		printf("\nUsage: blinkm <command> <args>\n\n"
 			"The led address is optional and defaults to 0x09.\n"
 			"Use a comma separated list to address multiple devices in one command.\n"
+			"A list can have ranges like 1-127, group names and all-found.\n"
+			"Add @bus to a led for one on another bus, like 9@1 for /dev/i2c-1.\n"
+			"Use -d all to send a color, fade or script command to every led at once.\n"
+			"Any command takes -B bus to change the default bus.\n"
 			"The color arguments are optional and default to zero.\n"
 			"\nAvailable Commands\n");
 
@@ -590,18 +1494,469 @@ void run_command(struct blinkm_args *ba)
 		break;
 
 	default:
-		for (i = 0; i < ba->_num_leds; i++) 
-			run_led_command(ba, i);
+		if (ba->_all) {
+			result = run_broadcast(bus, ba);
+			break;
+		}
+
+		/* write-only commands to several leds go out in one transfer */
+		if (ba->_num_leds > 1) 
+			result = run_batch_command(bus, ba);
+
+		if (result != 0)
+			break;
+
+		for (i = 0; i < ba->_num_leds; i++) {
+			if (run_led_command(bus, ba, i) < 0)
+				result = -1;
+		}
 
 		break;
 	}
+
+	return result < 0 ? -1 : 0;
+}
+
+/*
+ * Frames come from -i, a file or fifo, or stdin by default.
+ */
+int run_stream(struct i2c_session *bus, struct blinkm_args *ba)
+{
+	struct blinkm_stream_stats stats;
+	uint8_t leds[MAX_LEDS_PER_CMD];
+	int i, fd, result;
+
+	for (i = 0; i < ba->_num_leds; i++) 
+		leds[i] = ba->_led[i];
+
+	if (ba->_input[0]) {
+		fd = open(ba->_input, O_RDONLY);
+
+		if (fd < 0) {
+			perror(ba->_input);
+			return -1;
+		}
+	}
+	else {
+		fd = STDIN_FILENO;
+	}
+
+	result = blinkm_stream_run(bus, fd, ba->_script_line._cmd, leds, ba->_num_leds, 
+			ba->_fade_speed, &stats);
+
+	if (fd != STDIN_FILENO)
+		close(fd);
+
+	fprintf(stderr, "Streamed %d frames in %.1f ms, %d sent, %d dropped, %d writes, %d unchanged, %d failed",
+			stats._frames, stats._msecs, stats._sent, stats._dropped, 
+			stats._writes, stats._suppressed, stats._failed);
+
+	if (stats._msecs > 0) 
+		fprintf(stderr, " (%.1f fps)", stats._sent * 1000.0 / stats._msecs);
+
+	fprintf(stderr, "\n");
+
+	return result < 0 || stats._failed > 0 ? -1 : 0;
+}
+
+/*
+ * Cue lines are a time in ms from the start and a command for leds on 
+ * the bus
+ *
+ *   0 set-rgb -d 1,2,3,4 -r 255
+ *   500 fade-rgb -d all -b 255
+ *
+ * The commands for one time go out together. The first cue is -w ms 
+ * after the file is read, 100 ms by default. Cues are added relative to
+ * zero and moved to the real start once the whole file is in.
+ */
+int run_cues(struct i2c_session *bus, struct blinkm_args *ba)
+{
+	struct blinkm_sched sched;
+	struct blinkm_args cue;
+	FILE *fp;
+	char line[256], *p, *end;
+	uint8_t cmd, args[3], found[128];
+	uint64_t start, at;
+	long ms;
+	int i, j, line_no, ok, num_found, complete;
+
+	if (ba->_input[0]) {
+		fp = fopen(ba->_input, "r");
+
+		if (!fp) {
+			perror(ba->_input);
+			return -1;
+		}
+	}
+	else {
+		fp = stdin;
+	}
+
+	blinkm_sched_init(&sched, bus);
+
+	ok = 1;
+	line_no = 0;
+
+	while (ok && fgets(line, sizeof(line), fp)) {
+		line_no++;
+
+		p = strchr(line, '#');
+
+		if (p)
+			*p = 0;
+
+		for (p = line; isspace(*p); p++)
+			;
+
+		if (!*p)
+			continue;
+
+		ms = strtol(p, &end, 0);
+
+		if (end == p || ms < 0) {
+			fprintf(stderr, "Line %d: no cue time\n", line_no);
+			ok = 0;
+			break;
+		}
+
+		at = (uint64_t) ms * 1000000;
+
+		if (!parse_command_line(end, &cue) || !get_write_only_cmd(&cue, &cmd, args)) {
+			fprintf(stderr, "Line %d: not a command that can be cued\n", line_no);
+			ok = 0;
+			break;
+		}
+
+		if (cue._all) {
+			if (!blinkm_can_broadcast(cmd)) {
+				fprintf(stderr, "Line %d: %s can't be sent to all leds\n", 
+					line_no, commands[cue._cmd]._cmd);
+				ok = 0;
+			}
+			else if (blinkm_sched_add(&sched, at, 0, cmd, args[0], args[1], args[2]) < 0) {
+				ok = 0;
+			}
+		}
+
+		for (i = 0; ok && i < cue._num_leds; i++) {
+			if (cue._led_bus[i] >= 0) {
+				fprintf(stderr, "Line %d: cued leds must be on %s\n", line_no, bus->_bus);
+				ok = 0;
+			}
+			else if (cue._led[i] == 0) {
+				/* all-found, the scan happens now rather than when the cue fires */
+				num_found = blinkm_find_leds(bus, found);
+
+				for (j = 0; ok && j < num_found; j++) {
+					if (blinkm_sched_add(&sched, at, found[j], cmd, args[0], args[1], args[2]) < 0)
+						ok = 0;
+				}
+			}
+			else if (blinkm_sched_add(&sched, at, cue._led[i], cmd, args[0], args[1], args[2]) < 0) {
+				ok = 0;
+			}
+		}
+	}
+
+	if (fp != stdin)
+		fclose(fp);
+
+	if (ok) {
+		start = monotonic_nsecs() + (uint64_t) (ba->_delay < 0 ? 100 : ba->_delay) * 1000000;
+
+		for (i = 0; i < sched._count; i++)
+			sched._cue[i]._at += start;
+
+		complete = blinkm_sched_run(&sched);
+
+		if (complete >= 0)
+			blinkm_sched_print(stdout, &sched, start);
+
+		ok = complete == sched._count;
+	}
+
+	blinkm_sched_free(&sched);
+
+	return ok ? 0 : -1;
+}
+
+/*
+ * Effects come from -i or stdin, see blinkm_anim_parse().
+ */
+int run_animate(struct i2c_session *bus, struct blinkm_args *ba)
+{
+	struct blinkm_anim anim;
+	struct blinkm_anim_stats stats;
+	uint8_t leds[MAX_LEDS_PER_CMD];
+	FILE *fp;
+	int i, result;
+
+	for (i = 0; i < ba->_num_leds; i++) 
+		leds[i] = ba->_led[i];
+
+	if (blinkm_anim_init(&anim, bus, leds, ba->_num_leds, ba->_fade_speed) < 0)
+		return -1;
+
+	if (ba->_input[0]) {
+		fp = fopen(ba->_input, "r");
+
+		if (!fp) {
+			perror(ba->_input);
+			return -1;
+		}
+	}
+	else {
+		fp = stdin;
+	}
+
+	result = blinkm_anim_parse(fp, &anim);
+
+	if (fp != stdin)
+		fclose(fp);
+
+	if (result < 1)
+		return -1;
+
+	if (blinkm_anim_run(&anim, &stats) < 0)
+		return -1;
+
+	printf("Animated %d frames in %.1f ms, %d late, %d writes, %d unchanged, %d failed, "
+		"%d device fades\n", stats._frames, stats._msecs, stats._late, stats._writes, 
+		stats._suppressed, stats._failed, stats._hardware);
+
+	return stats._failed > 0 ? -1 : 0;
+}
+
+/*
+ * Script lines come from -i or stdin, in any form blinkm_script_parse() 
+ * takes. -n overrides a repeats line in the file.
+ */
+int run_write_script(struct i2c_session *bus, struct blinkm_args *ba)
+{
+	struct blinkm_script script;
+	uint8_t leds[MAX_LEDS_PER_CMD];
+	uint64_t start;
+	int i, count, result;
+
+	if (ba->_input[0])
+		count = blinkm_script_load(ba->_input, &script);
+	else
+		count = blinkm_script_parse(stdin, &script);
+
+	if (count < 1) {
+		if (count == 0)
+			fprintf(stderr, "No script lines to write\n");
+
+		return -1;
+	}
+
+	for (i = 0; i < ba->_num_leds; i++) 
+		leds[i] = ba->_led[i];
+
+	start = monotonic_usecs();
+
+	result = blinkm_write_script(bus, leds, ba->_num_leds, script._line, count, 
+			ba->_repeats_set ? ba->_num_repeats : script._repeats, ba->_delay, NULL);
+
+	if (result >= 0)
+		printf("Wrote %d script lines to %d of %d leds in %.1f ms\n", count, result, 
+				ba->_num_leds, (monotonic_usecs() - start) / 1000.0);
+
+	return result < ba->_num_leds ? -1 : 0;
+}
+
+/*
+ * load-script and sync-script both only write what differs.
+ */
+int run_sync_script(struct i2c_session *bus, struct blinkm_args *ba)
+{
+	struct blinkm_script script;
+	struct blinkm_sync_stats stats;
+	uint8_t leds[MAX_LEDS_PER_CMD];
+	int i, result;
+
+	if (blinkm_script_load(ba->_input, &script) < 1) 
+		return -1;
+
+	for (i = 0; i < ba->_num_leds; i++) 
+		leds[i] = ba->_led[i];
+
+	result = blinkm_script_sync(bus, leds, ba->_num_leds, &script, 
+			ba->_repeats_set ? ba->_num_repeats : -1, ba->_delay, &stats);
+
+	if (result >= 0)
+		printf("Synced %d script lines on %d of %d leds in %.1f ms, "
+				"%d lines and %d lengths written\n", script._num_lines, result, 
+				ba->_num_leds, stats._msecs, stats._lines_written, stats._length_written);
+
+	return result < ba->_num_leds ? -1 : 0;
+}
+
+/*
+ * Split a line into arguments and parse them like a command line.
+ * Return 0 for an empty line, bad arguments leave the usage command.
+ */
+int parse_command_line(char *line, struct blinkm_args *ba)
+{
+	char *argv[64];
+	int argc;
+
+	argv[0] = "blinkm";
+	argc = 1;
+
+	argv[argc] = strtok(line, " \t\r\n");
+
+	while (argv[argc] && argc < 63) 
+		argv[++argc] = strtok(NULL, " \t\r\n");
+
+	argv[argc] = NULL;
+
+	if (argc < 2)
+		return 0;
+
+	if (!parse_args(argc, argv, ba)) 
+		ba->_cmd = CMD_SHOW_USAGE;
+	else if (!check_args(ba)) 
+		ba->_cmd = CMD_SHOW_USAGE;
+
+	return 1;
+}
+
+void run_command_line(char *line, void *ctx)
+{
+	struct blinkm_args ba;
+
+	if (!parse_command_line(line, &ba))
+		return;
+
+	if (!check_nested_command(&ba, "a client"))
+		return;
+
+	run_on_buses((struct bus_set *) ctx, &ba);
+}
+
+/*
+ * Commands run from a client or a command file can't start another 
+ * session and don't get stdin.
+ * Return 0 after saying why if the command can't be run.
+ */
+int check_nested_command(struct blinkm_args *ba, const char *from)
+{
+	if (ba->_cmd == CMD_DAEMON || ba->_cmd == CMD_CLIENT || ba->_cmd == CMD_RUN) {
+		printf("%s is not available from %s\n", commands[ba->_cmd]._cmd, from);
+		return 0;
+	}
+
+	if ((ba->_cmd == CMD_STREAM || ba->_cmd == CMD_WRITE_SCRIPT || ba->_cmd == CMD_CUES 
+			|| ba->_cmd == CMD_ANIMATE) && !ba->_input[0]) {
+		printf("%s needs a -i file when run from %s\n", commands[ba->_cmd]._cmd, from);
+		return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * blinkm run [-i file]
+ * Every line of the file, or stdin for none or -, is a command line as
+ * given to blinkm. They all run in this process with the buses opened 
+ * once. The time each line took goes to stderr.
+ * Return -1 if any line failed.
+ */
+int run_file(struct bus_set *set, struct blinkm_args *ba)
+{
+	struct blinkm_args line_ba;
+	FILE *fp;
+	char line[512], text[512], *p;
+	uint64_t start, line_start, usecs;
+	int line_no, count, failed;
+
+	if (ba->_input[0] && strcmp(ba->_input, "-")) {
+		fp = fopen(ba->_input, "r");
+
+		if (!fp) {
+			perror(ba->_input);
+			return -1;
+		}
+	}
+	else {
+		fp = stdin;
+	}
+
+	line_no = 0;
+	count = 0;
+	failed = 0;
+	start = monotonic_usecs();
+
+	while (fgets(line, sizeof(line), fp)) {
+		line_no++;
+
+		p = strchr(line, '#');
+
+		if (p)
+			*p = 0;
+
+		/* parsing splits the line up, keep it for the report */
+		snprintf(text, sizeof(text), "%s", line);
+		p = text + strlen(text);
+
+		while (p > text && (p[-1] == '\n' || p[-1] == '\r' || p[-1] == ' ' || p[-1] == '\t'))
+			*--p = 0;
+
+		line_start = monotonic_usecs();
+
+		if (!parse_command_line(line, &line_ba))
+			continue;
+
+		count++;
+
+		if (line_ba._cmd == CMD_SHOW_USAGE) {
+			fprintf(stderr, "Line %d: bad command: %s\n", line_no, text);
+			failed++;
+			continue;
+		}
+
+		if (!check_nested_command(&line_ba, "a command file") 
+				|| run_on_buses(set, &line_ba) < 0) 
+			failed++;
+
+		usecs = monotonic_usecs() - line_start;
+
+		fprintf(stderr, "%5d %10.3f ms  %s\n", line_no, usecs / 1000.0, text);
+	}
+
+	if (fp != stdin)
+		fclose(fp);
+
+	fprintf(stderr, "Ran %d commands in %.1f ms, %d failed\n", count, 
+		(monotonic_usecs() - start) / 1000.0, failed);
+
+	return failed ? -1 : 0;
+}
+
+/*
+ * blinkm client [-S socket] [<command> <args>]
+ * With no command, every line on stdin is sent to the daemon.
+ */
+int run_client(int argc, char **argv)
+{
+	char *path = NULL;
+	int first = 2;
+
+	if (argc > 3 && !strcmp(argv[2], "-S")) {
+		path = argv[3];
+		first = 4;
+	}
+
+	return blinkm_client_run(path, argc - first, argv + first);
 }
 
 /*
    ================================================================================================
    ================================================================================================
 */
-void read_script(uint8_t led)
+void read_script(struct i2c_session *bus, uint8_t led)
 {
 	int i;
 	struct script_line sline;
@@ -609,7 +1964,7 @@ void read_script(uint8_t led)
 	for (i = 0; i < MAX_SCRIPT_LINES; i++) { 
 		bzero(&sline, sizeof(sline));
 
-		if (blinkm_read_script_line(led, i, &sline) < 0) 
+		if (blinkm_read_script_line(bus, led, i, &sline) < 0) 
 			break;
 
 		if (sline._ticks == 255 && sline._cmd == 255) 
@@ -672,36 +2027,70 @@ void read_script(uint8_t led)
  * 'a'.'a' is a standard BlinkM = 0x6161
  * 'a'.'b' is a MaxM BlinkM = 0x6162
  */
-void scan_bus_for_leds()
+void print_scan(struct blinkm_scan *scan)
 {
-	int count, firmware;
+	int i;
 	uint8_t led;
 
-	count = 0;
-
-	printf("\nScanning I2C bus for BlinkM devices...\n");
+	printf("\nScanning I2C bus %s for BlinkM devices...\n", scan->_bus);
 
-	for (led = 1; led < 128; led++) {
-		firmware = blinkm_get_firmware_version(led, 0);
+	if (scan->_error) {
+		printf("Could not open %s\n\n", scan->_bus);
+		return;
+	}
 
-		if (firmware < 1)
-			continue;
+	for (i = 0; i < scan->_count; i++) {
+		led = scan->_addr[i];
 
-		if (BLINKM_DEVICE_FIRMWARE == firmware) 	
+		if (BLINKM_DEVICE_FIRMWARE == scan->_firmware[i]) 	
 			printf("Found a BlinkM at address %d (0x%02X)\n", led, led);
-		else if (MAXM_DEVICE_FIRMWARE == firmware) 
+		else if (MAXM_DEVICE_FIRMWARE == scan->_firmware[i]) 
 			printf("Found a MaxM BlinkM at address %d (0x%02X)\n", led, led);
 		else 
 			printf("Found an uknown device at address %d (0x%02X) : 0x%04X\n", 
-					led, led, firmware);
-			
-		count++;
-		
+					led, led, scan->_firmware[i]);
 	}
 
-	if (count == 1) 
-		printf("Found 1 device\n\n");
+	if (scan->_count == 1) 
+		printf("Found 1 device");
 	else 
-		printf("Found %d devices\n\n", count);
+		printf("Found %d devices", scan->_count);
+
+	printf(" (%d addresses acked, scan took %.1f ms)\n\n", scan->_acked, scan->_msecs);
 }
 
+int scan_bus_for_leds(struct i2c_session *bus, struct blinkm_args *ba)
+{
+	struct blinkm_scan scans[MAX_SCAN_BUSES];
+	int i, result;
+
+	if (ba->_num_buses == 0) {
+		memset(&scans[0], 0, sizeof(scans[0]));
+		strcpy(scans[0]._bus, bus->_bus);
+
+		if (blinkm_scan_bus(bus, &scans[0]) < 0)
+			scans[0]._error = 1;
+
+		print_scan(&scans[0]);
+		blinkm_inventory_update(scans, 1, 1);
+		return scans[0]._error ? -1 : 0;
+	}
+
+	memset(scans, 0, sizeof(scans));
+
+	for (i = 0; i < ba->_num_buses; i++) 
+		strcpy(scans[i]._bus, ba->_bus[i]);
+
+	blinkm_scan_buses(scans, ba->_num_buses);
+
+	for (i = 0, result = 0; i < ba->_num_buses; i++) {
+		print_scan(&scans[i]);
+
+		if (scans[i]._error)
+			result = -1;
+	}
+
+	blinkm_inventory_update(scans, ba->_num_buses, 1);
+
+	return result;
+}
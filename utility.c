@@ -26,6 +26,7 @@
 */
 
 
+#include <stdint.h>
 #include <time.h>
 
 /*
@@ -46,3 +47,32 @@ int msleep(int milliseconds)
 	return nanosleep(&ts, NULL);
 }
 
+
+/*
+  =============================================================================
+  Microseconds on the monotonic clock, only useful for intervals.
+  =============================================================================
+*/
+uint64_t monotonic_usecs()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t) ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+
+/*
+  =============================================================================
+  Nanoseconds on the monotonic clock, the clock the cue scheduler uses.
+  =============================================================================
+*/
+uint64_t monotonic_nsecs()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t) ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
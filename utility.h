@@ -33,6 +33,8 @@ extern "C" {
 #endif
 
 int msleep(int milliseconds);
+uint64_t monotonic_usecs();
+uint64_t monotonic_nsecs();
 
 #ifdef __cplusplus
 }